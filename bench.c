@@ -0,0 +1,259 @@
+// Universidade Presbiteriana Mackenzie – Computação Visual – Projeto 1 (SDL3)
+//
+// Benchmark dos kernels de imagem: gera imagens sintéticas de vários tamanhos e formatos de histograma,
+// mede cada kernel isolado (aquecimento + repetições) e imprime JSON com MPix/s e ns/pixel, para
+// acompanhar regressões entre versões. Os kernels são os do próprio main.c, incluído aqui sem o main().
+//
+// Compilação:
+//   gcc -std=c99 -O2 -Wall -Wextra -o bench.exe bench.c procimg.c $(pkg-config --cflags --libs sdl3 sdl3-image sdl3-ttf) -lm
+//
+// Execução:
+//   ./bench [repeticoes] > resultado.json
+
+#define PROJ_SEM_MAIN
+#if defined(__GNUC__) || defined(__clang__)
+#pragma GCC diagnostic ignored "-Wunused-function" // funções só usadas pela interface do main.c
+#endif
+#include "main.c"
+
+#define BENCH_AQUECIMENTO 3
+#define BENCH_REPETICOES_PADRAO 15
+
+typedef enum { SINT_PLANO, SINT_BIMODAL, SINT_CINZA, SINT_RUIDO } TipoSintetica;
+
+static const char* const NOMES_SINTETICAS[] = { "plano", "bimodal", "cinza", "ruido_colorido" };
+
+static const struct { int w, h; } TAMANHOS[] = { { 640, 480 }, { 1920, 1080 }, { 3840, 2160 } };
+
+// Gerador xorshift32: as imagens saem iguais em toda execução
+static uint32_t sorteio(uint32_t* estado) {
+    uint32_t x = *estado;
+    x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+    return *estado = x;
+}
+
+// plano: cinza com histograma uniforme; bimodal: cinza concentrado em dois picos;
+// cinza: degradê suave já em tons de cinza; ruido_colorido: RGB independente em cada pixel
+static SDL_Surface* gerar_sintetica(TipoSintetica tipo, int w, int h) {
+    SDL_Surface* s = SDL_CreateSurface(w, h, SDL_PIXELFORMAT_RGBA32);
+    if (!s) return NULL;
+    uint32_t estado = 0x9E3779B9u ^ (uint32_t)(tipo * 7919 + w * 31 + h);
+    for (int y = 0; y < h; y++) {
+        uint8_t* p = (uint8_t*)s->pixels + (size_t)y * s->pitch;
+        for (int x = 0; x < w; x++, p += 4) {
+            uint32_t r = sorteio(&estado);
+            uint8_t v;
+            switch (tipo) {
+            case SINT_PLANO:
+                v = (uint8_t)r;
+                p[0] = p[1] = p[2] = v;
+                break;
+            case SINT_BIMODAL:
+                v = (uint8_t)(((r >> 31) ? 192 : 64) + (int)((r & 31) + ((r >> 5) & 31)) - 31);
+                p[0] = p[1] = p[2] = v;
+                break;
+            case SINT_CINZA:
+                v = (uint8_t)((x + y) * 255 / (w + h - 2));
+                p[0] = p[1] = p[2] = v;
+                break;
+            case SINT_RUIDO:
+                p[0] = (uint8_t)r; p[1] = (uint8_t)(r >> 8); p[2] = (uint8_t)(r >> 16);
+                break;
+            }
+            p[3] = 255;
+        }
+    }
+    return s;
+}
+
+// Estado compartilhado pelos kernels de um caso (uma imagem sintética)
+typedef struct {
+    SDL_Surface* rgba;
+    ImagemLuma* luma;         // já convertida, entrada dos kernels de intensidade
+    ImagemLuma* dst;
+    uint64_t hist[256];
+    uint64_t total;
+    uint8_t lut[256];
+    ImagemLuma16 luma16;      // a mesma imagem em 16 bits (byte baixo sorteado)
+    uint8_t* lut16;           // redução 16 -> 8 bits pela equalização de 16 bits
+    volatile double sumidouro; // impede que resultados sem efeito colateral sejam descartados
+} EstadoBench;
+
+static void k_verifica_cinza(EstadoBench* e) {
+    e->sumidouro += verifica_se_imagem_e_cinza(e->rgba);
+}
+
+static void k_escala_de_cinza(EstadoBench* e) {
+    (void)aplicar_escala_de_cinza(e->rgba, e->dst);
+}
+
+static void k_carga_fundida(EstadoBench* e) {
+    uint64_t hist[256], total;
+    int era_cinza = 0;
+    ImagemLuma* img = imagem_luma_de_surface(e->rgba, hist, &total, &era_cinza);
+    e->sumidouro += era_cinza;
+    imagem_luma_destruir(img);
+}
+
+static void k_histograma(EstadoBench* e) {
+    calcular_histograma(e->luma, e->hist, &e->total);
+}
+
+static void k_matriz_mapeamento(EstadoBench* e) {
+    (void)criar_matriz_mapeamento_por_imagem(e->luma, e->lut);
+}
+
+static void k_equalizar(EstadoBench* e) {
+    (void)equalizar_com_lut(e->luma, e->dst, e->lut);
+}
+
+static void k_histograma16(EstadoBench* e) {
+    ProcimgImagem plano = plano16_procimg(&e->luma16);
+    (void)procimg_histograma16(&plano, e->luma16.hist);
+}
+
+static void k_reduzir16(EstadoBench* e) {
+    (void)reduzir_luma16(&e->luma16, e->lut16, e->dst, NULL);
+}
+
+// Chave do cache de resultados sobre os bytes RGBA (4 bytes por pixel, como um arquivo sem compressão)
+static void k_chave_cache(EstadoBench* e) {
+    e->sumidouro += (double)(cache_chave((const uint8_t*)e->rgba->pixels, (size_t)e->rgba->pitch * e->rgba->h) & 255);
+}
+
+static void k_estatisticas(EstadoBench* e) {
+    double media, desvio;
+    procimg_estatisticas(e->hist, &media, &desvio);
+    e->sumidouro += media + desvio;
+}
+
+// Versão de 16 bits da imagem de 8: o byte alto é a intensidade e o baixo é sorteado, como num sensor de
+// 16 bits, e a LUT de redução é a da equalização de 16 bits
+static int preparar_16_bits(EstadoBench* e) {
+    ImagemLuma16* l = &e->luma16;
+    l->w = e->luma->w;
+    l->h = e->luma->h;
+    l->stride = (l->w * 2 + 63) & ~63;
+    l->y = (uint16_t*)alocar_plano(l->stride, l->h);
+    l->hist = malloc(PROCIMG_BINS16 * sizeof(uint64_t));
+    e->lut16 = malloc(PROCIMG_BINS16);
+    uint16_t* lut = malloc(PROCIMG_BINS16 * sizeof(uint16_t));
+    if (!l->y || !l->hist || !e->lut16 || !lut) {
+        free(lut);
+        return -1;
+    }
+    uint32_t estado = 0x2545F491u;
+    for (int y = 0; y < l->h; y++) {
+        const uint8_t* s = e->luma->y + (size_t)y * e->luma->stride;
+        uint16_t* d = (uint16_t*)((uint8_t*)l->y + (size_t)y * l->stride);
+        for (int x = 0; x < l->w; x++) d[x] = (uint16_t)(s[x] << 8 | (sorteio(&estado) & 255));
+    }
+    ProcimgImagem plano = plano16_procimg(l);
+    (void)procimg_histograma16(&plano, l->hist);
+    procimg_lut_equalizacao16(l->hist, lut);
+    lut16_para_8(lut, e->lut16);
+    free(lut);
+    return 0;
+}
+
+typedef struct {
+    const char* nome;
+    void (*rodar)(EstadoBench* e);
+} KernelBench;
+
+static const KernelBench KERNELS[] = {
+    { "verifica_se_imagem_e_cinza", k_verifica_cinza },
+    { "aplicar_escala_de_cinza", k_escala_de_cinza },
+    { "imagem_luma_de_surface", k_carga_fundida },
+    { "calcular_histograma", k_histograma },
+    { "criar_matriz_mapeamento_por_imagem", k_matriz_mapeamento },
+    { "equalizar_com_lut", k_equalizar },
+    { "procimg_histograma16", k_histograma16 },
+    { "reduzir_luma16", k_reduzir16 },
+    { "cache_chave", k_chave_cache },
+    { "procimg_estatisticas", k_estatisticas },
+};
+
+static int comparar_double(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char* argv[]) {
+    int repeticoes = argc >= 2 ? atoi(argv[1]) : BENCH_REPETICOES_PADRAO;
+    if (repeticoes < 1) {
+        fprintf(stderr, "Uso: %s [repeticoes]\n", argv[0]);
+        return 1;
+    }
+    if (!SDL_Init(0)) {
+        fprintf(stderr, "Erro ao inicializar SDL: %s\n", SDL_GetError());
+        return 1;
+    }
+    iniciar_procimg();
+
+    double* tempos = malloc((size_t)repeticoes * sizeof(double));
+    if (!tempos) {
+        SDL_Quit();
+        return 1;
+    }
+    double freq = (double)SDL_GetPerformanceFrequency();
+    int n_kernels = (int)(sizeof(KERNELS) / sizeof(KERNELS[0]));
+    int n_tamanhos = (int)(sizeof(TAMANHOS) / sizeof(TAMANHOS[0]));
+    int primeiro = 1, erro = 0;
+
+    printf("{\n  \"kernel_cinza\": \"%s\",\n  \"threads\": %d,\n  \"aquecimento\": %d,\n"
+           "  \"repeticoes\": %d,\n  \"resultados\": [",
+           procimg_kernel_cinza(), procimg_threads(), BENCH_AQUECIMENTO, repeticoes);
+
+    for (int t = 0; t < n_tamanhos && !erro; t++) {
+        for (int tipo = SINT_PLANO; tipo <= SINT_RUIDO && !erro; tipo++) {
+            int w = TAMANHOS[t].w, h = TAMANHOS[t].h;
+            EstadoBench e;
+            memset(&e, 0, sizeof(e));
+            e.rgba = gerar_sintetica((TipoSintetica)tipo, w, h);
+            e.luma = e.rgba ? imagem_luma_de_surface(e.rgba, e.hist, &e.total, NULL) : NULL;
+            e.dst = imagem_luma_criar(w, h, 0);
+            if (!e.luma || !e.dst) {
+                fprintf(stderr, "Erro: sem memória para a imagem %s %dx%d.\n", NOMES_SINTETICAS[tipo], w, h);
+                erro = 1;
+            }
+            if (!erro) procimg_lut_equalizacao(e.hist, e.lut);
+            if (!erro && preparar_16_bits(&e) != 0) {
+                fprintf(stderr, "Erro: sem memória para a imagem de 16 bits %dx%d.\n", w, h);
+                erro = 1;
+            }
+
+            for (int k = 0; k < n_kernels && !erro; k++) {
+                for (int i = 0; i < BENCH_AQUECIMENTO; i++) KERNELS[k].rodar(&e);
+                for (int i = 0; i < repeticoes; i++) {
+                    Uint64 t0 = SDL_GetPerformanceCounter();
+                    KERNELS[k].rodar(&e);
+                    tempos[i] = (double)(SDL_GetPerformanceCounter() - t0) / freq;
+                }
+                qsort(tempos, (size_t)repeticoes, sizeof(double), comparar_double);
+                double mediana = tempos[repeticoes / 2];
+                double pixels = (double)w * (double)h;
+                if (mediana <= 0.0) mediana = 1e-9;
+
+                printf("%s\n    {\"kernel\": \"%s\", \"imagem\": \"%s\", \"w\": %d, \"h\": %d, "
+                       "\"ms_mediana\": %.4f, \"ms_min\": %.4f, \"ns_por_pixel\": %.4f, \"mpix_s\": %.2f}",
+                       primeiro ? "" : ",", KERNELS[k].nome, NOMES_SINTETICAS[tipo], w, h,
+                       mediana * 1e3, tempos[0] * 1e3, mediana * 1e9 / pixels, pixels / 1e6 / mediana);
+                primeiro = 0;
+            }
+
+            liberar_plano((uint8_t*)e.luma16.y, e.luma16.stride, h);
+            free(e.luma16.hist);
+            free(e.lut16);
+            imagem_luma_destruir(e.dst);
+            imagem_luma_destruir(e.luma);
+            if (e.rgba) SDL_DestroySurface(e.rgba);
+        }
+    }
+    printf("\n  ]\n}\n");
+
+    free(tempos);
+    procimg_encerrar();
+    SDL_Quit();
+    return erro;
+}
@@ -9,11 +9,28 @@
 // - Nome: João Pedro Mascaro Baccelli - RA: 10224004
 //
 // Compilação:
-//   gcc -std=c99 -O2 -Wall -Wextra -o main.exe main.c $(pkg-config --cflags --libs sdl3 sdl3-image sdl3-ttf) -lm
+//   gcc -std=c99 -O2 -Wall -Wextra -o main.exe main.c procimg.c $(pkg-config --cflags --libs sdl3 sdl3-image sdl3-ttf) -lm
 //
 // Execução:
-//   ./main caminho/para/imagem.png
+//   ./main caminho/para/imagem.png [--trace trace.json]   (T mostra os tempos por etapa; S salva, F troca o formato,
+//                                                         M troca o ajuste do controle deslizante; botão direito
+//                                                         arrastando seleciona uma região, B troca os bins dela)
+//   ./main caminho/para/imagem.png --clahe 8x8 [limite]   (abre no CLAHE; [ ] mudam o limite, G a grade)
+//   ./main caminho/para/imagem16.pgm   (PGM de 16 bits: medido e equalizado em 16 bits, reduzido só para exibir)
+//   ./main mosaico_gigante.ppm   (as janelas abrem com uma prévia enquanto a carga segue em segundo plano)
+//   PROJ1_CACHE=dir PROJ1_CACHE_MIB=1024 ./main imagem.png   (cache de resultados em disco; 0 MiB desliga)
+//   PROJ1_CACHE_LOTE=1 ./main --batch dir_entrada dir_saida qoi   (o lote também grava no cache)
+//   ./main --batch dir_entrada dir_saida [png|pgm|luma|qoi]   (sem janelas, um worker por núcleo)
+//   ./main --stream entrada.pgm saida.pgm [linhas_por_faixa]   (imagens maiores que a memória)
+//   ./main --seq dir_entrada|- dir_saida|- [png|pgm|luma|qoi]   (quadros numerados ou Y4M em stdin/stdout)
+//   ./main --servidor /tmp/proj1.sock   (residente; pedidos por socket UNIX, sem janelas)
 
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L // mmap, ftruncate e posix_madvise com -std=c99
+#endif
+#if defined(__linux__) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE // madvise(MADV_HUGEPAGE) do pool de buffers
+#endif
 #include <stdio.h>
 #include <stdint.h> // Usada para tipos inteiros de tamanho fixo
 #include <stdlib.h>
@@ -24,6 +41,7 @@
 #include <SDL3/SDL.h>
 #include <SDL3_image/SDL_image.h>
 #include <SDL3_ttf/SDL_ttf.h>
+#include "procimg.h" // núcleo de processamento (escala de cinza, histograma, equalização, pool de threads)
 
 static TTF_Font* open_ui_font(int pt) {
     char local1[1024] = {0};
@@ -105,44 +123,133 @@ static void place_side_window(SDL_Window *win_main, SDL_Window *win_side, int si
 }
 
 
-// Gera o histograma e conta o total de pixels
-static void calcular_histograma(SDL_Surface* img, uint32_t hist[256], uint64_t* total_pixels) {
-    memset(hist, 0, 256 * sizeof(uint32_t));
-    *total_pixels = 0;
+//-------------------------------------------------------------------------------------------------------------------------
+// Medição por etapa: cronômetros com SDL_GetPerformanceCounter em volta de cada etapa da carga e do render.
+// O último valor de cada etapa vai para o log (as etapas de quadro só no resumo final), para o overlay da
+// janela do histograma e, com --trace, para um JSON no formato de trace do Chrome (chrome://tracing ou
+// Perfetto). Além da thread principal, a thread de carga mede as etapas da carga (com outro tid no trace).
 
-    if (!img || img->format != SDL_PIXELFORMAT_RGBA32) return;
+typedef enum {
+    ETAPA_ABRIR_ARQUIVO,
+    ETAPA_CACHE,
+    ETAPA_CARGA_MAPEADA,
+    ETAPA_IMG_LOAD,
+    ETAPA_CONVERTER_RGBA,
+    ETAPA_CINZA_E_HISTOGRAMA,
+    ETAPA_HISTOGRAMA,
+    ETAPA_MAPEAMENTO,
+    ETAPA_EQUALIZACAO,
+    ETAPA_REDUCAO_16,
+    ETAPA_CLAHE,
+    ETAPA_INDICE_ROI,
+    ETAPA_TEXTURAS,
+    ETAPA_RENDER_PRINCIPAL,   // daqui em diante as etapas se repetem a cada quadro
+    ETAPA_RENDER_HISTOGRAMA,
+    ETAPA_QUADRO,
+    N_ETAPAS
+} Etapa;
 
-    int w = img->w, h = img->h, pitch = img->pitch;
-    uint8_t* base = (uint8_t*)img->pixels;
+static const char* const NOMES_ETAPAS[N_ETAPAS] = {
+    "abrir arquivo", "cache", "carga mapeada", "IMG_Load", "SDL_ConvertSurface", "cinza + histograma", "histograma",
+    "mapeamento (LUT)", "equalizacao", "reducao 16 bits", "clahe", "indice ROI", "texturas", "render principal", "render histograma", "quadro"
+};
 
-    for (int y = 0; y < h; y++) {
-        uint8_t* row = base + y * pitch;
-        for (int x = 0; x < w; x++) {
-            uint8_t* p = row + x * 4;
-            uint8_t Y = p[0]; // RGBA32 e imagem em cinza: R=G=B
-            hist[Y]++;
-            (*total_pixels)++;
-        }
+#define QUADROS_MEDIA 120        // quadros na média móvel do overlay
+#define OVERLAY_INTERVALO_MS 250 // atualização do overlay quando não há eventos
+
+typedef struct {
+    Uint64 origem;                    // contador no início do programa (ts = 0 no trace)
+    double freq;
+    double ultimo_ms[N_ETAPAS];
+    double quadros_ms[QUADROS_MEDIA]; // anel com a duração dos últimos quadros
+    int n_quadros;
+    FILE* trace;
+    SDL_Mutex* trava_trace;           // a escrita no trace pode bloquear: mutex, não spinlock
+    int trace_eventos;
+    SDL_SpinLock trava;               // ultimo_ms e o anel de quadros, escritos também pela thread de carga
+    SDL_ThreadID thread_principal;
+} Medicoes;
+
+static Medicoes g_medicoes;
+
+static void medicoes_encerrar(void) {
+    if (g_medicoes.trace) {
+        fprintf(g_medicoes.trace, "\n]\n");
+        fclose(g_medicoes.trace);
+        g_medicoes.trace = NULL;
+        SDL_DestroyMutex(g_medicoes.trava_trace);
+        g_medicoes.trava_trace = NULL;
     }
 }
 
-// Calcula média e desvio padrão do histograma
-static void estatisticas_do_histograma(const uint32_t hist[256], uint64_t total,
-                                       double* media, double* desvio) {
-    if (total == 0) { *media = 0.0; *desvio = 0.0; return; }
-    double soma = 0.0;
-    for (int i = 0; i < 256; i++) soma += i * (double)hist[i];
-    double mu = soma / (double)total;
-    double var = 0.0;
-    for (int i = 0; i < 256; i++) {
-        double d = (double)i - mu;
-        var += d * d * (double)hist[i];
+// Zera as medições; com 'caminho_trace' também grava cada etapa no arquivo (fechado no exit)
+static int medicoes_iniciar(const char* caminho_trace) {
+    memset(&g_medicoes, 0, sizeof(g_medicoes));
+    g_medicoes.origem = SDL_GetPerformanceCounter();
+    g_medicoes.freq = (double)SDL_GetPerformanceFrequency();
+    g_medicoes.thread_principal = SDL_GetCurrentThreadID();
+    if (!caminho_trace) return 0;
+
+    g_medicoes.trace = fopen(caminho_trace, "w");
+    g_medicoes.trava_trace = g_medicoes.trace ? SDL_CreateMutex() : NULL;
+    if (!g_medicoes.trace || !g_medicoes.trava_trace) {
+        if (g_medicoes.trace) fclose(g_medicoes.trace);
+        g_medicoes.trace = NULL;
+        fprintf(stderr, "Erro: não foi possível criar '%s' (%s)\n", caminho_trace, strerror(errno));
+        return -1;
+    }
+    fprintf(g_medicoes.trace, "[");
+    atexit(medicoes_encerrar);
+    return 0;
+}
+
+static Uint64 medir_inicio(void) {
+    return SDL_GetPerformanceCounter();
+}
+
+// Fecha a medição de 'etapa' iniciada em 'inicio' e devolve a duração em ms
+static double medir_fim(Etapa etapa, Uint64 inicio) {
+    Uint64 fim = SDL_GetPerformanceCounter();
+    double ms = (double)(fim - inicio) * 1000.0 / g_medicoes.freq;
+    SDL_LockSpinlock(&g_medicoes.trava);
+    g_medicoes.ultimo_ms[etapa] = ms;
+    if (etapa == ETAPA_QUADRO) {
+        g_medicoes.quadros_ms[g_medicoes.n_quadros % QUADROS_MEDIA] = ms;
+        g_medicoes.n_quadros++;
+    }
+    SDL_UnlockSpinlock(&g_medicoes.trava);
+
+    if (etapa < ETAPA_RENDER_PRINCIPAL) SDL_Log("Tempo: %-20s %9.3f ms", NOMES_ETAPAS[etapa], ms);
+
+    if (g_medicoes.trace) {
+        char evento[256];
+        double ts_us = (double)(inicio - g_medicoes.origem) * 1e6 / g_medicoes.freq;
+        SDL_snprintf(evento, sizeof(evento), "\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,"
+                     "\"dur\":%.3f,\"pid\":1,\"tid\":%d}", NOMES_ETAPAS[etapa],
+                     etapa < ETAPA_RENDER_PRINCIPAL ? "carga" : "quadro", ts_us, ms * 1000.0,
+                     SDL_GetCurrentThreadID() == g_medicoes.thread_principal ? 1 : 2);
+        // A vírgula depende da ordem de escrita, então é decidida junto com ela
+        SDL_LockMutex(g_medicoes.trava_trace);
+        fprintf(g_medicoes.trace, "%s%s", g_medicoes.trace_eventos++ ? "," : "", evento);
+        SDL_UnlockMutex(g_medicoes.trava_trace);
+    }
+    return ms;
+}
+
+// Média e pior caso dos últimos QUADROS_MEDIA quadros
+static void medicoes_quadros(double* media_ms, double* max_ms) {
+    int n = g_medicoes.n_quadros < QUADROS_MEDIA ? g_medicoes.n_quadros : QUADROS_MEDIA;
+    double soma = 0.0, max = 0.0;
+    for (int i = 0; i < n; i++) {
+        soma += g_medicoes.quadros_ms[i];
+        if (g_medicoes.quadros_ms[i] > max) max = g_medicoes.quadros_ms[i];
     }
-    var /= (double)total;
-    *media = mu;
-    *desvio = sqrt(var);
+    *media_ms = n ? soma / n : 0.0;
+    *max_ms = max;
 }
 
+//-------------------------------------------------------------------------------------------------------------------------
+
 // Descrição da media da imagem baseado no histograma
 static const char* class_luminosidade(double media) {
     if (media < 85.0) return "escura";
@@ -157,8 +264,13 @@ static const char* class_contraste(double desvio) {
     return "baixo";
 }
 
-// Desenha histograma em uma área (retângulo) usando barras
-static void render_histograma(SDL_Renderer* r, SDL_FRect area, const uint32_t hist[256]) {
+// Modos do gráfico: barras lineares, barras em escala log (realça intensidades raras) ou barras + CDF
+typedef enum { HIST_LINEAR, HIST_LOG, HIST_CDF, N_MODOS_HISTOGRAMA } ModoHistograma;
+
+static const char* const NOMES_MODOS_HISTOGRAMA[N_MODOS_HISTOGRAMA] = { "linear", "log", "CDF" };
+
+// Desenha o gráfico em 'area' com as 256 barras em uma única chamada de SDL_RenderFillRects
+static void desenhar_histograma(SDL_Renderer* r, SDL_FRect area, const uint64_t hist[256], ModoHistograma modo) {
     SDL_SetRenderDrawColor(r, 30, 30, 40, 255);
     SDL_RenderFillRect(r, &area);
 
@@ -168,21 +280,171 @@ static void render_histograma(SDL_Renderer* r, SDL_FRect area, const uint32_t hi
     SDL_SetRenderDrawColor(r, 80, 80, 120, 255);
     SDL_RenderRect(r, &plot);
 
-    uint32_t maxv = 1;
-    for (int i = 0; i < 256; i++) if (hist[i] > maxv) maxv = hist[i];
+    uint64_t maxv = 1, total = 0;
+    for (int i = 0; i < 256; i++) {
+        if (hist[i] > maxv) maxv = hist[i];
+        total += hist[i];
+    }
+    double escala_log = log1p((double)maxv);
 
+    SDL_FRect barras[256];
     float wbar = plot.w / 256.0f;
     for (int i = 0; i < 256; i++) {
-        float x = plot.x + i * wbar;
-        float h = (hist[i] / (float)maxv) * (plot.h - 1.0f);
-        SDL_FRect bar = (SDL_FRect){ x, plot.y + plot.h - h, wbar, h };
-        SDL_SetRenderDrawColor(r, 120, 180, 240, 255);
-        SDL_RenderFillRect(r, &bar);
+        float frac = modo == HIST_LOG ? (float)(log1p((double)hist[i]) / escala_log) : hist[i] / (float)maxv;
+        float h = frac * (plot.h - 1.0f);
+        barras[i] = (SDL_FRect){ plot.x + i * wbar, plot.y + plot.h - h, wbar, h };
+    }
+    SDL_SetRenderDrawColor(r, 120, 180, 240, 255);
+    SDL_RenderFillRects(r, barras, 256);
+
+    if (modo == HIST_CDF && total > 0) {
+        SDL_FPoint cdf[256];
+        uint64_t acumulado = 0;
+        for (int i = 0; i < 256; i++) {
+            acumulado += hist[i];
+            cdf[i] = (SDL_FPoint){ plot.x + (i + 0.5f) * wbar,
+                                   plot.y + plot.h - 1.0f - (float)((double)acumulado / total) * (plot.h - 1.0f) };
+        }
+        SDL_SetRenderDrawColor(r, 250, 170, 60, 255);
+        SDL_RenderLines(r, cdf, 256);
+    }
+}
+
+// O gráfico fica pronto em uma textura alvo e só é redesenhado quando o histograma (versão), o modo ou o
+// tamanho da área mudam; nos demais quadros é só uma cópia da textura.
+typedef struct {
+    SDL_Texture* tex;
+    int w, h;
+    uint64_t versao;
+    ModoHistograma modo;
+    int valido;
+} CacheHistograma;
+
+static void cache_histograma_invalidar(CacheHistograma* c) {
+    c->valido = 0;
+}
+
+static void cache_histograma_destruir(CacheHistograma* c) {
+    if (c->tex) SDL_DestroyTexture(c->tex);
+    memset(c, 0, sizeof(*c));
+}
+
+// 'versao' deve mudar sempre que o conteúdo de 'hist' mudar
+static void render_histograma(SDL_Renderer* r, CacheHistograma* cache, SDL_FRect area, const uint64_t hist[256],
+                              uint64_t versao, ModoHistograma modo) {
+    int w = (int)area.w, h = (int)area.h;
+    if (!cache->tex || cache->w != w || cache->h != h) {
+        if (cache->tex) SDL_DestroyTexture(cache->tex);
+        cache->tex = SDL_CreateTexture(r, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_TARGET, w, h);
+        cache->w = w;
+        cache->h = h;
+        cache->valido = 0;
+    }
+    if (!cache->tex) {
+        // Renderer sem textura alvo: desenha direto
+        desenhar_histograma(r, area, hist, modo);
+        return;
+    }
+
+    if (!cache->valido || cache->versao != versao || cache->modo != modo) {
+        SDL_Texture* alvo_anterior = SDL_GetRenderTarget(r);
+        SDL_SetRenderTarget(r, cache->tex);
+        desenhar_histograma(r, (SDL_FRect){ 0, 0, (float)w, (float)h }, hist, modo);
+        SDL_SetRenderTarget(r, alvo_anterior);
+        cache->versao = versao;
+        cache->modo = modo;
+        cache->valido = 1;
     }
+    SDL_FRect dst = { area.x, area.y, (float)w, (float)h };
+    SDL_RenderTexture(r, cache->tex, NULL, &dst);
 }
 
 static TTF_Font* g_ui_font = NULL;
 
+// Cache de textos rasterizados: cada string vira textura uma única vez e é reaproveitada enquanto não
+// mudar. A chave é (renderer, fonte, cor, texto); com o cache cheio sai a entrada usada há mais tempo.
+#define CACHE_TEXTOS 64
+#define TEXTO_MAX 96
+
+typedef struct {
+    SDL_Renderer* r;
+    TTF_Font* fonte;
+    SDL_Color cor;
+    char texto[TEXTO_MAX];
+    SDL_Texture* tex;
+    float w, h;
+    Uint64 uso;          // relógio do último acesso
+} EntradaTexto;
+
+static EntradaTexto g_cache_textos[CACHE_TEXTOS];
+static Uint64 g_cache_textos_relogio = 0;
+
+static SDL_Texture* rasterizar_texto(SDL_Renderer* r, TTF_Font* fonte, const char* texto, SDL_Color cor,
+                                     float* w, float* h) {
+    SDL_Surface* s = TTF_RenderText_Blended(fonte, texto, strlen(texto), cor);
+    if (!s) return NULL;
+    SDL_Texture* tex = SDL_CreateTextureFromSurface(r, s);
+    if (tex) SDL_SetTextureBlendMode(tex, SDL_BLENDMODE_BLEND);
+    *w = (float)s->w;
+    *h = (float)s->h;
+    SDL_DestroySurface(s);
+    return tex;
+}
+
+// Textura do texto (NULL se não der para rasterizar); textos maiores que TEXTO_MAX não passam por aqui
+static EntradaTexto* texto_em_cache(SDL_Renderer* r, TTF_Font* fonte, const char* texto, SDL_Color cor) {
+    EntradaTexto* vitima = &g_cache_textos[0];
+    for (int i = 0; i < CACHE_TEXTOS; i++) {
+        EntradaTexto* e = &g_cache_textos[i];
+        if (e->tex && e->r == r && e->fonte == fonte && e->cor.r == cor.r && e->cor.g == cor.g &&
+            e->cor.b == cor.b && e->cor.a == cor.a && strcmp(e->texto, texto) == 0) {
+            e->uso = ++g_cache_textos_relogio;
+            return e;
+        }
+        if (!e->tex || (vitima->tex && e->uso < vitima->uso)) vitima = e;
+    }
+
+    if (vitima->tex) SDL_DestroyTexture(vitima->tex);
+    memset(vitima, 0, sizeof(*vitima));
+    SDL_Texture* tex = rasterizar_texto(r, fonte, texto, cor, &vitima->w, &vitima->h);
+    if (!tex) return NULL;
+    vitima->r = r;
+    vitima->fonte = fonte;
+    vitima->cor = cor;
+    SDL_strlcpy(vitima->texto, texto, sizeof(vitima->texto));
+    vitima->tex = tex;
+    vitima->uso = ++g_cache_textos_relogio;
+    return vitima;
+}
+
+// Libera as texturas do cache (antes de destruir os renderers ou fechar as fontes)
+static void cache_textos_limpar(void) {
+    for (int i = 0; i < CACHE_TEXTOS; i++) {
+        if (g_cache_textos[i].tex) SDL_DestroyTexture(g_cache_textos[i].tex);
+    }
+    memset(g_cache_textos, 0, sizeof(g_cache_textos));
+}
+
+// Desenha o texto com o canto superior esquerdo em (x, y); com centralizar, (x, y) é o centro
+static void render_texto(SDL_Renderer* r, TTF_Font* fonte, const char* texto, SDL_Color cor,
+                         float x, float y, int centralizar) {
+    if (!fonte || !texto || texto[0] == '\0') return;
+    SDL_Texture* tex;
+    float w, h;
+    SDL_Texture* temporaria = NULL;
+    if (strlen(texto) < TEXTO_MAX) {
+        EntradaTexto* e = texto_em_cache(r, fonte, texto, cor);
+        if (!e) return;
+        tex = e->tex; w = e->w; h = e->h;
+    } else {
+        tex = temporaria = rasterizar_texto(r, fonte, texto, cor, &w, &h);
+        if (!tex) return;
+    }
+    SDL_FRect dst = { centralizar ? x - w * 0.5f : x, centralizar ? y - h * 0.5f : y, w, h };
+    SDL_RenderTexture(r, tex, NULL, &dst);
+    if (temporaria) SDL_DestroyTexture(temporaria);
+}
+
 // Desenha um botão e retorna 1 para mudar de cor caso o mouse esteja sobre ele
 static int render_botao(SDL_Renderer* r, SDL_FRect rect, int hovered, int pressed, const char* rotulo_curto) {
     if (pressed) SDL_SetRenderDrawColor(r, 30, 70, 150, 255);
@@ -200,22 +462,7 @@ static int render_botao(SDL_Renderer* r, SDL_FRect rect, int hovered, int presse
     float cy = rect.y + rect.h * 0.5f;
     if (g_ui_font && rotulo_curto && rotulo_curto[0] != '\0') {
         SDL_Color fg = {240, 244, 255, 255};
-        SDL_Surface* surf = TTF_RenderText_Blended(g_ui_font, rotulo_curto, strlen(rotulo_curto), fg);
-        if (surf) {
-            SDL_Texture* tex = SDL_CreateTextureFromSurface(r, surf);
-            if (tex) {
-                SDL_SetTextureBlendMode(tex, SDL_BLENDMODE_BLEND);
-                SDL_FRect dst = {
-                    rect.x + (rect.w - (float)surf->w) * 0.5f,
-                    rect.y + (rect.h - (float)surf->h) * 0.5f,
-                    (float)surf->w,
-                    (float)surf->h
-                };
-                SDL_RenderTexture(r, tex, NULL, &dst);
-                SDL_DestroyTexture(tex);
-            }
-            SDL_DestroySurface(surf);
-        }
+        render_texto(r, g_ui_font, rotulo_curto, fg, cx, cy, 1);
     } else {
         SDL_RenderLine(r, cx - 20, cy, cx + 20, cy);
         SDL_RenderLine(r, cx, cy - 6, cx, cy + 6);
@@ -224,6 +471,57 @@ static int render_botao(SDL_Renderer* r, SDL_FRect rect, int hovered, int presse
     return hovered;
 }
 
+// Controle deslizante: trilho em 'rect', preenchido até 'valor' (0 a 1), com o rótulo começando em x_rotulo
+static void render_controle_deslizante(SDL_Renderer* r, SDL_FRect rect, double valor, int arrastando,
+                                       const char* rotulo, float x_rotulo) {
+    SDL_SetRenderDrawColor(r, 40, 40, 52, 255);
+    SDL_RenderFillRect(r, &rect);
+    SDL_FRect cheio = { rect.x, rect.y, (float)(rect.w * valor), rect.h };
+    SDL_SetRenderDrawColor(r, 40, 90, 190, 255);
+    SDL_RenderFillRect(r, &cheio);
+    SDL_SetRenderDrawColor(r, 15, 35, 70, 255);
+    SDL_RenderRect(r, &rect);
+
+    SDL_FRect pino = { cheio.x + cheio.w - 4.0f, rect.y - 4.0f, 8.0f, rect.h + 8.0f };
+    if (arrastando) SDL_SetRenderDrawColor(r, 255, 255, 255, 255);
+    else SDL_SetRenderDrawColor(r, 200, 210, 230, 255);
+    SDL_RenderFillRect(r, &pino);
+
+    if (g_ui_font && rotulo) {
+        SDL_Color fg = {230, 230, 240, 255};
+        render_texto(r, g_ui_font, rotulo, fg, x_rotulo, rect.y + rect.h * 0.5f - TTF_GetFontHeight(g_ui_font) * 0.5f, 0);
+    }
+}
+
+// Overlay com o último tempo de cada etapa e a média móvel dos quadros (tecla T)
+static void render_overlay_tempos(SDL_Renderer* r, TTF_Font* fonte, SDL_FRect area) {
+    if (!fonte) return;
+    char linhas[N_ETAPAS + 1][96];
+    int n = 0;
+    double ultimo_ms[N_ETAPAS];
+    SDL_LockSpinlock(&g_medicoes.trava);
+    memcpy(ultimo_ms, g_medicoes.ultimo_ms, sizeof(ultimo_ms));
+    SDL_UnlockSpinlock(&g_medicoes.trava);
+    for (int i = 0; i < ETAPA_QUADRO; i++) {
+        snprintf(linhas[n++], sizeof(linhas[0]), "%-20s %8.3f ms", NOMES_ETAPAS[i], ultimo_ms[i]);
+    }
+    double media = 0.0, max = 0.0;
+    medicoes_quadros(&media, &max);
+    snprintf(linhas[n++], sizeof(linhas[0]), "quadro: media %.2f ms, max %.2f ms", media, max);
+
+    float altura_linha = (float)TTF_GetFontHeight(fonte);
+    SDL_FRect fundo = { area.x, area.y, area.w, altura_linha * n + 8.0f };
+    SDL_SetRenderDrawBlendMode(r, SDL_BLENDMODE_BLEND);
+    SDL_SetRenderDrawColor(r, 0, 0, 0, 180);
+    SDL_RenderFillRect(r, &fundo);
+    SDL_SetRenderDrawBlendMode(r, SDL_BLENDMODE_NONE);
+
+    SDL_Color fg = {255, 220, 120, 255};
+    for (int i = 0; i < n; i++) {
+        render_texto(r, fonte, linhas[i], fg, area.x + 6.0f, area.y + 4.0f + altura_linha * i, 0);
+    }
+}
+
 // Retorna 1 se estiver em escala de cinza e 0 se não
 int verifica_se_imagem_e_cinza(SDL_Surface* img) {
     if (!img) return -1;
@@ -246,288 +544,4520 @@ int verifica_se_imagem_e_cinza(SDL_Surface* img) {
     return 1;
 }
 
-// Quando a imagem não é cinza, aplica tons de cinza nela
-int aplicar_escala_de_cinza(SDL_Surface* img) {
-    if (!img) return -1;
-    if (img->format != SDL_PIXELFORMAT_RGBA32) return -1;
+//-------------------------------------------------------------------------------------------------------------------------
+// Pool de buffers: toda a memória de imagem (planos de intensidade e alfa, surfaces RGBA da conversão,
+// histogramas parciais) sai de listas livres por classe de tamanho. Um buffer devolvido volta para a lista da
+// sua classe e é entregue à próxima imagem de tamanho parecido já com as páginas mapeadas, então o modo em
+// lote, a sequência e o servidor não repetem falhas de página nem fragmentam o heap a cada imagem.
+// São quatro classes por potência de 2 (no máximo 25% de sobra) a partir de 4 KiB. Buffers de 2 MiB ou mais
+// são alinhados a 2 MiB e, no Linux, marcados para huge pages, o que também alivia o TLB nas varreduras.
 
-    int w = img->w, h = img->h;
-    int pitch = img->pitch;
-    uint8_t* base = (uint8_t*)img->pixels;
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
 
-    for (int y = 0; y < h; y++) {
-        uint8_t* row = base + y * pitch;
-        for (int x = 0; x < w; x++) {
-            uint8_t* p = row + x * 4;
-            uint8_t R = p[0], G = p[1], B = p[2];
-            uint8_t Y = (uint8_t)(0.2125 * R + 0.7154 * G + 0.0721 * B); // fórmula usada a partir do PDF
-            p[0] = Y; p[1] = Y; p[2] = Y; // todos os pixels com a mesma intensidade para a escala de cinza
-        }
+#define BUFFERS_MENOR_CLASSE 12                     // 4 KiB
+#define BUFFERS_MAIOR_CLASSE 47                     // classes até 2^48 bytes
+#define BUFFERS_SUBCLASSES 4
+#define BUFFERS_N_CLASSES ((BUFFERS_MAIOR_CLASSE - BUFFERS_MENOR_CLASSE + 1) * BUFFERS_SUBCLASSES)
+#define BUFFERS_PAGINA_GRANDE ((size_t)2 << 20)
+#define BUFFERS_RETIDOS_MAX ((uint64_t)1 << 30)    // acima disso, o que volta é liberado para o sistema
+
+typedef struct BufferLivre {
+    struct BufferLivre* proximo;   // gravado no próprio buffer enquanto ele está livre
+} BufferLivre;
+
+typedef struct {
+    uint64_t acertos;              // pedidos atendidos por um buffer reaproveitado
+    uint64_t faltas;               // pedidos que alocaram no sistema
+    uint64_t bytes_em_uso;         // tamanho das classes entregues e ainda não devolvidas
+    uint64_t pico_bytes;
+    uint64_t bytes_retidos;        // nas listas livres
+} EstatisticasBuffers;
+
+typedef struct {
+    SDL_SpinLock trava;            // só protege as listas e os contadores; alocação e cópia ficam fora
+    BufferLivre* livres[BUFFERS_N_CLASSES];
+    EstatisticasBuffers est;
+} PoolBuffers;
+
+static PoolBuffers g_buffers;
+
+// Classe de um pedido de n bytes e o tamanho real dela; -1 se passar da maior classe
+static int buffer_classe(size_t n, size_t* tamanho) {
+    if (n < ((size_t)1 << BUFFERS_MENOR_CLASSE)) n = (size_t)1 << BUFFERS_MENOR_CLASSE;
+    int k = BUFFERS_MENOR_CLASSE;
+    while (k < BUFFERS_MAIOR_CLASSE + 1 && ((size_t)2 << k) <= n) k++;
+    if (k > BUFFERS_MAIOR_CLASSE) return -1;
+    size_t base = (size_t)1 << k, passo = base / BUFFERS_SUBCLASSES;
+    size_t j = (n - base + passo - 1) / passo;   // 0..4: o 4 é a primeira classe da potência seguinte
+    *tamanho = base + j * passo;
+    if (j == BUFFERS_SUBCLASSES) {
+        if (k == BUFFERS_MAIOR_CLASSE) return -1;
+        return (k + 1 - BUFFERS_MENOR_CLASSE) * BUFFERS_SUBCLASSES;
     }
-    return 0;
+    return (k - BUFFERS_MENOR_CLASSE) * BUFFERS_SUBCLASSES + (int)j;
 }
 
-// Structs para armazenar as intensidades e pixels de cada intensidade para a equalização
-typedef struct { uint8_t antigo, novo; } ParIntensidade;
-typedef struct { uint8_t intensidade; uint32_t quantidade; } ContagemIntensidade;
+// Buffer de pelo menos n bytes, alinhado a 64 (a 2 MiB nas classes grandes); devolver com buffer_devolver(p, n)
+static void* buffer_obter(size_t n) {
+    size_t tamanho;
+    int c = buffer_classe(n, &tamanho);
+    if (c < 0) return NULL;
 
-static int comparar_por_intensidade(const void* a, const void* b) {
-    const ContagemIntensidade* A = (const ContagemIntensidade*)a;
-    const ContagemIntensidade* B = (const ContagemIntensidade*)b;
-    return (int)A->intensidade - (int)B->intensidade;
-}
+    SDL_LockSpinlock(&g_buffers.trava);
+    BufferLivre* b = g_buffers.livres[c];
+    if (b) {
+        g_buffers.livres[c] = b->proximo;
+        g_buffers.est.acertos++;
+        g_buffers.est.bytes_retidos -= tamanho;
+    } else {
+        g_buffers.est.faltas++;
+    }
+    g_buffers.est.bytes_em_uso += tamanho;
+    if (g_buffers.est.bytes_em_uso > g_buffers.est.pico_bytes) g_buffers.est.pico_bytes = g_buffers.est.bytes_em_uso;
+    SDL_UnlockSpinlock(&g_buffers.trava);
+    if (b) return b;
 
-// Mapeia a intensidades de pixels baseado na distribuição cumulativa da imagem RGBA32
-size_t criar_matriz_mapeamento_por_imagem(SDL_Surface* imagem, ParIntensidade** saidaPares) {
-    if (!imagem || !saidaPares) return 0;
-    if (imagem->format != SDL_PIXELFORMAT_RGBA32) { *saidaPares = NULL; return 0; }
+    int grande = tamanho >= BUFFERS_PAGINA_GRANDE;
+    void* p = SDL_aligned_alloc(grande ? BUFFERS_PAGINA_GRANDE : 64, tamanho);
+    if (!p) {
+        SDL_LockSpinlock(&g_buffers.trava);
+        g_buffers.est.bytes_em_uso -= tamanho;
+        SDL_UnlockSpinlock(&g_buffers.trava);
+        return NULL;
+    }
+#if defined(MADV_HUGEPAGE)
+    if (grande) madvise(p, tamanho, MADV_HUGEPAGE);
+#endif
+    return p;
+}
 
-    ContagemIntensidade* listaContagens = NULL;
-    size_t quantidadeIntensidades = 0;
-    uint32_t totalPixels = 0;
+// Devolve um buffer de buffer_obter(n) (com o mesmo n) para a lista livre da classe
+static void buffer_devolver(void* p, size_t n) {
+    if (!p) return;
+    size_t tamanho;
+    int c = buffer_classe(n, &tamanho);
 
-    int w = imagem->w, h = imagem->h, pitch = imagem->pitch;
-    uint8_t* base = (uint8_t*)imagem->pixels;
+    SDL_LockSpinlock(&g_buffers.trava);
+    g_buffers.est.bytes_em_uso -= tamanho;
+    if (g_buffers.est.bytes_retidos + tamanho <= BUFFERS_RETIDOS_MAX) {
+        BufferLivre* b = (BufferLivre*)p;
+        b->proximo = g_buffers.livres[c];
+        g_buffers.livres[c] = b;
+        g_buffers.est.bytes_retidos += tamanho;
+        p = NULL;
+    }
+    SDL_UnlockSpinlock(&g_buffers.trava);
+    if (p) SDL_aligned_free(p);
+}
 
-    for (int y = 0; y < h; y++) {
-        uint8_t* row = base + y * pitch;
-        for (int x = 0; x < w; x++) {
-            uint8_t* px = row + x * 4;
-            uint8_t intensidade = px[0];
-
-            size_t i;
-            for (i = 0; i < quantidadeIntensidades; i++) {
-                if (listaContagens[i].intensidade == intensidade) {
-                    listaContagens[i].quantidade++;
-                    break;
-                }
-            }
-            if (i == quantidadeIntensidades) {
-                ContagemIntensidade* nova = realloc(listaContagens, (quantidadeIntensidades + 1) * sizeof(*listaContagens));
-                if (!nova) { free(listaContagens); *saidaPares = NULL; return 0; }
-                listaContagens = nova;
-                listaContagens[quantidadeIntensidades].intensidade = intensidade;
-                listaContagens[quantidadeIntensidades].quantidade  = 1;
-                quantidadeIntensidades++;
-            }
-            totalPixels++;
+// Libera para o sistema tudo o que está parado nas listas livres
+static void buffers_esvaziar(void) {
+    for (int c = 0; c < BUFFERS_N_CLASSES; c++) {
+        SDL_LockSpinlock(&g_buffers.trava);
+        BufferLivre* b = g_buffers.livres[c];
+        g_buffers.livres[c] = NULL;
+        SDL_UnlockSpinlock(&g_buffers.trava);
+        while (b) {
+            BufferLivre* proximo = b->proximo;
+            SDL_aligned_free(b);
+            b = proximo;
         }
     }
+    SDL_LockSpinlock(&g_buffers.trava);
+    g_buffers.est.bytes_retidos = 0;
+    SDL_UnlockSpinlock(&g_buffers.trava);
+}
+
+static EstatisticasBuffers buffers_estatisticas(void) {
+    SDL_LockSpinlock(&g_buffers.trava);
+    EstatisticasBuffers e = g_buffers.est;
+    SDL_UnlockSpinlock(&g_buffers.trava);
+    return e;
+}
+
+static void buffers_log(void) {
+    EstatisticasBuffers e = buffers_estatisticas();
+    uint64_t pedidos = e.acertos + e.faltas;
+    SDL_Log("Buffers: %llu pedido(s), %llu reaproveitado(s) (%.1f%%), %llu alocado(s); pico %.1f MiB, retidos %.1f MiB",
+            (unsigned long long)pedidos, (unsigned long long)e.acertos,
+            pedidos ? 100.0 * (double)e.acertos / (double)pedidos : 0.0, (unsigned long long)e.faltas,
+            (double)e.pico_bytes / (1024.0 * 1024.0), (double)e.bytes_retidos / (1024.0 * 1024.0));
+}
+
+// Surface RGBA32 cujos pixels vêm do pool (ou a própria surface carregada, se ela já for RGBA32)
+typedef struct {
+    SDL_Surface* s;
+    void* bloco;              // NULL quando os pixels não são do pool
+    size_t tamanho;
+} SurfaceRgba;
 
-    if (quantidadeIntensidades == 0) { *saidaPares = NULL; return 0; }
-    qsort(listaContagens, quantidadeIntensidades, sizeof(ContagemIntensidade), comparar_por_intensidade);
+// Converte para RGBA32 consumindo 'src' (destruída aqui). Formatos com paleta seguem pelo SDL_ConvertSurface.
+static int surface_rgba_de(SDL_Surface* src, SurfaceRgba* out) {
+    memset(out, 0, sizeof(*out));
+    if (!src) return -1;
+    if (src->format == SDL_PIXELFORMAT_RGBA32) {
+        out->s = src;
+        return 0;
+    }
+    if (SDL_ISPIXELFORMAT_INDEXED(src->format) || src->w <= 0 || src->h <= 0) {
+        out->s = SDL_ConvertSurface(src, SDL_PIXELFORMAT_RGBA32);
+        SDL_DestroySurface(src);
+        return out->s ? 0 : -1;
+    }
 
-    uint32_t somaAteAqui = 0, primeiraSoma = 0; int primeiraDef = 0;
-    for (size_t i = 0; i < quantidadeIntensidades; i++) {
-        somaAteAqui += listaContagens[i].quantidade;
-        if (!primeiraDef) { primeiraSoma = somaAteAqui; primeiraDef = 1; }
+    int pitch = (src->w * 4 + 63) & ~63;
+    out->tamanho = (size_t)pitch * (size_t)src->h;
+    out->bloco = buffer_obter(out->tamanho);
+    int ok = out->bloco && SDL_LockSurface(src);
+    if (ok) {
+        ok = SDL_ConvertPixels(src->w, src->h, src->format, src->pixels, src->pitch,
+                               SDL_PIXELFORMAT_RGBA32, out->bloco, pitch);
+        SDL_UnlockSurface(src);
     }
+    if (ok) ok = (out->s = SDL_CreateSurfaceFrom(src->w, src->h, SDL_PIXELFORMAT_RGBA32, out->bloco, pitch)) != NULL;
+    SDL_DestroySurface(src);
+    if (!ok) {
+        buffer_devolver(out->bloco, out->tamanho);
+        memset(out, 0, sizeof(*out));
+        return -1;
+    }
+    return 0;
+}
 
-    ParIntensidade* pares = malloc(quantidadeIntensidades * sizeof(*pares));
-    if (!pares) { free(listaContagens); *saidaPares = NULL; return 0; }
+static void surface_rgba_liberar(SurfaceRgba* r) {
+    if (r->s) SDL_DestroySurface(r->s);
+    buffer_devolver(r->bloco, r->tamanho);
+    memset(r, 0, sizeof(*r));
+}
 
-    if (totalPixels == 0 || primeiraSoma == totalPixels) {
-        for (size_t i = 0; i < quantidadeIntensidades; i++) {
-            pares[i].antigo = listaContagens[i].intensidade;
-            pares[i].novo   = listaContagens[i].intensidade;
-        }
-    } else {
-        somaAteAqui = 0;
-        for (size_t i = 0; i < quantidadeIntensidades; i++) {
-            somaAteAqui += listaContagens[i].quantidade;
-            double num = (double)((int64_t)somaAteAqui - (int64_t)primeiraSoma);
-            double den = (double)((int64_t)totalPixels   - (int64_t)primeiraSoma);
-            long val = lround((num / den) * 255.0);
-            if (val < 0) val = 0;
-            if (val > 255) val = 255;
-            pares[i].antigo = listaContagens[i].intensidade;
-            pares[i].novo   = (uint8_t)val;
-        }
+//-------------------------------------------------------------------------------------------------------------------------
+// Imagem interna: depois da conversão só existe a intensidade, então guardamos um plano de 8 bits por
+// pixel e, se a imagem tiver transparência, um plano de alfa separado. RGBA só é montado na hora de
+// enviar para uma textura ou gravar um formato colorido.
+
+typedef struct {
+    int w, h;
+    int stride;          // bytes por linha dos planos (>= w; múltiplo de 64 quando alocado aqui)
+    uint8_t* y;          // intensidade
+    uint8_t* a;          // alfa; NULL quando a imagem é totalmente opaca
+    uint8_t* bloco_y;    // memória alocada por esta imagem (NULL se o plano for externo)
+    uint8_t* bloco_a;
+    uint64_t versao;     // identifica o conteúdo atual; quem altera os pixels de uma imagem existente troca a versão
+} ImagemLuma;
+
+static SDL_AtomicInt g_versao_imagens;
+
+// Versões únicas no processo (0 fica para "sem versão")
+static uint64_t nova_versao_imagem(void) {
+    return (uint64_t)(uint32_t)SDL_AddAtomicInt(&g_versao_imagens, 1) + 1u;
+}
+
+static uint8_t* alocar_plano(int stride, int h) {
+    return buffer_obter((size_t)stride * (size_t)h);
+}
+
+static void liberar_plano(uint8_t* plano, int stride, int h) {
+    buffer_devolver(plano, (size_t)stride * (size_t)h);
+}
+
+static ImagemLuma* imagem_luma_criar(int w, int h, int com_alfa) {
+    if (w <= 0 || h <= 0) return NULL;
+    ImagemLuma* img = calloc(1, sizeof(*img));
+    if (!img) return NULL;
+    img->w = w;
+    img->h = h;
+    img->stride = (w + 63) & ~63;
+    img->versao = nova_versao_imagem();
+    img->bloco_y = img->y = alocar_plano(img->stride, h);
+    if (com_alfa) img->bloco_a = img->a = alocar_plano(img->stride, h);
+    if (!img->y || (com_alfa && !img->a)) {
+        liberar_plano(img->bloco_y, img->stride, h);
+        liberar_plano(img->bloco_a, img->stride, h);
+        free(img);
+        return NULL;
     }
+    return img;
+}
 
-    free(listaContagens);
-    *saidaPares = pares;
-    return quantidadeIntensidades;
+// Nova imagem do mesmo tamanho que 'modelo', compartilhando o plano de alfa dele ('modelo' deve viver mais)
+static ImagemLuma* imagem_luma_criar_como(const ImagemLuma* modelo) {
+    ImagemLuma* img = imagem_luma_criar(modelo->w, modelo->h, 0);
+    if (img) img->a = modelo->a;
+    return img;
 }
 
-// Equaliza tons de cinza por mapeamento usando os Structs
-int equalizar_com_matriz_linear(SDL_Surface* src, SDL_Surface* dst,
-                                const ParIntensidade* pares, size_t n) {
-    if (!src || !dst || (!pares && n > 0)) return -1;
-    if (src->format != SDL_PIXELFORMAT_RGBA32 || dst->format != SDL_PIXELFORMAT_RGBA32) return -1;
-    if (src->w != dst->w || src->h != dst->h) return -1;
+static void imagem_luma_destruir(ImagemLuma* img) {
+    if (!img) return;
+    liberar_plano(img->bloco_y, img->stride, img->h);
+    liberar_plano(img->bloco_a, img->stride, img->h);
+    free(img);
+}
 
-    int w = src->w, h = src->h;
-    int sp = src->pitch, dp = dst->pitch;
-    uint8_t* s = (uint8_t*)src->pixels;
-    uint8_t* d = (uint8_t*)dst->pixels;
+// Garante em *img um buffer opaco de w x h; o anterior é reaproveitado quando o tamanho não muda
+static int imagem_luma_reusar(ImagemLuma** img, int w, int h) {
+    if (*img && (*img)->w == w && (*img)->h == h && !(*img)->a) return 0;
+    imagem_luma_destruir(*img);
+    *img = imagem_luma_criar(w, h, 0);
+    return *img ? 0 : -1;
+}
 
-    for (int y = 0; y < h; y++) {
-        uint8_t* sr = s + y * sp;
-        uint8_t* dr = d + y * dp;
-        for (int x = 0; x < w; x++) {
-            uint8_t* ps = sr + x * 4;
-            uint8_t* pd = dr + x * 4;
-            uint8_t oldv = ps[0], newv = oldv;
+//-------------------------------------------------------------------------------------------------------------------------
+// Ligação com a procimg: os kernels (escala de cinza, histograma, LUT) e o pool de threads ficam na biblioteca;
+// aqui as imagens internas e as surfaces do SDL viram descritores ProcimgImagem, sem cópia.
 
-            for (size_t i = 0; i < n; i++) {
-                if (pares[i].antigo == oldv) { newv = pares[i].novo; break; }
-            }
+// Liga a biblioteca ao pool de buffers e registra o kernel escolhido (chamada no início de cada modo)
+static void iniciar_procimg(void) {
+    procimg_definir_alocador(buffer_obter, buffer_devolver);
+    SDL_Log("Kernel de escala de cinza: %s", procimg_kernel_cinza());
+}
 
-            pd[0] = newv; pd[1] = newv; pd[2] = newv; pd[3] = ps[3];
-        }
+// Plano de intensidade (ou de alfa) de uma ImagemLuma
+static ProcimgImagem plano_procimg(const ImagemLuma* img, uint8_t* plano) {
+    return procimg_imagem(plano, img->w, img->h, img->stride, PROCIMG_CINZA8);
+}
+
+// Copia um canal (0=R ... 3=A) de uma linha RGBA32 para um plano de 8 bits
+static void copiar_canal_linha(const uint8_t* src, int canal, uint8_t* dst, int w) {
+    for (int x = 0; x < w; x++) dst[x] = src[4 * x + canal];
+}
+
+// 1 se todos os alfas da linha forem 255
+static int linha_opaca(const uint8_t* alfa, int w) {
+    uint8_t acc = 0xFF;
+    for (int x = 0; x < w; x++) acc &= alfa[x];
+    return acc == 0xFF;
+}
+
+// Monta uma linha RGBA32 (R=G=B=Y) a partir dos planos; alfa NULL significa opaco
+static void expandir_linha_rgba(const uint8_t* y, const uint8_t* alfa, uint8_t* dst, int w) {
+    for (int x = 0; x < w; x++, dst += 4) {
+        dst[0] = y[x]; dst[1] = y[x]; dst[2] = y[x];
+        dst[3] = alfa ? alfa[x] : 255;
     }
+}
+
+// Converte a imagem RGBA32 para tons de cinza no plano de intensidade de 'dst' (e alfa, se houver)
+int aplicar_escala_de_cinza(SDL_Surface* img, ImagemLuma* dst) {
+    if (!img || !dst) return -1;
+    if (img->format != SDL_PIXELFORMAT_RGBA32) return -1;
+
+    ProcimgImagem src = procimg_imagem(img->pixels, img->w, img->h, img->pitch, PROCIMG_RGBA32);
+    ProcimgImagem y = plano_procimg(dst, dst->y);
+    ProcimgImagem a = plano_procimg(dst, dst->a);
+    if (procimg_escala_de_cinza(&src, &y, dst->a ? &a : NULL, NULL) != PROCIMG_OK) return -1;
+    dst->versao = nova_versao_imagem();
     return 0;
 }
 
 //-------------------------------------------------------------------------------------------------------------------------
+// Operações pontuais: toda transformação de intensidade é uma LUT de 256 entradas (saida = lut[entrada]).
+// Várias operações encadeadas são compostas em uma única LUT, então a imagem é percorrida uma só vez.
+// A conversão para cinza acontece na entrada, ao montar a ImagemLuma.
 
-int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        printf("Erro! É preciso passar a imagem ao executar!\n");
-        printf("Uso: %s caminho/para/imagem.png\n", argv[0]);
-        return 1;
-    }
-    const char* path = argv[1];
+static void lut_identidade(uint8_t lut[256]) {
+    for (int i = 0; i < 256; i++) lut[i] = (uint8_t)i;
+}
 
-    if (!SDL_Init(SDL_INIT_VIDEO)) {
-        printf("Erro ao inicializar SDL: %s\n", SDL_GetError());
-        return 1;
-    }
+// saida[i] = segunda[primeira[i]] (aplica 'primeira' e depois 'segunda'); 'saida' pode ser um dos operandos
+static void lut_compor(const uint8_t primeira[256], const uint8_t segunda[256], uint8_t saida[256]) {
+    uint8_t tmp[256];
+    for (int i = 0; i < 256; i++) tmp[i] = segunda[primeira[i]];
+    memcpy(saida, tmp, sizeof(tmp));
+}
 
-    SDL_SetLogPriority(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_DEBUG);
+// Cadeia de operações pontuais: a composição de todas as LUTs adicionadas até agora
+typedef struct {
+    uint8_t lut[256];
+} CadeiaPontual;
 
-    FILE *f = fopen(path, "rb");
-    if (!f) {
-        fprintf(stderr, "Erro: não foi possível abrir '%s' (%s)\n", path, strerror(errno));
-        SDL_Quit();
-        return 1;
-    }
-    fclose(f);
+static void cadeia_iniciar(CadeiaPontual* cadeia) {
+    lut_identidade(cadeia->lut);
+}
 
-    SDL_ClearError();
-    SDL_Surface* initial_img = IMG_Load(path);
-    if (!initial_img) {
-        fprintf(stderr,
-                "Erro: o arquivo não é uma imagem suportada ou está corrompido.\nDetalhe: %s\n",
-                SDL_GetError());
-        SDL_Quit();
-        return 1;
-    }
+static void cadeia_adicionar_lut(CadeiaPontual* cadeia, const uint8_t lut[256]) {
+    lut_compor(cadeia->lut, lut, cadeia->lut);
+}
 
-    SDL_Surface* img = SDL_ConvertSurface(initial_img, SDL_PIXELFORMAT_RGBA32);
-    SDL_DestroySurface(initial_img);
-    if (!img) {
-        fprintf(stderr, "Erro: falha ao converter para RGBA32: %s\n", SDL_GetError());
-        SDL_Quit();
-        return 1;
+// Aplica a cadeia em uma única passada: dst = lut[src]; src e dst podem ser a mesma imagem.
+// Só o plano de intensidade é tocado: o alfa não é uma intensidade.
+static int aplicar_cadeia_pontual(const ImagemLuma* src, ImagemLuma* dst, const CadeiaPontual* cadeia) {
+    if (!src || !dst || !cadeia) return -1;
+
+    ProcimgImagem s = plano_procimg(src, src->y);
+    ProcimgImagem d = plano_procimg(dst, dst->y);
+    if (procimg_aplicar_lut(&s, &d, cadeia->lut) != PROCIMG_OK) return -1;
+    dst->versao = nova_versao_imagem();
+    return 0;
+}
+
+//-------------------------------------------------------------------------------------------------------------------------
+// Histograma: a procimg soma sub-histogramas por faixa de linhas (os parciais vêm do pool de buffers)
+
+// Gera o histograma e conta o total de pixels
+static void calcular_histograma(const ImagemLuma* img, uint64_t hist[256], uint64_t* total_pixels) {
+    memset(hist, 0, 256 * sizeof(uint64_t));
+    *total_pixels = 0;
+    if (!img) return;
+
+    ProcimgImagem plano = plano_procimg(img, img->y);
+    if (procimg_histograma(&plano, hist) != PROCIMG_OK) return;
+    *total_pixels = (uint64_t)img->w * (uint64_t)img->h;
+}
+
+//-------------------------------------------------------------------------------------------------------------------------
+// Histogramas por versão de imagem: o histograma (e as estatísticas) de cada versão é calculado uma vez só.
+// Uma imagem gerada por LUT a partir de outra tem o histograma derivado do pai em O(256): todo pixel de
+// intensidade i vira lut[i], então o bin i do pai soma no bin lut[i] do filho, sem varrer a imagem.
+
+#define CACHE_HISTOGRAMAS 8
+
+typedef struct {
+    uint64_t versao;          // ImagemLuma.versao (0 = entrada livre)
+    uint64_t hist[256];
+    uint64_t total;
+    double media, desvio;
+} HistogramaImagem;
+
+typedef struct {
+    HistogramaImagem itens[CACHE_HISTOGRAMAS];
+    int proximo;              // entrada substituída na próxima inserção (a mais antiga)
+} CacheHistogramas;
+
+static HistogramaImagem* cache_histogramas_buscar(CacheHistogramas* c, uint64_t versao) {
+    if (versao == 0) return NULL;
+    for (int i = 0; i < CACHE_HISTOGRAMAS; i++) {
+        if (c->itens[i].versao == versao) return &c->itens[i];
     }
+    return NULL;
+}
 
-    if (img->w <= 0 || img->h <= 0) {
-        fprintf(stderr, "Erro: dimensões de imagem inválidas (%dx%d).\n", img->w, img->h);
-        SDL_DestroySurface(img);
-        SDL_Quit();
-        return 1;
+static const HistogramaImagem* cache_histogramas_guardar(CacheHistogramas* c, uint64_t versao,
+                                                         const uint64_t hist[256], uint64_t total) {
+    HistogramaImagem* h = cache_histogramas_buscar(c, versao);
+    if (!h) {
+        h = &c->itens[c->proximo];
+        c->proximo = (c->proximo + 1) % CACHE_HISTOGRAMAS;
     }
+    h->versao = versao;
+    memmove(h->hist, hist, sizeof(h->hist));
+    h->total = total;
+    procimg_estatisticas(h->hist, &h->media, &h->desvio);
+    return h;
+}
 
-    //garantir cinza na imagem
-    if (!SDL_LockSurface(img)) {
-        printf("Erro ao travar surface para escala de cinza: %s\n", SDL_GetError());
-        SDL_DestroySurface(img);
-        SDL_Quit();
-        return 1;
+// filho[lut[i]] += pai[i]: histograma de lut[imagem] a partir do histograma da imagem
+static void histograma_por_lut(const uint64_t pai[256], const uint8_t lut[256], uint64_t filho[256]) {
+    uint64_t tmp[256] = {0};
+    for (int i = 0; i < 256; i++) tmp[lut[i]] += pai[i];
+    memcpy(filho, tmp, sizeof(tmp));
+}
+
+// Histograma da versão 'versao_filho', gerada aplicando 'lut' a uma imagem com histograma 'pai': do cache ou
+// derivado do pai, sem varrer a imagem
+static const HistogramaImagem* cache_histogramas_derivar(CacheHistogramas* c, uint64_t versao_filho,
+                                                         const uint64_t pai[256], uint64_t total,
+                                                         const uint8_t lut[256]) {
+    const HistogramaImagem* h = cache_histogramas_buscar(c, versao_filho);
+    if (h) return h;
+    uint64_t hist[256];
+    histograma_por_lut(pai, lut, hist);
+    return cache_histogramas_guardar(c, versao_filho, hist, total);
+}
+
+// Histograma da versão atual de 'img': do cache ou, na falta, de uma varredura da imagem
+static const HistogramaImagem* histograma_da_imagem(CacheHistogramas* c, const ImagemLuma* img) {
+    const HistogramaImagem* h = cache_histogramas_buscar(c, img->versao);
+    if (h) return h;
+    uint64_t hist[256], total = 0;
+    calcular_histograma(img, hist, &total);
+    return cache_histogramas_guardar(c, img->versao, hist, total);
+}
+
+//-------------------------------------------------------------------------------------------------------------------------
+// Passada única de carregamento: para cada linha RGBA verifica se já é cinza, converte para o plano de
+// intensidade (ou só copia o canal R, se já for cinza), separa o alfa e soma no histograma enquanto a
+// linha ainda está na cache. Como a conversão mantém pixels que já são cinza (os coeficientes Q15
+// somam 1), o resultado é o mesmo de verificar e converter a imagem inteira.
+
+// 1 se todos os pixels da linha têm R=G=B
+static int linha_e_cinza(const uint8_t* p, int w) {
+    uint32_t diff = 0;
+    for (int x = 0; x < w; x++, p += 4) {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        diff |= (v ^ (v >> 8)) & 0xFFFFu;   // R^G nos bits 0-7, G^B nos bits 8-15
     }
-    int escalaCinza = verifica_se_imagem_e_cinza(img);
-    if(escalaCinza == 0){
-        aplicar_escala_de_cinza(img);
+    return diff == 0;
+}
+
+typedef struct {
+    const uint8_t* base;
+    int pitch;
+    ImagemLuma* dst;
+    int n_faixas;
+    ProcimgCinzaLinha cinza_linha;
+    ProcimgHistogramaParcial* parciais;   // um por faixa
+    int* faixa_colorida;           // 1 se a faixa tinha algum pixel colorido
+    int* faixa_transparente;       // 1 se a faixa tinha algum alfa diferente de 255
+} ContextoCarga;
+
+static void tarefa_carga(void* data, int faixa) {
+    ContextoCarga* ctx = (ContextoCarga*)data;
+    ImagemLuma* dst = ctx->dst;
+    int y0, y1;
+    procimg_faixa_linhas(dst->h, ctx->n_faixas, faixa, &y0, &y1);
+    ProcimgHistogramaParcial* parcial = &ctx->parciais[faixa];
+    memset(parcial, 0, sizeof(*parcial));
+
+    int colorida = 0, transparente = 0;
+    for (int y = y0; y < y1; y++) {
+        const uint8_t* row = ctx->base + (size_t)y * ctx->pitch;
+        uint8_t* ly = dst->y + (size_t)y * dst->stride;
+        uint8_t* la = dst->a + (size_t)y * dst->stride;
+        if (linha_e_cinza(row, dst->w)) {
+            copiar_canal_linha(row, 0, ly, dst->w);
+        } else {
+            ctx->cinza_linha(row, ly, dst->w);
+            colorida = 1;
+        }
+        copiar_canal_linha(row, 3, la, dst->w);
+        if (!transparente && !linha_opaca(la, dst->w)) transparente = 1;
+        procimg_histograma_linha(ly, dst->w, parcial);
     }
+    ctx->faixa_colorida[faixa] = colorida;
+    ctx->faixa_transparente[faixa] = transparente;
+}
 
-    int w = img->w, h = img->h;
-    SDL_UnlockSurface(img);
+// Monta a ImagemLuma a partir de uma surface RGBA32, garantindo o cinza e calculando o histograma na
+// mesma passada. '*era_cinza' recebe 1 se a imagem já era cinza. Retorna NULL em caso de erro.
+static ImagemLuma* imagem_luma_de_surface(SDL_Surface* rgba, uint64_t hist[256], uint64_t* total_pixels,
+                                          int* era_cinza) {
+    memset(hist, 0, 256 * sizeof(uint64_t));
+    *total_pixels = 0;
+    if (!rgba || rgba->format != SDL_PIXELFORMAT_RGBA32 || rgba->w <= 0 || rgba->h <= 0) return NULL;
 
-    //Cria matriz somente com intensidades presentes
-    ParIntensidade* matriz = NULL;
-    size_t linhas = criar_matriz_mapeamento_por_imagem(img, &matriz);
+    // O plano de alfa é preenchido junto e descartado no final se a imagem for opaca
+    ImagemLuma* img = imagem_luma_criar(rgba->w, rgba->h, 1);
+    if (!img) return NULL;
 
-    if (linhas == 0 || !matriz) {
-        printf("Erro: não foi possível criar a matriz de mapeamento.\n");
-        SDL_DestroySurface(img); SDL_Quit();
-        return 1;
+    ContextoCarga ctx;
+    ctx.base = (const uint8_t*)rgba->pixels;
+    ctx.pitch = rgba->pitch;
+    ctx.dst = img;
+    ctx.cinza_linha = procimg_cinza_linha(PROCIMG_RGBA32);
+    ctx.n_faixas = procimg_faixas(rgba->w, rgba->h);
+    ctx.parciais = procimg_parciais_alocar(ctx.n_faixas);
+    ctx.faixa_colorida = calloc((size_t)ctx.n_faixas, sizeof(int));
+    ctx.faixa_transparente = calloc((size_t)ctx.n_faixas, sizeof(int));
+    if (!ctx.parciais || !ctx.faixa_colorida || !ctx.faixa_transparente) {
+        procimg_parciais_liberar(ctx.parciais, ctx.n_faixas);
+        free(ctx.faixa_colorida);
+        free(ctx.faixa_transparente);
+        imagem_luma_destruir(img);
+        return NULL;
     }
 
-    SDL_Surface* eq = SDL_ConvertSurface(img, SDL_PIXELFORMAT_RGBA32);
-    if (!eq) {
-        printf("Erro ao criar cópia para equalização.\n");
-        free(matriz);
-        SDL_DestroySurface(img); SDL_Quit();
-        return 1;
+    procimg_paralelo_para(ctx.n_faixas, tarefa_carga, &ctx);
+
+    int cinza = 1, transparente = 0;
+    for (int f = 0; f < ctx.n_faixas; f++) {
+        if (ctx.faixa_colorida[f]) cinza = 0;
+        if (ctx.faixa_transparente[f]) transparente = 1;
     }
+    procimg_parciais_somar(ctx.parciais, ctx.n_faixas, hist);
+    *total_pixels = (uint64_t)img->w * (uint64_t)img->h;
+    if (era_cinza) *era_cinza = cinza;
 
-    if (!SDL_LockSurface(img) || !SDL_LockSurface(eq)) {
-        printf("Erro ao travar surfaces na equalização.\n");
-        SDL_DestroySurface(eq);
-        free(matriz);
-        SDL_DestroySurface(img); SDL_Quit();
-        return 1;
+    if (!transparente) {
+        liberar_plano(img->bloco_a, img->stride, img->h);
+        img->bloco_a = img->a = NULL;
     }
 
-    (void)equalizar_com_matriz_linear(img, eq, matriz, linhas);
+    procimg_parciais_liberar(ctx.parciais, ctx.n_faixas);
+    free(ctx.faixa_colorida);
+    free(ctx.faixa_transparente);
+    return img;
+}
 
-    SDL_UnlockSurface(eq);
-    SDL_UnlockSurface(img);
+// Mapeia as intensidades da imagem pela distribuição cumulativa, gerando a LUT de equalização
+int criar_matriz_mapeamento_por_imagem(const ImagemLuma* imagem, uint8_t lut[256]) {
+    if (!imagem || !lut) return -1;
 
-    {
-        //Janela principal
-        SDL_Window* win_main = SDL_CreateWindow("Proj1 - Principal (Imagem)",
-                                                w, h, SDL_WINDOW_RESIZABLE);
-        if (!win_main) {
-            printf("Erro ao criar janela principal: %s\n", SDL_GetError());
-            free(matriz);
-            SDL_DestroySurface(eq);
-            SDL_DestroySurface(img);
-            SDL_Quit();
-            return 1;
-        }
-        SDL_SetWindowPosition(win_main, SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED);
+    uint64_t hist[256];
+    uint64_t total = 0;
+    calcular_histograma(imagem, hist, &total);
+    if (total == 0) return -1;
 
-        SDL_Renderer* ren_main = SDL_CreateRenderer(win_main, NULL);
-        if (!ren_main) {
-            printf("Erro ao criar renderer principal: %s\n", SDL_GetError());
-            SDL_DestroyWindow(win_main);
-            free(matriz); SDL_DestroySurface(eq); SDL_DestroySurface(img); SDL_Quit(); return 1;
-        }
+    procimg_lut_equalizacao(hist, lut);
+    return 0;
+}
 
-        // texturas para original e equalizada
-        SDL_Texture* tex_orig = SDL_CreateTextureFromSurface(ren_main, img);
-        SDL_Texture* tex_eq   = SDL_CreateTextureFromSurface(ren_main, eq);
-        SDL_Texture* tex_atual = tex_orig;
+// Equaliza tons de cinza aplicando a LUT de mapeamento
+int equalizar_com_lut(const ImagemLuma* src, ImagemLuma* dst, const uint8_t lut[256]) {
+    CadeiaPontual cadeia;
+    cadeia_iniciar(&cadeia);
+    cadeia_adicionar_lut(&cadeia, lut);
+    return aplicar_cadeia_pontual(src, dst, &cadeia);
+}
 
-        // 2) Janela secundária (NORMAL) ao lado
-        const int SEC_W = 480;
-        const int SEC_H = 560;
+// Equalização adaptativa (CLAHE): grade de blocos e limite de corte, relativo à média de pixels por bin do bloco
+typedef struct {
+    int blocos_x, blocos_y;
+    double limite;
+} ParametrosClahe;
 
-        SDL_Window* win_sec = SDL_CreateWindow("Proj1 - Secundaria (Histograma)", SEC_W, SEC_H, 0);
-        if (!win_sec) {
-            printf("Erro ao criar janela secundária: %s\n", SDL_GetError());
-            SDL_DestroyTexture(tex_orig); SDL_DestroyTexture(tex_eq);
-            SDL_DestroyRenderer(ren_main); SDL_DestroyWindow(win_main);
-            free(matriz); SDL_DestroySurface(eq); SDL_DestroySurface(img); SDL_Quit(); return 1;
-        }
-        place_side_window(win_main, win_sec, SEC_W, SEC_H);
+#define CLAHE_BLOCOS_PADRAO 8
+#define CLAHE_LIMITE_PADRAO 2.0
 
-        SDL_Renderer* ren_sec = SDL_CreateRenderer(win_sec, NULL);
-        if (!ren_sec) {
-            printf("Erro ao criar renderer secundário: %s\n", SDL_GetError());
-            SDL_DestroyWindow(win_sec);
-            SDL_DestroyTexture(tex_orig); SDL_DestroyTexture(tex_eq);
-            SDL_DestroyRenderer(ren_main); SDL_DestroyWindow(win_main);
-            free(matriz); SDL_DestroySurface(eq); SDL_DestroySurface(img); SDL_Quit(); return 1;
-        }
+// CLAHE do plano de intensidade; o alfa de 'dst' não é tocado
+static int aplicar_clahe(const ImagemLuma* src, ImagemLuma* dst, const ParametrosClahe* p) {
+    if (!src || !dst || !p) return -1;
+
+    ProcimgImagem s = plano_procimg(src, src->y);
+    ProcimgImagem d = plano_procimg(dst, dst->y);
+    if (procimg_clahe(&s, &d, p->blocos_x, p->blocos_y, p->limite) != PROCIMG_OK) return -1;
+    dst->versao = nova_versao_imagem();
+    return 0;
+}
+
+// Ajuste contínuo da imagem equalizada (controle deslizante da janela do histograma): mistura entre a
+// original e a equalizada, ou equalização global com limite de corte. Os dois viram uma LUT de 256 entradas.
+typedef enum { AJUSTE_MISTURA, AJUSTE_CORTE, N_MODOS_AJUSTE } ModoAjuste;
+
+#define AJUSTE_CORTE_MAX 8.0   // no fim do controle cada bin é cortado em 8x a média por bin
+
+// LUT do ajuste com o controle em 'valor' (0 a 1): na mistura, 0 é a original e 1 a equalizada ('lut_eq');
+// no corte, o limite vai de 1x (contraste mínimo) a AJUSTE_CORTE_MAX x a média de pixels por bin
+static void lut_do_ajuste(const uint64_t hist[256], const uint8_t lut_eq[256], ModoAjuste modo, double valor,
+                          uint8_t lut[256]) {
+    if (modo == AJUSTE_MISTURA) {
+        for (int i = 0; i < 256; i++) lut[i] = (uint8_t)lround(i + valor * (lut_eq[i] - i));
+        return;
+    }
+
+    // Corta os bins acima do teto e redistribui o excesso por igual (o resto, um a um a partir do bin 0)
+    uint64_t total = 0;
+    for (int i = 0; i < 256; i++) total += hist[i];
+    double limite = 1.0 + valor * (AJUSTE_CORTE_MAX - 1.0);
+    uint64_t teto = (uint64_t)(limite * (double)total / 256.0);
+    if (teto < 1) teto = 1;
+    uint64_t cortado[256], excesso = 0;
+    for (int i = 0; i < 256; i++) {
+        cortado[i] = hist[i] > teto ? teto : hist[i];
+        excesso += hist[i] - cortado[i];
+    }
+    for (int i = 0; i < 256; i++) cortado[i] += excesso / 256 + ((uint64_t)i < excesso % 256);
+    procimg_lut_equalizacao(cortado, lut);
+}
+
+//-------------------------------------------------------------------------------------------------------------------------
+// Saída: RGBA só é montado aqui, ao enviar para a GPU ou gravar em disco
+
+// Pixel RGBA32 (R=G=B=lut[Y], A=255) de cada intensidade, já na ordem de bytes da textura: com a LUT
+// embutida, passar a imagem por uma LUT nova custa o mesmo que expandi-la
+typedef struct {
+    uint32_t px[256];
+} TabelaRgba;
+
+// lut NULL = identidade
+static void tabela_rgba(const uint8_t* lut, TabelaRgba* t) {
+    for (int i = 0; i < 256; i++) {
+        uint8_t v = lut ? lut[i] : (uint8_t)i;
+        uint8_t bytes[4] = { v, v, v, 255 };
+        memcpy(&t->px[i], bytes, 4);
+    }
+}
+
+// Escreve a região (x0, y0, w, h) dos planos em 'pixels' (RGBA32, 'pitch' bytes por linha) pela tabela
+static void escrever_regiao_rgba(const ImagemLuma* img, int x0, int y0, int w, int h, const TabelaRgba* t,
+                                 uint8_t* pixels, int pitch) {
+    for (int y = 0; y < h; y++) {
+        size_t linha = (size_t)(y0 + y) * img->stride + (size_t)x0;
+        const uint8_t* src = img->y + linha;
+        uint8_t* dst = pixels + (size_t)y * pitch;
+        for (int x = 0; x < w; x++) memcpy(dst + 4 * (size_t)x, &t->px[src[x]], 4);
+        if (img->a) {
+            const uint8_t* alfa = img->a + linha;
+            for (int x = 0; x < w; x++) dst[4 * (size_t)x + 3] = alfa[x];
+        }
+    }
+}
+
+// Cria uma textura RGBA32 (streaming, para poder ser reescrita) com a região (x0, y0, w, h) dos planos,
+// expandindo linha a linha direto na memória da textura; 't' NULL = sem LUT
+static SDL_Texture* textura_de_luma_regiao(SDL_Renderer* r, const ImagemLuma* img, int x0, int y0, int w, int h,
+                                           const TabelaRgba* t) {
+    SDL_Texture* tex = SDL_CreateTexture(r, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STREAMING, w, h);
+    if (!tex) return NULL;
+
+    void* pixels = NULL;
+    int pitch = 0;
+    if (!SDL_LockTexture(tex, NULL, &pixels, &pitch)) {
+        SDL_DestroyTexture(tex);
+        return NULL;
+    }
+    if (t) {
+        escrever_regiao_rgba(img, x0, y0, w, h, t, (uint8_t*)pixels, pitch);
+    } else {
+        for (int y = 0; y < h; y++) {
+            size_t linha = (size_t)(y0 + y) * img->stride + (size_t)x0;
+            const uint8_t* alfa = img->a ? img->a + linha : NULL;
+            expandir_linha_rgba(img->y + linha, alfa, (uint8_t*)pixels + (size_t)y * pitch, w);
+        }
+    }
+    SDL_UnlockTexture(tex);
+    SDL_SetTextureBlendMode(tex, img->a ? SDL_BLENDMODE_BLEND : SDL_BLENDMODE_NONE);
+    return tex;
+}
+
+static SDL_Texture* textura_de_luma(SDL_Renderer* r, const ImagemLuma* img) {
+    return textura_de_luma_regiao(r, img, 0, 0, img->w, img->h, NULL);
+}
+
+// Salva em PNG. Sem alfa, o plano de intensidade vira uma surface de 8 bits com paleta de cinza sem
+// cópia nenhuma; com alfa, monta uma surface RGBA32 temporária.
+static int salvar_luma_png(const ImagemLuma* img, const char* caminho) {
+    SDL_Surface* s = NULL;
+    if (!img->a) {
+        s = SDL_CreateSurfaceFrom(img->w, img->h, SDL_PIXELFORMAT_INDEX8, img->y, img->stride);
+        SDL_Palette* pal = s ? SDL_CreateSurfacePalette(s) : NULL;
+        if (!pal) {
+            if (s) SDL_DestroySurface(s);
+            return 0;
+        }
+        SDL_Color cores[256];
+        for (int i = 0; i < 256; i++) cores[i] = (SDL_Color){ (Uint8)i, (Uint8)i, (Uint8)i, 255 };
+        SDL_SetPaletteColors(pal, cores, 0, 256);
+    } else {
+        s = SDL_CreateSurface(img->w, img->h, SDL_PIXELFORMAT_RGBA32);
+        if (!s) return 0;
+        for (int y = 0; y < img->h; y++) {
+            expandir_linha_rgba(img->y + (size_t)y * img->stride, img->a + (size_t)y * img->stride,
+                                (uint8_t*)s->pixels + (size_t)y * s->pitch, img->w);
+        }
+    }
+    int ok = IMG_SavePNG(s, caminho);
+    SDL_DestroySurface(s);
+    return ok;
+}
+
+//-------------------------------------------------------------------------------------------------------------------------
+// Codificadores rápidos, sem zlib: QOI (sem perdas, uma passada, bem mais rápido que PNG) e PNG sem
+// compressão (blocos "stored" do deflate; o arquivo fica do tamanho dos pixels, mas é gravado na
+// velocidade do disco). O IMG_SavePNG continua sendo o PNG comprimido.
+
+static void be32_gravar(uint8_t* p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24); p[1] = (uint8_t)(v >> 16); p[2] = (uint8_t)(v >> 8); p[3] = (uint8_t)v;
+}
+
+// QOI: cinza vira RGB com r = g = b (ou RGBA com alfa); codificado linha a linha num buffer pequeno
+static int salvar_luma_qoi(const ImagemLuma* img, const char* caminho) {
+    FILE* f = fopen(caminho, "wb");
+    uint8_t* saida = malloc((size_t)img->w * 5 + 8);   // pior caso: QOI_OP_RGBA em todos os pixels
+    if (!f || !saida) {
+        if (f) fclose(f);
+        free(saida);
+        return SDL_SetError("não foi possível criar '%s' (%s)", caminho, strerror(errno));
+    }
+    uint8_t cab[14] = { 'q', 'o', 'i', 'f' };
+    be32_gravar(cab + 4, (uint32_t)img->w);
+    be32_gravar(cab + 8, (uint32_t)img->h);
+    cab[12] = img->a ? 4 : 3;
+    cab[13] = 0;
+    int ok = fwrite(cab, 1, sizeof(cab), f) == sizeof(cab);
+
+    uint8_t indice_y[64] = {0}, indice_a[64] = {0};   // tabela de cores vistas (r = g = b = y)
+    uint8_t ant_y = 0, ant_a = 255;
+    int corrida = 0;
+    for (int y = 0; y < img->h && ok; y++) {
+        const uint8_t* ly = img->y + (size_t)y * img->stride;
+        const uint8_t* la = img->a ? img->a + (size_t)y * img->stride : NULL;
+        uint8_t* o = saida;
+        for (int x = 0; x < img->w; x++) {
+            uint8_t v = ly[x], a = la ? la[x] : 255;
+            if (v == ant_y && a == ant_a) {
+                if (++corrida == 62) { *o++ = (uint8_t)(0xc0 | (corrida - 1)); corrida = 0; }
+                continue;
+            }
+            if (corrida) { *o++ = (uint8_t)(0xc0 | (corrida - 1)); corrida = 0; }
+            int h = (v * 15 + a * 11) % 64;                  // hash do QOI com r = g = b
+            if (indice_y[h] == v && indice_a[h] == a) {
+                *o++ = (uint8_t)h;
+            } else {
+                indice_y[h] = v;
+                indice_a[h] = a;
+                int d = (int8_t)(uint8_t)(v - ant_y);
+                if (a != ant_a) {
+                    *o++ = 0xff; *o++ = v; *o++ = v; *o++ = v; *o++ = a;
+                } else if (d >= -2 && d <= 1) {
+                    *o++ = (uint8_t)(0x40 | (d + 2) << 4 | (d + 2) << 2 | (d + 2));
+                } else if (d >= -32 && d <= 31) {
+                    *o++ = (uint8_t)(0x80 | (d + 32)); *o++ = 0x88;   // dr - dg = db - dg = 0
+                } else {
+                    *o++ = 0xfe; *o++ = v; *o++ = v; *o++ = v;
+                }
+            }
+            ant_y = v;
+            ant_a = a;
+        }
+        if (y == img->h - 1) {
+            static const uint8_t FIM_QOI[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+            if (corrida) *o++ = (uint8_t)(0xc0 | (corrida - 1));
+            memcpy(o, FIM_QOI, sizeof(FIM_QOI));
+            o += sizeof(FIM_QOI);
+        }
+        ok = fwrite(saida, 1, (size_t)(o - saida), f) == (size_t)(o - saida);
+    }
+    free(saida);
+    if (fclose(f) != 0) ok = 0;
+    return ok ? 1 : SDL_SetError("falha ao gravar '%s' (%s)", caminho, strerror(errno));
+}
+
+// Fluxo do IDAT de um PNG sem compressão: blocos stored de até 65535 bytes, com CRC e Adler-32 contínuos
+typedef struct {
+    FILE* f;
+    uint32_t tabela_crc[256];
+    uint32_t crc;
+    uint32_t adler_a, adler_b;
+    uint64_t restante;        // bytes de pixels (com o byte de filtro de cada linha) ainda não escritos
+    uint32_t restante_bloco;
+    int ok;
+} PngSemCompressao;
+
+static void png_escrever(PngSemCompressao* p, const uint8_t* dados, size_t n) {
+    uint32_t c = p->crc;
+    for (size_t i = 0; i < n; i++) c = p->tabela_crc[(c ^ dados[i]) & 0xff] ^ (c >> 8);
+    p->crc = c;
+    if (p->ok && fwrite(dados, 1, n, p->f) != n) p->ok = 0;
+}
+
+static void png_chunk_inicio(PngSemCompressao* p, uint32_t tamanho, const char* tipo) {
+    uint8_t b[4];
+    be32_gravar(b, tamanho);
+    if (p->ok && fwrite(b, 1, 4, p->f) != 4) p->ok = 0;
+    p->crc = 0xffffffffu;
+    png_escrever(p, (const uint8_t*)tipo, 4);
+}
+
+static void png_chunk_fim(PngSemCompressao* p) {
+    uint8_t b[4];
+    be32_gravar(b, p->crc ^ 0xffffffffu);
+    if (p->ok && fwrite(b, 1, 4, p->f) != 4) p->ok = 0;
+}
+
+// Bytes de pixels do fluxo zlib: abre um bloco stored quando o anterior acaba
+static void png_pixels(PngSemCompressao* p, const uint8_t* dados, size_t n) {
+    while (n > 0) {
+        if (p->restante_bloco == 0) {
+            uint32_t len = p->restante > 65535 ? 65535 : (uint32_t)p->restante;
+            uint8_t cab[5] = { (uint8_t)(len == p->restante), (uint8_t)len, (uint8_t)(len >> 8),
+                               (uint8_t)~len, (uint8_t)(~len >> 8) };
+            png_escrever(p, cab, sizeof(cab));
+            p->restante_bloco = len;
+        }
+        size_t k = n < p->restante_bloco ? n : p->restante_bloco;
+        for (size_t i = 0; i < k; i += 5552) {   // 5552: maior trecho sem estourar antes do módulo
+            size_t fim = i + 5552 < k ? i + 5552 : k;
+            for (size_t j = i; j < fim; j++) {
+                p->adler_a += dados[j];
+                p->adler_b += p->adler_a;
+            }
+            p->adler_a %= 65521u;
+            p->adler_b %= 65521u;
+        }
+        png_escrever(p, dados, k);
+        p->restante_bloco -= (uint32_t)k;
+        p->restante -= k;
+        dados += k;
+        n -= k;
+    }
+}
+
+// PNG cinza (ou cinza + alfa) de 8 bits, filtro "None" em todas as linhas e deflate sem compressão
+static int salvar_luma_png_sem_compressao(const ImagemLuma* img, const char* caminho) {
+    int canais = img->a ? 2 : 1;
+    uint64_t linha = 1 + (uint64_t)img->w * canais;
+    uint64_t dados = linha * (uint64_t)img->h;
+    uint64_t blocos = (dados + 65534) / 65535;
+    uint64_t idat = 2 + blocos * 5 + dados + 4;
+    if (idat > 0x7fffffffu) return SDL_SetError("imagem grande demais para um PNG sem compressão");
+
+    PngSemCompressao p;
+    memset(&p, 0, sizeof(p));
+    uint8_t* buf = malloc((size_t)linha);
+    p.f = fopen(caminho, "wb");
+    if (!p.f || !buf) {
+        if (p.f) fclose(p.f);
+        free(buf);
+        return SDL_SetError("não foi possível criar '%s' (%s)", caminho, strerror(errno));
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        p.tabela_crc[i] = c;
+    }
+    p.ok = 1;
+
+    static const uint8_t ASSINATURA[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    if (fwrite(ASSINATURA, 1, sizeof(ASSINATURA), p.f) != sizeof(ASSINATURA)) p.ok = 0;
+    uint8_t ihdr[13];
+    be32_gravar(ihdr, (uint32_t)img->w);
+    be32_gravar(ihdr + 4, (uint32_t)img->h);
+    ihdr[8] = 8;                      // bits por canal
+    ihdr[9] = img->a ? 4 : 0;         // cinza + alfa ou cinza
+    ihdr[10] = ihdr[11] = ihdr[12] = 0;
+    png_chunk_inicio(&p, sizeof(ihdr), "IHDR");
+    png_escrever(&p, ihdr, sizeof(ihdr));
+    png_chunk_fim(&p);
+
+    png_chunk_inicio(&p, (uint32_t)idat, "IDAT");
+    static const uint8_t ZLIB[2] = { 0x78, 0x01 };
+    png_escrever(&p, ZLIB, sizeof(ZLIB));
+    p.adler_a = 1;
+    p.restante = dados;
+    buf[0] = 0;                       // filtro None
+    for (int y = 0; y < img->h && p.ok; y++) {
+        const uint8_t* ly = img->y + (size_t)y * img->stride;
+        if (img->a) {
+            const uint8_t* la = img->a + (size_t)y * img->stride;
+            for (int x = 0; x < img->w; x++) { buf[1 + 2 * x] = ly[x]; buf[2 + 2 * x] = la[x]; }
+        } else {
+            memcpy(buf + 1, ly, (size_t)img->w);
+        }
+        png_pixels(&p, buf, (size_t)linha);
+    }
+    uint8_t adler[4];
+    be32_gravar(adler, p.adler_b << 16 | p.adler_a);
+    png_escrever(&p, adler, sizeof(adler));
+    png_chunk_fim(&p);
+
+    png_chunk_inicio(&p, 0, "IEND");
+    png_chunk_fim(&p);
+
+    free(buf);
+    if (fclose(p.f) != 0) p.ok = 0;
+    return p.ok ? 1 : SDL_SetError("falha ao gravar '%s' (%s)", caminho, strerror(errno));
+}
+
+//-------------------------------------------------------------------------------------------------------------------------
+// Exibição em ladrilhos: a imagem vira uma pirâmide de níveis (cada um com metade da resolução do anterior)
+// cortados em ladrilhos de LADRILHO x LADRILHO. Só os ladrilhos visíveis do nível adequado ao zoom são
+// enviados para a GPU, então imagens maiores que a textura máxima do renderer também abrem. Os níveis
+// reduzidos são construídos sob demanda em uma thread de fundo; enquanto isso aparece uma prévia feita
+// por amostragem na abertura.
+
+#define LADRILHO 512
+#define PIRAMIDE_NIVEIS_MAX 24
+#define LADRILHOS_MAX_TEXTURAS 96   // texturas vivas por pirâmide (~1 MiB cada)
+#define LADRILHOS_POR_QUADRO 6      // envios por quadro; o resto fica para os quadros seguintes
+#define ZOOM_MAX 32.0
+
+typedef struct {
+    const ImagemLuma* src;
+    ImagemLuma* dst;
+    int n_faixas;
+} ContextoReducao;
+
+static void reduzir_linha(const uint8_t* l0, const uint8_t* l1, uint8_t* dst, int w_src, int w_dst) {
+    for (int x = 0; x < w_dst; x++) {
+        int x0 = 2 * x, x1 = x0 + 1 < w_src ? x0 + 1 : x0;
+        dst[x] = (uint8_t)((l0[x0] + l0[x1] + l1[x0] + l1[x1] + 2) >> 2);
+    }
+}
+
+static void tarefa_reducao(void* data, int faixa) {
+    ContextoReducao* ctx = (ContextoReducao*)data;
+    const ImagemLuma* s = ctx->src;
+    ImagemLuma* d = ctx->dst;
+    int y0, y1;
+    procimg_faixa_linhas(d->h, ctx->n_faixas, faixa, &y0, &y1);
+    for (int y = y0; y < y1; y++) {
+        size_t l0 = (size_t)(2 * y) * s->stride;
+        size_t l1 = (size_t)(2 * y + 1 < s->h ? 2 * y + 1 : 2 * y) * s->stride;
+        size_t ld = (size_t)y * d->stride;
+        reduzir_linha(s->y + l0, s->y + l1, d->y + ld, s->w, d->w);
+        if (d->a) reduzir_linha(s->a + l0, s->a + l1, d->a + ld, s->w, d->w);
+    }
+}
+
+// Metade da resolução (arredondando para cima), com média de blocos 2x2
+static ImagemLuma* imagem_luma_reduzir(const ImagemLuma* src) {
+    ImagemLuma* dst = imagem_luma_criar((src->w + 1) / 2, (src->h + 1) / 2, src->a != NULL);
+    if (!dst) return NULL;
+    ContextoReducao ctx;
+    ctx.src = src;
+    ctx.dst = dst;
+    ctx.n_faixas = procimg_faixas(dst->w, dst->h);
+    procimg_paralelo_para(ctx.n_faixas, tarefa_reducao, &ctx);
+    return dst;
+}
+
+// Amostragem por vizinho mais próximo: lê só w*h pixels, então é instantânea mesmo em imagens enormes
+static ImagemLuma* imagem_luma_amostrar(const ImagemLuma* src, int w, int h) {
+    ImagemLuma* dst = imagem_luma_criar(w, h, src->a != NULL);
+    if (!dst) return NULL;
+    for (int y = 0; y < h; y++) {
+        size_t ls = (size_t)((int64_t)y * src->h / h) * src->stride;
+        uint8_t* dy = dst->y + (size_t)y * dst->stride;
+        uint8_t* da = dst->a ? dst->a + (size_t)y * dst->stride : NULL;
+        for (int x = 0; x < w; x++) {
+            size_t xs = (size_t)((int64_t)x * src->w / w);
+            dy[x] = src->y[ls + xs];
+            if (da) da[x] = src->a[ls + xs];
+        }
+    }
+    return dst;
+}
+
+typedef struct {
+    SDL_Texture* tex;         // NULL enquanto não foi enviado
+    Uint64 uso;               // último quadro em que foi desenhado
+    Uint32 geracao;           // geração da LUT com que a textura foi escrita
+} Ladrilho;
+
+typedef struct {
+    ImagemLuma* plano;        // o nível 0 é a própria imagem (não pertence à pirâmide)
+    int colunas, linhas;
+    Ladrilho* ladrilhos;      // alocado na primeira vez que o nível é exibido
+} NivelPiramide;
+
+typedef struct {
+    const ImagemLuma* fonte;
+    int n_niveis;
+    NivelPiramide niveis[PIRAMIDE_NIVEIS_MAX];
+    ImagemLuma* previa;       // nível mais reduzido, amostrado na abertura
+    SDL_Texture* tex_previa;
+    Uint32 geracao_previa;
+    int n_texturas;
+    Uint64 quadro;
+
+    // LUT aplicada na exibição: trocar a LUT só reescreve as texturas dos ladrilhos visíveis
+    TabelaRgba tabela;
+    Uint32 geracao;
+
+    // Construção em segundo plano: tudo abaixo é protegido por 'mutex'
+    SDL_Thread* thread;
+    SDL_Mutex* mutex;
+    SDL_Condition* cond;
+    int pedido;               // construir os níveis até este
+    int construidos;          // níveis 1..construidos prontos
+    int encerrar;
+} Piramide;
+
+static Uint32 g_evento_piramide = 0;   // enviado pela thread de fundo quando um nível fica pronto
+
+static int thread_piramide(void* data) {
+    Piramide* p = (Piramide*)data;
+    SDL_LockMutex(p->mutex);
+    for (;;) {
+        while (!p->encerrar && p->construidos >= p->pedido) SDL_WaitCondition(p->cond, p->mutex);
+        if (p->encerrar) break;
+        int k = p->construidos + 1;
+        SDL_UnlockMutex(p->mutex);
+
+        // O nível k-1 já está pronto e não muda mais: pode ser lido sem o mutex
+        ImagemLuma* nivel = imagem_luma_reduzir(p->niveis[k - 1].plano);
+
+        SDL_LockMutex(p->mutex);
+        if (!nivel) {
+            SDL_Log("Pirâmide: sem memória para o nível %d; a prévia continua sendo usada.", k);
+            break;
+        }
+        p->niveis[k].plano = nivel;
+        p->construidos = k;
+        if (g_evento_piramide) {
+            SDL_Event ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.type = g_evento_piramide;
+            SDL_PushEvent(&ev);
+        }
+    }
+    SDL_UnlockMutex(p->mutex);
+    return 0;
+}
+
+// Monta a estrutura dos níveis, a prévia e a thread de construção; os níveis reduzidos só saem quando pedidos
+static int piramide_criar(Piramide* p, SDL_Renderer* r, const ImagemLuma* fonte) {
+    memset(p, 0, sizeof(*p));
+    p->fonte = fonte;
+    int w = fonte->w, h = fonte->h;
+    for (int k = 0; k < PIRAMIDE_NIVEIS_MAX; k++) {
+        p->niveis[k].colunas = (w + LADRILHO - 1) / LADRILHO;
+        p->niveis[k].linhas = (h + LADRILHO - 1) / LADRILHO;
+        p->n_niveis = k + 1;
+        if (w <= LADRILHO && h <= LADRILHO) break;
+        w = (w + 1) / 2;
+        h = (h + 1) / 2;
+    }
+    p->niveis[0].plano = (ImagemLuma*)fonte;
+    tabela_rgba(NULL, &p->tabela);
+
+    // Prévia com o tamanho do nível mais reduzido (cabe em um ladrilho); fica guardada para acompanhar a LUT
+    p->previa = imagem_luma_amostrar(fonte, w, h);
+    if (p->previa) p->tex_previa = textura_de_luma(r, p->previa);
+
+    p->mutex = SDL_CreateMutex();
+    p->cond = SDL_CreateCondition();
+    if (!p->mutex || !p->cond) return -1;
+    if (p->n_niveis > 1) {
+        p->thread = SDL_CreateThread(thread_piramide, "piramide", p);
+        if (!p->thread) SDL_Log("Pirâmide: thread de fundo indisponível (%s)", SDL_GetError());
+    }
+    return 0;
+}
+
+static void piramide_destruir(Piramide* p) {
+    if (p->mutex) {
+        SDL_LockMutex(p->mutex);
+        p->encerrar = 1;
+        SDL_SignalCondition(p->cond);
+        SDL_UnlockMutex(p->mutex);
+    }
+    if (p->thread) SDL_WaitThread(p->thread, NULL);
+    for (int k = 0; k < p->n_niveis; k++) {
+        NivelPiramide* n = &p->niveis[k];
+        if (n->ladrilhos) {
+            for (int i = 0; i < n->colunas * n->linhas; i++) {
+                if (n->ladrilhos[i].tex) SDL_DestroyTexture(n->ladrilhos[i].tex);
+            }
+            free(n->ladrilhos);
+        }
+        if (k > 0) imagem_luma_destruir(n->plano);
+    }
+    if (p->tex_previa) SDL_DestroyTexture(p->tex_previa);
+    imagem_luma_destruir(p->previa);
+    if (p->cond) SDL_DestroyCondition(p->cond);
+    if (p->mutex) SDL_DestroyMutex(p->mutex);
+    memset(p, 0, sizeof(*p));
+}
+
+// Passa a exibir a pirâmide pela 'lut' (NULL = identidade). As texturas são reescritas no lugar quando
+// voltam a ser desenhadas, sem serem recriadas.
+static void piramide_definir_lut(Piramide* p, const uint8_t* lut) {
+    tabela_rgba(lut, &p->tabela);
+    p->geracao++;
+}
+
+// 1 se o nível k já pode ser exibido; se não, pede a construção dele
+static int piramide_nivel_pronto(Piramide* p, int k) {
+    if (k == 0) return 1;
+    SDL_LockMutex(p->mutex);
+    int pronto = p->construidos >= k;
+    if (!pronto && p->pedido < k) {
+        p->pedido = k;
+        SDL_SignalCondition(p->cond);
+    }
+    SDL_UnlockMutex(p->mutex);
+    return pronto && p->niveis[k].plano != NULL;
+}
+
+// Libera a textura usada há mais tempo (fora do quadro atual) para abrir espaço a um novo ladrilho
+static void piramide_liberar_ladrilho(Piramide* p) {
+    Ladrilho* vitima = NULL;
+    for (int k = 0; k < p->n_niveis; k++) {
+        NivelPiramide* n = &p->niveis[k];
+        if (!n->ladrilhos) continue;
+        for (int i = 0; i < n->colunas * n->linhas; i++) {
+            Ladrilho* l = &n->ladrilhos[i];
+            if (l->tex && l->uso < p->quadro && (!vitima || l->uso < vitima->uso)) vitima = l;
+        }
+    }
+    if (vitima) {
+        SDL_DestroyTexture(vitima->tex);
+        vitima->tex = NULL;
+        p->n_texturas--;
+    }
+}
+
+// Enquadramento: 'zoom' pixels de tela por pixel da imagem, com o ponto (cx, cy) da imagem no centro
+typedef struct {
+    double zoom;
+    double cx, cy;
+    int ajustada;             // acompanha o tamanho da janela mostrando a imagem inteira
+} Vista;
+
+static void vista_ajustar(Vista* v, int iw, int ih, int ww, int wh) {
+    v->zoom = fmin((double)ww / iw, (double)wh / ih);
+    v->cx = iw * 0.5;
+    v->cy = ih * 0.5;
+    v->ajustada = 1;
+}
+
+static void vista_limitar(Vista* v, int iw, int ih) {
+    v->cx = fmin(fmax(v->cx, 0.0), (double)iw);
+    v->cy = fmin(fmax(v->cy, 0.0), (double)ih);
+}
+
+// Multiplica o zoom mantendo fixo o ponto da imagem sob (mx, my)
+static void vista_zoom(Vista* v, double fator, float mx, float my, int iw, int ih, int ww, int wh) {
+    double zoom_min = fmin(fmin((double)ww / iw, (double)wh / ih), 1.0) * 0.5;
+    double novo = fmin(fmax(v->zoom * fator, zoom_min), ZOOM_MAX);
+    double ix = v->cx + (mx - ww * 0.5) / v->zoom;
+    double iy = v->cy + (my - wh * 0.5) / v->zoom;
+    v->cx = ix - (mx - ww * 0.5) / novo;
+    v->cy = iy - (my - wh * 0.5) / novo;
+    v->zoom = novo;
+    v->ajustada = 0;
+    vista_limitar(v, iw, ih);
+}
+
+static void vista_mover(Vista* v, float dx, float dy, int iw, int ih) {
+    v->cx -= dx / v->zoom;
+    v->cy -= dy / v->zoom;
+    v->ajustada = 0;
+    vista_limitar(v, iw, ih);
+}
+
+// Ladrilho já enviado que precisa ser reescrito com a LUT atual: a textura fica travada enquanto o pool
+// preenche os ladrilhos, um por tarefa
+typedef struct {
+    SDL_Texture* tex;
+    const ImagemLuma* plano;
+    int x0, y0, w, h;
+    uint8_t* pixels;
+    int pitch;
+} ReescritaLadrilho;
+
+typedef struct {
+    ReescritaLadrilho* itens;
+    const TabelaRgba* tabela;
+} ContextoReescrita;
+
+static void tarefa_reescrita(void* data, int i) {
+    ContextoReescrita* ctx = (ContextoReescrita*)data;
+    ReescritaLadrilho* it = &ctx->itens[i];
+    escrever_regiao_rgba(it->plano, it->x0, it->y0, it->w, it->h, ctx->tabela, it->pixels, it->pitch);
+}
+
+// Reescreve com a LUT atual os ladrilhos já enviados da faixa [cx0, cx1] x [cy0, cy1] do nível: todos saem no
+// mesmo quadro, então o custo de trocar a LUT depende do tamanho da janela, não do da imagem
+static void piramide_reescrever_visiveis(Piramide* p, NivelPiramide* n, int cx0, int cx1, int cy0, int cy1) {
+    if (cx1 < cx0 || cy1 < cy0) return;
+    ReescritaLadrilho* itens = malloc((size_t)(cx1 - cx0 + 1) * (size_t)(cy1 - cy0 + 1) * sizeof(*itens));
+    if (!itens) return;
+    int n_itens = 0;
+    for (int ty = cy0; ty <= cy1; ty++) {
+        for (int tx = cx0; tx <= cx1; tx++) {
+            Ladrilho* l = &n->ladrilhos[ty * n->colunas + tx];
+            if (!l->tex || l->geracao == p->geracao) continue;
+            ReescritaLadrilho* it = &itens[n_itens];
+            void* pixels = NULL;
+            if (!SDL_LockTexture(l->tex, NULL, &pixels, &it->pitch)) continue;
+            it->tex = l->tex;
+            it->plano = n->plano;
+            it->x0 = tx * LADRILHO;
+            it->y0 = ty * LADRILHO;
+            it->w = n->plano->w - it->x0 < LADRILHO ? n->plano->w - it->x0 : LADRILHO;
+            it->h = n->plano->h - it->y0 < LADRILHO ? n->plano->h - it->y0 : LADRILHO;
+            it->pixels = (uint8_t*)pixels;
+            l->geracao = p->geracao;
+            n_itens++;
+        }
+    }
+    if (n_itens > 0) {
+        ContextoReescrita ctx;
+        ctx.itens = itens;
+        ctx.tabela = &p->tabela;
+        procimg_paralelo_para(n_itens, tarefa_reescrita, &ctx);
+        for (int i = 0; i < n_itens; i++) SDL_UnlockTexture(itens[i].tex);
+    }
+    free(itens);
+}
+
+// Desenha a parte visível da pirâmide. Retorna 1 se ficaram ladrilhos sem enviar (redesenhar de novo).
+static int render_piramide(SDL_Renderer* r, Piramide* p, const Vista* v, int ww, int wh) {
+    const ImagemLuma* f = p->fonte;
+    p->quadro++;
+    double x_img = ww * 0.5 - v->cx * v->zoom;   // canto da imagem na tela
+    double y_img = wh * 0.5 - v->cy * v->zoom;
+
+    // Nível mais reduzido em que um pixel ainda ocupa pelo menos meio pixel de tela
+    int k = 0;
+    while (k + 1 < p->n_niveis && v->zoom * (double)(1 << (k + 1)) <= 1.0) k++;
+
+    float escala_previa = 0.0f;
+    if (p->tex_previa) {
+        float pw, ph;
+        SDL_GetTextureSize(p->tex_previa, &pw, &ph);
+        escala_previa = pw / (float)f->w;
+        if (p->geracao_previa != p->geracao) {
+            void* pixels = NULL;
+            int pitch = 0;
+            if (SDL_LockTexture(p->tex_previa, NULL, &pixels, &pitch)) {
+                escrever_regiao_rgba(p->previa, 0, 0, p->previa->w, p->previa->h, &p->tabela, (uint8_t*)pixels, pitch);
+                SDL_UnlockTexture(p->tex_previa);
+            }
+            p->geracao_previa = p->geracao;
+        }
+    }
+    if (!piramide_nivel_pronto(p, k)) {
+        // Nível ainda em construção: a prévia ocupa a imagem inteira até o evento de nível pronto
+        SDL_FRect dst = { (float)x_img, (float)y_img, (float)(f->w * v->zoom), (float)(f->h * v->zoom) };
+        if (p->tex_previa) SDL_RenderTexture(r, p->tex_previa, NULL, &dst);
+        return 0;
+    }
+
+    NivelPiramide* n = &p->niveis[k];
+    if (!n->ladrilhos) {
+        n->ladrilhos = calloc((size_t)n->colunas * n->linhas, sizeof(Ladrilho));
+        if (!n->ladrilhos) return 0;
+    }
+
+    // Ladrilhos que cruzam a janela
+    double lado = (double)LADRILHO * (1 << k);   // lado do ladrilho em pixels da imagem original
+    double tx0 = floor(-x_img / v->zoom / lado), tx1 = floor((ww - x_img) / v->zoom / lado);
+    double ty0 = floor(-y_img / v->zoom / lado), ty1 = floor((wh - y_img) / v->zoom / lado);
+    int cx0 = (int)fmax(tx0, 0.0), cx1 = (int)fmin(tx1, n->colunas - 1.0);
+    int cy0 = (int)fmax(ty0, 0.0), cy1 = (int)fmin(ty1, n->linhas - 1.0);
+    piramide_reescrever_visiveis(p, n, cx0, cx1, cy0, cy1);
+
+    int enviados = 0, pendente = 0;
+    for (int ty = cy0; ty <= cy1; ty++) {
+        for (int tx = cx0; tx <= cx1; tx++) {
+            Ladrilho* l = &n->ladrilhos[ty * n->colunas + tx];
+            int lx = tx * LADRILHO, ly = ty * LADRILHO;
+            int lw = n->plano->w - lx < LADRILHO ? n->plano->w - lx : LADRILHO;
+            int lh = n->plano->h - ly < LADRILHO ? n->plano->h - ly : LADRILHO;
+
+            // Região em pixels da imagem original (o último pixel de um nível pode passar da borda)
+            double sx = lx * (double)(1 << k), sy = ly * (double)(1 << k);
+            double sw = fmin(lw * (double)(1 << k), f->w - sx), sh = fmin(lh * (double)(1 << k), f->h - sy);
+            SDL_FRect dst = { (float)(x_img + sx * v->zoom), (float)(y_img + sy * v->zoom),
+                              (float)(sw * v->zoom), (float)(sh * v->zoom) };
+
+            if (!l->tex && enviados < LADRILHOS_POR_QUADRO) {
+                if (p->n_texturas >= LADRILHOS_MAX_TEXTURAS) piramide_liberar_ladrilho(p);
+                l->tex = textura_de_luma_regiao(r, n->plano, lx, ly, lw, lh, &p->tabela);
+                l->geracao = p->geracao;
+                if (l->tex) p->n_texturas++;
+                enviados++;
+            }
+            if (l->tex) {
+                SDL_FRect src = { 0, 0, (float)(sw / (1 << k)), (float)(sh / (1 << k)) };
+                SDL_RenderTexture(r, l->tex, &src, &dst);
+                l->uso = p->quadro;
+            } else {
+                pendente = 1;
+                if (p->tex_previa) {
+                    SDL_FRect src = { (float)sx * escala_previa, (float)sy * escala_previa,
+                                      (float)sw * escala_previa, (float)sh * escala_previa };
+                    SDL_RenderTexture(r, p->tex_previa, &src, &dst);
+                }
+            }
+        }
+    }
+    return pendente;
+}
+
+// Imagens que o botão alterna na janela principal
+typedef enum { EXIBIR_ORIGINAL, EXIBIR_EQUALIZADA, EXIBIR_CLAHE, N_MODOS_EXIBICAO } ModoExibicao;
+
+static const char* const NOMES_MODOS_EXIBICAO[N_MODOS_EXIBICAO] = { "Original", "Equalizado", "CLAHE" };
+
+// Refaz a imagem CLAHE com os parâmetros atuais e a pirâmide dela. A thread da pirâmide lê a imagem, então a
+// pirâmide antiga sai antes de a imagem ser reescrita.
+static int atualizar_clahe(SDL_Renderer* r, const ImagemLuma* img, ImagemLuma** clahe, Piramide* pir,
+                           const ParametrosClahe* p) {
+    piramide_destruir(pir);
+    if (!*clahe) {
+        *clahe = imagem_luma_criar_como(img);
+        if (!*clahe) return -1;
+    }
+    Uint64 t = medir_inicio();
+    int ret = aplicar_clahe(img, *clahe, p);
+    medir_fim(ETAPA_CLAHE, t);
+    if (ret != 0) return -1;
+    SDL_Log("CLAHE: grade %dx%d, limite %.1f", p->blocos_x, p->blocos_y, p->limite);
+    return piramide_criar(pir, r, *clahe);
+}
+
+// Seleção de região (botão direito arrastando na janela principal): o histograma da região vem de um índice
+// de histograma integral da imagem exibida, montado na primeira seleção. Durante o arrasto a consulta é
+// arredondada para as células do índice e custa O(bins); ao soltar o botão sai a exata.
+static const int BINS_ROI[] = { 256, 64, 16 };   // tecla B: menos bins, células menores no mesmo orçamento
+#define N_BINS_ROI ((int)(sizeof(BINS_ROI) / sizeof(BINS_ROI[0])))
+
+// Índice de 'img' em *ind, montado agora se ainda não existir
+static const ProcimgIndiceHistograma* indice_da_imagem(ProcimgIndiceHistograma** ind, const ImagemLuma* img,
+                                                       int bins) {
+    if (*ind) return *ind;
+    ProcimgImagem plano = plano_procimg(img, img->y);
+    Uint64 t = medir_inicio();
+    if (procimg_indice_criar(&plano, bins, 0, ind) != PROCIMG_OK) {
+        SDL_Log("Região: sem memória para o índice de histograma");
+        return NULL;
+    }
+    medir_fim(ETAPA_INDICE_ROI, t);
+    int celula;
+    size_t bytes;
+    procimg_indice_info(*ind, NULL, &celula, &bytes);
+    SDL_Log("Região: índice com %d bins, células de %d px, %.1f MiB", bins, celula, bytes / 1048576.0);
+    return *ind;
+}
+
+// Histograma da região em 'saida', com 256 entradas como os da imagem inteira: com menos bins, cada bin ocupa
+// a sua faixa de intensidades no gráfico e as estatísticas usam o centro do bin. 'lut' (opcional) leva o
+// histograma da imagem indexada para a exibida por essa LUT.
+static int histograma_da_regiao(const ProcimgIndiceHistograma* ind, int x, int y, int w, int h, int exato,
+                                const uint8_t* lut, HistogramaImagem* saida) {
+    uint64_t grossos[256], mapeados[256];
+    if (procimg_indice_consultar(ind, x, y, w, h, exato, grossos) != PROCIMG_OK) return -1;
+    int bins;
+    procimg_indice_info(ind, &bins, NULL, NULL);
+    int largura = 256 / bins;
+    if (lut) {
+        memset(mapeados, 0, sizeof(mapeados));
+        for (int b = 0; b < bins; b++) mapeados[lut[b * largura + largura / 2] / largura] += grossos[b];
+        memcpy(grossos, mapeados, (size_t)bins * sizeof(uint64_t));
+    }
+    saida->total = 0;
+    for (int i = 0; i < 256; i++) saida->hist[i] = grossos[i / largura];
+    for (int b = 0; b < bins; b++) saida->total += grossos[b];
+    procimg_estatisticas_bins(grossos, bins, &saida->media, &saida->desvio);
+    saida->versao = nova_versao_imagem();   // só identifica o gráfico para o cache de texturas
+    return 0;
+}
+
+// Ponto da tela (x, y) da janela ww x wh em coordenadas da imagem
+static void vista_para_imagem(const Vista* v, float x, float y, int ww, int wh, double* ix, double* iy) {
+    *ix = v->cx + (x - ww * 0.5) / v->zoom;
+    *iy = v->cy + (y - wh * 0.5) / v->zoom;
+}
+
+// Contorno da região (x, y, w, h) da imagem sobre a janela principal
+static void render_selecao(SDL_Renderer* r, const Vista* v, int ww, int wh, int x, int y, int w, int h) {
+    SDL_FRect q = { (float)(ww * 0.5 + (x - v->cx) * v->zoom), (float)(wh * 0.5 + (y - v->cy) * v->zoom),
+                    (float)(w * v->zoom), (float)(h * v->zoom) };
+    SDL_SetRenderDrawColor(r, 255, 210, 0, 255);
+    SDL_RenderRect(r, &q);
+}
+
+//-------------------------------------------------------------------------------------------------------------------------
+// Leitura em faixas de linhas: permite processar imagens maiores que a memória, porque só uma faixa
+// fica em memória por vez. PGM/PPM binários (P5/P6) são lidos direto do arquivo; os demais formatos
+// dependem do IMG_Load, que decodifica a imagem inteira (nesse caso a memória não fica limitada).
+
+typedef struct {
+    char tipo;       // '5' (PGM, cinza) ou '6' (PPM, RGB)
+    int w, h, maxval;   // maxval acima de 255: amostras de 2 bytes, big-endian
+    size_t offset;   // início dos pixels no arquivo
+} CabecalhoPnm;
+
+static int pnm_espaco(uint8_t c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+// Interpreta o cabeçalho de um PGM/PPM binário a partir dos primeiros bytes do arquivo
+static int pnm_ler_cabecalho(const uint8_t* buf, size_t n, CabecalhoPnm* c) {
+    if (n < 2 || buf[0] != 'P' || (buf[1] != '5' && buf[1] != '6')) return -1;
+    c->tipo = (char)buf[1];
+
+    size_t i = 2;
+    long campos[3];
+    for (int k = 0; k < 3; k++) {
+        for (;;) { // espaços e comentários
+            while (i < n && pnm_espaco(buf[i])) i++;
+            if (i < n && buf[i] == '#') {
+                while (i < n && buf[i] != '\n') i++;
+                continue;
+            }
+            break;
+        }
+        if (i >= n || buf[i] < '0' || buf[i] > '9') return -1;
+        long v = 0;
+        while (i < n && buf[i] >= '0' && buf[i] <= '9') {
+            v = v * 10 + (buf[i] - '0');
+            if (v > 1000000000L) return -1;
+            i++;
+        }
+        campos[k] = v;
+    }
+    // Exatamente um espaço separa o maxval dos pixels
+    if (i >= n || !pnm_espaco(buf[i])) return -1;
+
+    c->w = (int)campos[0];
+    c->h = (int)campos[1];
+    c->maxval = (int)campos[2];
+    c->offset = i + 1;
+    if (c->w <= 0 || c->h <= 0 || c->maxval <= 0 || c->maxval > 65535) return -1;
+    return 0;
+}
+
+static int termina_com(const char* s, const char* sufixo) {
+    size_t ls = strlen(s), lf = strlen(sufixo);
+    return ls >= lf && SDL_strcasecmp(s + ls - lf, sufixo) == 0;
+}
+
+typedef enum { LEITOR_PNM, LEITOR_SDL } TipoLeitor;
+
+typedef struct {
+    TipoLeitor tipo;
+    int w, h;
+    int proxima;              // próxima linha a ser lida
+    FILE* f;                  // PNM
+    CabecalhoPnm cab;
+    uint8_t* bruta;           // uma linha crua do arquivo (PPM)
+    SurfaceRgba rgba;         // SDL: imagem inteira já decodificada
+    ProcimgCinzaLinha cinza_linha;
+} LeitorFaixas;
+
+static void leitor_fechar(LeitorFaixas* l) {
+    if (l->f) fclose(l->f);
+    free(l->bruta);
+    surface_rgba_liberar(&l->rgba);
+    memset(l, 0, sizeof(*l));
+}
+
+static int leitor_abrir(LeitorFaixas* l, const char* caminho) {
+    memset(l, 0, sizeof(*l));
+    l->cinza_linha = procimg_cinza_linha(PROCIMG_RGBA32);
+
+    l->f = fopen(caminho, "rb");
+    if (!l->f) {
+        fprintf(stderr, "Erro: não foi possível abrir '%s' (%s)\n", caminho, strerror(errno));
+        return -1;
+    }
+    uint8_t cab[512];
+    size_t n = fread(cab, 1, sizeof(cab), l->f);
+    if (pnm_ler_cabecalho(cab, n, &l->cab) == 0 && l->cab.maxval <= 255) {
+        l->tipo = LEITOR_PNM;
+        l->w = l->cab.w;
+        l->h = l->cab.h;
+        l->cinza_linha = procimg_cinza_linha(PROCIMG_RGB24);
+        if (l->cab.tipo == '6' && !(l->bruta = malloc((size_t)l->w * 3))) {
+            leitor_fechar(l);
+            return -1;
+        }
+        return fseek(l->f, (long)l->cab.offset, SEEK_SET) == 0 ? 0 : -1;
+    }
+    fclose(l->f);
+    l->f = NULL;
+
+    SDL_Log("Aviso: '%s' não é PGM/PPM binário de 8 bits; a imagem será decodificada inteira na memória.", caminho);
+    SDL_Surface* initial_img = IMG_Load(caminho);
+    if (!initial_img) {
+        fprintf(stderr, "Erro: o arquivo não é uma imagem suportada ou está corrompido.\nDetalhe: %s\n",
+                SDL_GetError());
+        return -1;
+    }
+    if (surface_rgba_de(initial_img, &l->rgba) != 0 || l->rgba.s->w <= 0 || l->rgba.s->h <= 0) {
+        fprintf(stderr, "Erro: falha ao converter para RGBA32: %s\n", SDL_GetError());
+        leitor_fechar(l);
+        return -1;
+    }
+    l->tipo = LEITOR_SDL;
+    l->w = l->rgba.s->w;
+    l->h = l->rgba.s->h;
+    return 0;
+}
+
+static int leitor_reiniciar(LeitorFaixas* l) {
+    l->proxima = 0;
+    if (l->tipo == LEITOR_PNM) return fseek(l->f, (long)l->cab.offset, SEEK_SET) == 0 ? 0 : -1;
+    return 0;
+}
+
+// Lê até faixa->h linhas já em cinza; retorna quantas foram lidas (0 no fim, -1 em erro)
+static int leitor_ler(LeitorFaixas* l, ImagemLuma* faixa) {
+    int n = l->h - l->proxima;
+    if (n > faixa->h) n = faixa->h;
+
+    for (int y = 0; y < n; y++) {
+        uint8_t* dst = faixa->y + (size_t)y * faixa->stride;
+        if (l->tipo == LEITOR_SDL) {
+            const uint8_t* row = (const uint8_t*)l->rgba.s->pixels + (size_t)(l->proxima + y) * l->rgba.s->pitch;
+            l->cinza_linha(row, dst, l->w);
+        } else if (l->cab.tipo == '5') {
+            if (fread(dst, 1, (size_t)l->w, l->f) != (size_t)l->w) return -1;
+        } else {
+            if (fread(l->bruta, 3, (size_t)l->w, l->f) != (size_t)l->w) return -1;
+            l->cinza_linha(l->bruta, dst, l->w);
+        }
+    }
+    l->proxima += n;
+    return n;
+}
+
+//-------------------------------------------------------------------------------------------------------------------------
+// Arquivos mapeados em memória: PGM/PPM binários e luma crua (.luma) são lidos e gravados direto nos bytes
+// mapeados, sem passar pelo SDL_image. Em PGM e .luma o plano de intensidade é o próprio arquivo, então a
+// troca de imagens entre etapas de um pipeline não copia pixels: a entrada é lida no mapeamento e a LUT
+// escreve direto no mapeamento da saída.
+//
+// Formato .luma: cabeçalho de 64 bytes ("LUMA8\n", depois largura, altura e stride como uint32
+// little-endian, resto zerado) seguido de 'altura' linhas de 'stride' bytes. O stride é múltiplo de 64,
+// como nas imagens alocadas, e o mapeamento começa em página, então as linhas ficam alinhadas.
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define PROJ_MMAP 1
+#else
+#include <process.h> // _getpid
+#endif
+
+#define LUMA_MAGICO "LUMA8\n"
+#define LUMA_CABECALHO 64
+
+typedef struct {
+    uint8_t* dados;
+    size_t tamanho;
+    int gravavel;
+    char* caminho;            // gravação: destino, só substituído no fechamento
+    char* temporario;         // gravação: onde os bytes vão até lá (sem mmap, gravado inteiro no fechamento)
+} ArquivoMapeado;
+
+// Identifica o processo no nome dos temporários: ids de thread só são únicos dentro de um processo
+static unsigned long long id_processo(void) {
+#if defined(PROJ_MMAP)
+    return (unsigned long long)getpid();
+#elif defined(_WIN32)
+    return (unsigned long long)_getpid();
+#else
+    return 0;
+#endif
+}
+
+// "<caminho>.<pid>.<thread>.tmp": temporário ao lado do destino, renomeado sobre ele quando a gravação termina
+static char* nome_temporario(const char* caminho) {
+    char* t = NULL;
+    if (SDL_asprintf(&t, "%s.%llx.%llx.tmp", caminho, id_processo(), (unsigned long long)SDL_GetCurrentThreadID()) < 0) {
+        return NULL;
+    }
+    return t;
+}
+
+// Mapeia um arquivo existente só para leitura
+static int mapa_abrir(ArquivoMapeado* m, const char* caminho) {
+    memset(m, 0, sizeof(*m));
+#if defined(PROJ_MMAP)
+    int fd = open(caminho, O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return -1;
+    }
+    void* p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return -1;
+    posix_madvise(p, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+    m->dados = p;
+    m->tamanho = (size_t)st.st_size;
+#else
+    m->dados = SDL_LoadFile(caminho, &m->tamanho);
+    if (!m->dados) return -1;
+#endif
+    return 0;
+}
+
+// Mapeia para escrita um temporário de 'tamanho' bytes ao lado de 'caminho'; o destino só é substituído em
+// mapa_fechar, então ele pode ser o próprio arquivo de entrada ainda mapeado
+static int mapa_criar(ArquivoMapeado* m, const char* caminho, size_t tamanho) {
+    memset(m, 0, sizeof(*m));
+    m->gravavel = 1;
+    m->caminho = SDL_strdup(caminho);
+    m->temporario = nome_temporario(caminho);
+    if (!m->caminho || !m->temporario) goto falha;
+#if defined(PROJ_MMAP)
+    int fd = open(m->temporario, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) goto falha;
+    if (ftruncate(fd, (off_t)tamanho) != 0) {
+        close(fd);
+        goto falha;
+    }
+    void* p = mmap(NULL, tamanho, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) goto falha;
+    m->dados = p;
+#else
+    m->dados = SDL_malloc(tamanho);
+    if (!m->dados) goto falha;
+#endif
+    m->tamanho = tamanho;
+    return 0;
+
+falha:
+    if (m->temporario) SDL_RemovePath(m->temporario);
+    SDL_free(m->temporario);
+    SDL_free(m->caminho);
+    memset(m, 0, sizeof(*m));
+    return -1;
+}
+
+// Desfaz o mapeamento. Numa gravação, 'manter' decide entre renomear o temporário sobre o destino e apagá-lo;
+// retorna 1 se o arquivo chegou inteiro ao destino (sempre 1 na leitura)
+static int mapa_encerrar(ArquivoMapeado* m, int manter) {
+    int ok = 1;
+    if (!m->dados) return 0;
+#if defined(PROJ_MMAP)
+    ok = munmap(m->dados, m->tamanho) == 0;
+#else
+    if (m->gravavel && manter) ok = SDL_SaveFile(m->temporario, m->dados, m->tamanho);
+    SDL_free(m->dados);
+#endif
+    if (m->gravavel) {
+        ok = ok && manter && SDL_RenamePath(m->temporario, m->caminho);
+        if (!ok) SDL_RemovePath(m->temporario);
+        SDL_free(m->temporario);
+        SDL_free(m->caminho);
+    }
+    memset(m, 0, sizeof(*m));
+    return ok;
+}
+
+static int mapa_fechar(ArquivoMapeado* m) { return mapa_encerrar(m, 1); }
+
+// Abandona uma gravação pela metade sem tocar no destino
+static void mapa_descartar(ArquivoMapeado* m) { (void)mapa_encerrar(m, 0); }
+
+typedef enum { BRUTO_NENHUM, BRUTO_PGM, BRUTO_PPM, BRUTO_LUMA, BRUTO_PGM16 } FormatoBruto;
+
+// Onde estão os pixels dentro do arquivo mapeado
+typedef struct {
+    FormatoBruto formato;
+    int w, h;
+    size_t stride;            // bytes por linha no arquivo
+    size_t offset;            // início da primeira linha
+} DescritorBruto;
+
+static uint32_t le32_ler(const uint8_t* p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void le32_gravar(uint8_t* p, uint32_t v) {
+    p[0] = (uint8_t)v; p[1] = (uint8_t)(v >> 8); p[2] = (uint8_t)(v >> 16); p[3] = (uint8_t)(v >> 24);
+}
+
+// Reconhece PGM/PPM de 8 bits (maxval 255), PGM de 16 bits (maxval acima de 255) e .luma; retorna -1 se o
+// arquivo não puder ser usado direto
+static int bruto_identificar(const uint8_t* buf, size_t n, DescritorBruto* d) {
+    memset(d, 0, sizeof(*d));
+    CabecalhoPnm pnm;
+    if (n >= LUMA_CABECALHO && memcmp(buf, LUMA_MAGICO, 6) == 0) {
+        d->formato = BRUTO_LUMA;
+        d->w = (int)le32_ler(buf + 8);
+        d->h = (int)le32_ler(buf + 12);
+        d->stride = le32_ler(buf + 16);
+        d->offset = LUMA_CABECALHO;
+        if (d->w <= 0 || d->h <= 0 || d->stride < (size_t)d->w) return -1;
+    } else if (pnm_ler_cabecalho(buf, n, &pnm) == 0 && (pnm.maxval == 255 || (pnm.maxval > 255 && pnm.tipo == '5'))) {
+        d->formato = pnm.maxval > 255 ? BRUTO_PGM16 : pnm.tipo == '5' ? BRUTO_PGM : BRUTO_PPM;
+        d->w = pnm.w;
+        d->h = pnm.h;
+        d->stride = (size_t)pnm.w * (d->formato == BRUTO_PPM ? 3 : d->formato == BRUTO_PGM16 ? 2 : 1);
+        d->offset = pnm.offset;
+    } else {
+        return -1;
+    }
+    // O último pixel precisa estar dentro do arquivo
+    if ((n - d->offset) / d->stride < (size_t)d->h) return -1;
+    return 0;
+}
+
+// Formato de saída mapeada pela extensão do caminho (BRUTO_NENHUM se não for .pgm nem .luma)
+static FormatoBruto bruto_formato_saida(const char* caminho) {
+    if (termina_com(caminho, ".pgm")) return BRUTO_PGM;
+    if (termina_com(caminho, ".luma")) return BRUTO_LUMA;
+    return BRUTO_NENHUM;
+}
+
+// ImagemLuma que só aponta para um plano de outra memória (não é destruída, nada é liberado)
+static ImagemLuma vista_luma(uint8_t* y, int w, int h, size_t stride) {
+    ImagemLuma v;
+    memset(&v, 0, sizeof(v));
+    v.w = w;
+    v.h = h;
+    v.stride = (int)stride;
+    v.y = y;
+    return v;
+}
+
+// Cria o arquivo de saída mapeado já com o cabeçalho e devolve uma vista do plano dentro dele (em
+// BRUTO_PGM16 o stride da vista é de 2 bytes por pixel e quem grava escreve as amostras em big-endian)
+static int bruto_criar_saida(ArquivoMapeado* m, const char* caminho, FormatoBruto formato, int w, int h,
+                             ImagemLuma* plano) {
+    char pgm[64];
+    size_t cab, stride;
+    if (formato == BRUTO_LUMA) {
+        cab = LUMA_CABECALHO;
+        stride = (size_t)((w + 63) & ~63);
+    } else {
+        int bytes = formato == BRUTO_PGM16 ? 2 : 1;
+        cab = (size_t)SDL_snprintf(pgm, sizeof(pgm), "P5\n%d %d\n%d\n", w, h, bytes == 2 ? 65535 : 255);
+        stride = (size_t)w * bytes;
+    }
+    if (mapa_criar(m, caminho, cab + stride * (size_t)h) != 0) {
+        fprintf(stderr, "Erro: não foi possível criar '%s' (%s)\n", caminho, strerror(errno));
+        return -1;
+    }
+    if (formato == BRUTO_LUMA) {
+        memset(m->dados, 0, cab);
+        memcpy(m->dados, LUMA_MAGICO, 6);
+        le32_gravar(m->dados + 8, (uint32_t)w);
+        le32_gravar(m->dados + 12, (uint32_t)h);
+        le32_gravar(m->dados + 16, (uint32_t)stride);
+    } else {
+        memcpy(m->dados, pgm, cab);
+    }
+    *plano = vista_luma(m->dados + cab, w, h, stride);
+    return 0;
+}
+
+// PPM mapeado -> plano de intensidade, somando o histograma na mesma passada
+static int ppm_para_luma(const uint8_t* rgb, size_t pitch, ImagemLuma* dst, uint64_t hist[256]) {
+    ProcimgImagem src = procimg_imagem((uint8_t*)rgb, dst->w, dst->h, (int)pitch, PROCIMG_RGB24);
+    ProcimgImagem y = plano_procimg(dst, dst->y);
+    return procimg_escala_de_cinza(&src, &y, NULL, hist) == PROCIMG_OK ? 0 : -1;
+}
+
+//-------------------------------------------------------------------------------------------------------------------------
+// 16 bits: o PGM com maxval acima de 255 guarda cada amostra em 2 bytes big-endian. Ele vira um plano uint16_t na
+// ordem da CPU, e o histograma (65536 bins), as estatísticas, a LUT e a equalização trabalham nos 16 bits. Só a
+// exibição e as gravações de 8 bits recebem a imagem reduzida, por uma LUT de 65536 entradas que já embute o
+// mapeamento (procimg_reduzir16), numa passada só.
+
+typedef struct {
+    int w, h;
+    int stride;              // bytes por linha (múltiplo de 64)
+    uint16_t* y;
+    uint64_t* hist;          // PROCIMG_BINS16 bins, calculado na carga
+    int minimo, maximo;      // menor e maior intensidade presentes
+} ImagemLuma16;
+
+static void imagem_luma16_destruir(ImagemLuma16* img) {
+    if (!img) return;
+    liberar_plano((uint8_t*)img->y, img->stride, img->h);
+    free(img->hist);
+    free(img);
+}
+
+static ProcimgImagem plano16_procimg(const ImagemLuma16* img) {
+    return procimg_imagem(img->y, img->w, img->h, img->stride, PROCIMG_CINZA16);
+}
+
+// Plano de 16 bits a partir das amostras de um PGM, já com o histograma e a faixa de intensidades
+static ImagemLuma16* luma16_de_pgm(const uint8_t* dados, const DescritorBruto* d) {
+    ImagemLuma16* img = calloc(1, sizeof(*img));
+    if (!img) return NULL;
+    img->w = d->w;
+    img->h = d->h;
+    img->stride = (d->w * 2 + 63) & ~63;
+    img->y = (uint16_t*)alocar_plano(img->stride, d->h);
+    img->hist = malloc(PROCIMG_BINS16 * sizeof(uint64_t));
+    if (!img->y || !img->hist) {
+        imagem_luma16_destruir(img);
+        return NULL;
+    }
+    for (int y = 0; y < d->h; y++) {
+        const uint8_t* s = dados + d->offset + (size_t)y * d->stride;
+        uint16_t* l = (uint16_t*)((uint8_t*)img->y + (size_t)y * img->stride);
+        for (int x = 0; x < d->w; x++) l[x] = (uint16_t)(s[2 * x] << 8 | s[2 * x + 1]);
+    }
+    ProcimgImagem plano = plano16_procimg(img);
+    if (procimg_histograma16(&plano, img->hist) != PROCIMG_OK) {
+        imagem_luma16_destruir(img);
+        return NULL;
+    }
+    img->minimo = 0;
+    while (img->minimo < PROCIMG_BINS16 - 1 && !img->hist[img->minimo]) img->minimo++;
+    img->maximo = PROCIMG_BINS16 - 1;
+    while (img->maximo > 0 && !img->hist[img->maximo]) img->maximo--;
+    return img;
+}
+
+// Carrega um PGM de 16 bits mapeado; NULL se o arquivo for de outro formato
+static ImagemLuma16* carregar_luma16_mapeada(const char* caminho) {
+    ArquivoMapeado in;
+    DescritorBruto d;
+    if (mapa_abrir(&in, caminho) != 0) return NULL;
+    ImagemLuma16* img = NULL;
+    if (bruto_identificar(in.dados, in.tamanho, &d) == 0 && d.formato == BRUTO_PGM16) img = luma16_de_pgm(in.dados, &d);
+    mapa_fechar(&in);
+    return img;
+}
+
+// LUT de 16 bits -> LUT de redução (0..65535 para 0..255, arredondando)
+static void lut16_para_8(const uint16_t* lut16, uint8_t* lut8) {
+    for (int i = 0; i < PROCIMG_BINS16; i++) lut8[i] = (uint8_t)((lut16[i] * 255u + 32767u) / 65535u);
+}
+
+// dst (8 bits, mesmo tamanho) = lut[src], com o histograma do resultado na mesma passada (opcional)
+static int reduzir_luma16(const ImagemLuma16* src, const uint8_t* lut, ImagemLuma* dst, uint64_t hist[256]) {
+    ProcimgImagem s = plano16_procimg(src);
+    ProcimgImagem d = plano_procimg(dst, dst->y);
+    if (procimg_reduzir16(&s, &d, lut, hist) != PROCIMG_OK) return -1;
+    dst->versao = nova_versao_imagem();
+    return 0;
+}
+
+// Equaliza nos 16 bits e só reduz o resultado para 8 em 'dst'
+static int equalizar_luma16(const ImagemLuma16* src, ImagemLuma* dst, uint64_t hist[256]) {
+    uint16_t* lut16 = malloc(PROCIMG_BINS16 * sizeof(uint16_t));
+    uint8_t* lut8 = malloc(PROCIMG_BINS16);
+    int r = -1;
+    if (lut16 && lut8) {
+        procimg_lut_equalizacao16(src->hist, lut16);
+        lut16_para_8(lut16, lut8);
+        r = reduzir_luma16(src, lut8, dst, hist);
+    }
+    free(lut16);
+    free(lut8);
+    return r;
+}
+
+// Para etapas que só trabalham em 8 bits: a faixa de intensidades presente é esticada sobre 0..255
+static int reduzir_luma16_pela_faixa(const ImagemLuma16* src, ImagemLuma* dst, uint64_t hist[256]) {
+    uint8_t* janela = malloc(PROCIMG_BINS16);
+    if (!janela) return -1;
+    procimg_lut_janela16(src->minimo, src->maximo, janela);
+    int r = reduzir_luma16(src, janela, dst, hist);
+    free(janela);
+    return r;
+}
+
+// Ajuste da equalizada de uma imagem de 16 bits (controle deslizante), já como LUT de redução: a mistura vai da
+// original como é exibida ('janela') à equalização de 16 bits ('lut_eq'); o corte limita cada bin a um múltiplo
+// da média de pixels por bin dentro da faixa de intensidades presente
+static int lut_do_ajuste16(const ImagemLuma16* img, const uint16_t* lut_eq, const uint8_t* janela, ModoAjuste modo,
+                           double valor, uint8_t* lut) {
+    if (modo == AJUSTE_MISTURA) {
+        for (int i = 0; i < PROCIMG_BINS16; i++) {
+            lut[i] = (uint8_t)lround(janela[i] + valor * (lut_eq[i] * (255.0 / 65535.0) - janela[i]));
+        }
+        return 0;
+    }
+
+    uint64_t* cortado = malloc(PROCIMG_BINS16 * sizeof(uint64_t));
+    uint16_t* lut16 = malloc(PROCIMG_BINS16 * sizeof(uint16_t));
+    if (!cortado || !lut16) {
+        free(cortado);
+        free(lut16);
+        return -1;
+    }
+    int n = img->maximo - img->minimo + 1;
+    double limite = 1.0 + valor * (AJUSTE_CORTE_MAX - 1.0);
+    uint64_t teto = (uint64_t)(limite * ((double)img->w * img->h) / n), excesso = 0;
+    if (teto < 1) teto = 1;
+    memset(cortado, 0, PROCIMG_BINS16 * sizeof(uint64_t));
+    for (int i = img->minimo; i <= img->maximo; i++) {
+        cortado[i] = img->hist[i] > teto ? teto : img->hist[i];
+        excesso += img->hist[i] - cortado[i];
+    }
+    for (int k = 0; k < n; k++) cortado[img->minimo + k] += excesso / n + ((uint64_t)k < excesso % n);
+    procimg_lut_equalizacao16(cortado, lut16);
+    lut16_para_8(lut16, lut);
+    free(cortado);
+    free(lut16);
+    return 0;
+}
+
+// LUTs da interface para uma imagem de 16 bits: a redução da original para exibição, a equalização nos 16 bits e
+// a redução da equalizada com o ajuste atual do controle deslizante
+typedef struct {
+    uint8_t janela[PROCIMG_BINS16];
+    uint16_t eq[PROCIMG_BINS16];
+    uint8_t ajuste[PROCIMG_BINS16];
+} Luts16;
+
+// PGM de 16 bits mapeado: a saída .pgm sai em 16 bits (maxval 65535), equalizada sem perder a faixa dinâmica; a
+// .luma é de 8 bits e recebe a equalizada reduzida
+static int equalizar_pgm16_mapeado(const uint8_t* dados, const DescritorBruto* d, const char* saida,
+                                   FormatoBruto formato_saida) {
+    ImagemLuma16* img = luma16_de_pgm(dados, d);
+    uint16_t* lut = malloc(PROCIMG_BINS16 * sizeof(uint16_t));
+    ArquivoMapeado out;
+    ImagemLuma dst;
+    int erro = !img || !lut;
+    if (!erro) {
+        erro = bruto_criar_saida(&out, saida, formato_saida == BRUTO_LUMA ? BRUTO_LUMA : BRUTO_PGM16, d->w, d->h,
+                                 &dst) != 0;
+    }
+    if (!erro) {
+        if (formato_saida == BRUTO_LUMA) {
+            erro = equalizar_luma16(img, &dst, NULL) != 0;
+        } else {
+            // Equalização no próprio plano de 16 bits e cópia para o arquivo em big-endian
+            ProcimgImagem plano = plano16_procimg(img);
+            procimg_lut_equalizacao16(img->hist, lut);
+            erro = procimg_aplicar_lut16(&plano, &plano, lut) != PROCIMG_OK;
+            for (int y = 0; y < img->h && !erro; y++) {
+                const uint16_t* l = (const uint16_t*)((const uint8_t*)img->y + (size_t)y * img->stride);
+                uint8_t* o = dst.y + (size_t)y * dst.stride;
+                for (int x = 0; x < img->w; x++) {
+                    o[2 * x] = (uint8_t)(l[x] >> 8);
+                    o[2 * x + 1] = (uint8_t)l[x];
+                }
+            }
+        }
+        if (erro) mapa_descartar(&out);
+        else if (!mapa_fechar(&out)) erro = 1;
+    }
+    free(lut);
+    imagem_luma16_destruir(img);
+    return erro ? -1 : 0;
+}
+
+// Equaliza 'entrada' (PGM de 8 ou 16 bits, PPM ou .luma) para 'saida' (.pgm ou .luma) só com arquivos
+// mapeados. Retorna 0 em sucesso, -1 em erro e 1 se algum dos dois formatos não tiver caminho mapeado
+// (quem chama decide o fallback pelo SDL_image).
+static int equalizar_arquivo_mapeado(const char* entrada, const char* saida, uint64_t* pixels) {
+    FormatoBruto formato_saida = bruto_formato_saida(saida);
+    if (formato_saida == BRUTO_NENHUM) return 1;
+
+    ArquivoMapeado in, out;
+    DescritorBruto d;
+    if (mapa_abrir(&in, entrada) != 0) return 1;
+    if (bruto_identificar(in.dados, in.tamanho, &d) != 0) {
+        mapa_fechar(&in);
+        return 1;
+    }
+    if (d.formato == BRUTO_PGM16) {
+        int r = equalizar_pgm16_mapeado(in.dados, &d, saida, formato_saida);
+        mapa_fechar(&in);
+        if (r == 0) *pixels += (uint64_t)d.w * (uint64_t)d.h;
+        return r;
+    }
+
+    ImagemLuma dst;
+    if (bruto_criar_saida(&out, saida, formato_saida, d.w, d.h, &dst) != 0) {
+        mapa_fechar(&in);
+        return -1;
+    }
+
+    uint64_t hist[256];
+    uint64_t total = (uint64_t)d.w * (uint64_t)d.h;
+    uint8_t lut_eq[256];
+    int erro = 0;
+    if (d.formato == BRUTO_PPM) {
+        // Cinza direto no arquivo de saída e equalização no próprio lugar
+        erro = ppm_para_luma(in.dados + d.offset, d.stride, &dst, hist) != 0;
+        if (!erro) {
+            procimg_lut_equalizacao(hist, lut_eq);
+            (void)equalizar_com_lut(&dst, &dst, lut_eq);
+        }
+    } else {
+        // A entrada já é o plano de intensidade: histograma e LUT leem direto do mapeamento
+        ImagemLuma src = vista_luma(in.dados + d.offset, d.w, d.h, d.stride);
+        calcular_histograma(&src, hist, &total);
+        procimg_lut_equalizacao(hist, lut_eq);
+        (void)equalizar_com_lut(&src, &dst, lut_eq);
+    }
+
+    mapa_fechar(&in);
+    if (erro) mapa_descartar(&out);
+    else if (!mapa_fechar(&out)) erro = 1;
+    if (erro) return -1;
+    *pixels += total;
+    return 0;
+}
+
+// Grava o plano de intensidade em .pgm ou .luma mapeado (o alfa é descartado); retorna 1 se deu certo
+static int salvar_luma_mapeada(const ImagemLuma* img, const char* caminho) {
+    ArquivoMapeado out;
+    ImagemLuma dst;
+    if (bruto_criar_saida(&out, caminho, bruto_formato_saida(caminho), img->w, img->h, &dst) != 0) return 0;
+    for (int y = 0; y < img->h; y++) {
+        memcpy(dst.y + (size_t)y * dst.stride, img->y + (size_t)y * img->stride, (size_t)img->w);
+    }
+    return mapa_fechar(&out);
+}
+
+// Salva pelo formato da extensão: .pgm e .luma pelo caminho mapeado, .qoi pelo codificador QOI, o resto em PNG
+static int salvar_luma(const ImagemLuma* img, const char* caminho) {
+    if (bruto_formato_saida(caminho) != BRUTO_NENHUM) return salvar_luma_mapeada(img, caminho);
+    if (termina_com(caminho, ".qoi")) return salvar_luma_qoi(img, caminho);
+    return salvar_luma_png(img, caminho);
+}
+
+// Carrega PGM de 8 bits ou .luma mapeado para uma ImagemLuma própria, com o histograma. Retorna NULL se o
+// arquivo não for um desses formatos (PPM e os demais seguem pelo SDL_image, que também trata a cor e o alfa;
+// o PGM de 16 bits tem carregar_luma16_mapeada).
+static ImagemLuma* carregar_luma_mapeada(const char* caminho, uint64_t hist[256], uint64_t* total_pixels) {
+    ArquivoMapeado in;
+    DescritorBruto d;
+    if (mapa_abrir(&in, caminho) != 0) return NULL;
+    ImagemLuma* img = NULL;
+    if (bruto_identificar(in.dados, in.tamanho, &d) == 0 && (d.formato == BRUTO_PGM || d.formato == BRUTO_LUMA) &&
+        (img = imagem_luma_criar(d.w, d.h, 0)) != NULL) {
+        for (int y = 0; y < d.h; y++) {
+            memcpy(img->y + (size_t)y * img->stride, in.dados + d.offset + (size_t)y * d.stride, (size_t)d.w);
+        }
+        calcular_histograma(img, hist, total_pixels);
+    }
+    mapa_fechar(&in);
+    return img;
+}
+
+// Decodifica os bytes de um arquivo de imagem em *img (reaproveitada quando o tamanho não muda): PGM, PPM e
+// .luma direto dos bytes, o resto pelo SDL_image (o alfa é descartado). Com PPM (e PGM de 16 bits, reduzido
+// pela faixa de intensidades presente) o histograma sai na mesma passada e *tem_hist fica 1.
+static int decodificar_luma(const uint8_t* dados, size_t n, ImagemLuma** img, uint64_t hist[256], int* tem_hist) {
+    DescritorBruto d;
+    *tem_hist = 0;
+    if (bruto_identificar(dados, n, &d) == 0) {
+        if (imagem_luma_reusar(img, d.w, d.h) != 0) return -1;
+        if (d.formato == BRUTO_PPM) {
+            if (ppm_para_luma(dados + d.offset, d.stride, *img, hist) != 0) return -1;
+            *tem_hist = 1;
+        } else if (d.formato == BRUTO_PGM16) {
+            ImagemLuma16* img16 = luma16_de_pgm(dados, &d);
+            int r = img16 ? reduzir_luma16_pela_faixa(img16, *img, hist) : -1;
+            imagem_luma16_destruir(img16);
+            if (r != 0) return -1;
+            *tem_hist = 1;
+        } else {
+            for (int y = 0; y < d.h; y++) {
+                memcpy((*img)->y + (size_t)y * (*img)->stride, dados + d.offset + (size_t)y * d.stride, (size_t)d.w);
+            }
+        }
+        (*img)->versao = nova_versao_imagem();
+        return 0;
+    }
+
+    SDL_IOStream* io = SDL_IOFromConstMem(dados, n);
+    SDL_Surface* initial_img = io ? IMG_Load_IO(io, true) : NULL;
+    if (!initial_img) return -1;
+    SurfaceRgba conv;   // pixels do pool de buffers
+    SDL_Surface* rgba = surface_rgba_de(initial_img, &conv) == 0 ? conv.s : NULL;
+    if (!rgba) return -1;
+    int r = -1;
+    if (rgba->w > 0 && rgba->h > 0 && SDL_LockSurface(rgba)) {
+        if (imagem_luma_reusar(img, rgba->w, rgba->h) == 0) r = aplicar_escala_de_cinza(rgba, *img);
+        SDL_UnlockSurface(rgba);
+    }
+    surface_rgba_liberar(&conv);
+    return r;
+}
+
+// Mesmo que decodificar_luma, com o arquivo mapeado (sem cópia para um buffer intermediário)
+static int decodificar_arquivo_luma(const char* caminho, ImagemLuma** img, uint64_t hist[256], int* tem_hist) {
+    ArquivoMapeado in;
+    if (mapa_abrir(&in, caminho) != 0) {
+        SDL_SetError("não foi possível abrir '%s' (%s)", caminho, strerror(errno));
+        return -1;
+    }
+    int r = decodificar_luma(in.dados, in.tamanho, img, hist, tem_hist);
+    mapa_fechar(&in);
+    return r;
+}
+
+//-------------------------------------------------------------------------------------------------------------------------
+// Gravação em segundo plano: a tecla S só copia a imagem exibida e põe a tarefa na fila; uma thread
+// gravadora codifica e escreve no disco, então as janelas não congelam durante o PNG. Cada gravação
+// recebe um nome novo (output_image_0001.png, ...), sem sobrescrever arquivos existentes.
+
+typedef enum {
+    GRAVAR_PNG,                 // IMG_SavePNG (comprimido)
+    GRAVAR_PNG_SEM_COMPRESSAO,  // PNG com deflate stored
+    GRAVAR_QOI,
+    GRAVAR_PGM,                 // sem compressão; o alfa é descartado
+    N_FORMATOS_GRAVACAO
+} FormatoGravacao;
+
+static const struct { const char* nome; const char* extensao; } FORMATOS_GRAVACAO[N_FORMATOS_GRAVACAO] = {
+    { "PNG", "png" }, { "PNG sem compressão", "png" }, { "QOI", "qoi" }, { "PGM", "pgm" }
+};
+
+#define GRAVACOES_PENDENTES_MAX 4   // limita a memória presa em cópias esperando o disco
+#define GRAVACAO_BASE "output_image"
+
+typedef struct TarefaGravacao {
+    ImagemLuma* img;                // cópia própria; a interface segue usando a dela
+    FormatoGravacao formato;
+    char caminho[256];
+    struct TarefaGravacao* proxima;
+} TarefaGravacao;
+
+typedef struct {
+    SDL_Mutex* mutex;
+    SDL_Condition* cond;
+    SDL_Thread* thread;
+    TarefaGravacao* primeira;
+    TarefaGravacao* ultima;
+    int pendentes;                  // na fila ou em gravação
+    int encerrar;
+    int numero;                     // último número usado no nome (só a thread principal mexe)
+} Gravador;
+
+static Gravador g_gravador;
+
+static ImagemLuma* imagem_luma_copiar(const ImagemLuma* src) {
+    ImagemLuma* img = imagem_luma_criar(src->w, src->h, src->a != NULL);
+    if (!img) return NULL;
+    for (int y = 0; y < src->h; y++) {
+        memcpy(img->y + (size_t)y * img->stride, src->y + (size_t)y * src->stride, (size_t)src->w);
+        if (src->a) memcpy(img->a + (size_t)y * img->stride, src->a + (size_t)y * src->stride, (size_t)src->w);
+    }
+    img->versao = src->versao;
+    return img;
+}
+
+static int gravar_no_formato(const ImagemLuma* img, const char* caminho, FormatoGravacao formato) {
+    switch (formato) {
+    case GRAVAR_PNG_SEM_COMPRESSAO: return salvar_luma_png_sem_compressao(img, caminho);
+    case GRAVAR_QOI: return salvar_luma_qoi(img, caminho);
+    case GRAVAR_PGM: return salvar_luma_mapeada(img, caminho);
+    default: return salvar_luma_png(img, caminho);
+    }
+}
+
+static int thread_gravador(void* data) {
+    Gravador* g = (Gravador*)data;
+    SDL_LockMutex(g->mutex);
+    for (;;) {
+        while (!g->primeira && !g->encerrar) SDL_WaitCondition(g->cond, g->mutex);
+        TarefaGravacao* t = g->primeira;
+        if (!t) break;   // encerrar com a fila vazia
+        g->primeira = t->proxima;
+        if (!g->primeira) g->ultima = NULL;
+        SDL_UnlockMutex(g->mutex);
+
+        Uint64 t0 = SDL_GetPerformanceCounter();
+        if (gravar_no_formato(t->img, t->caminho, t->formato)) {
+            SDL_Log("Imagem salva como '%s' (%s, %.1f ms)", t->caminho, FORMATOS_GRAVACAO[t->formato].nome,
+                    (double)(SDL_GetPerformanceCounter() - t0) * 1000.0 / (double)SDL_GetPerformanceFrequency());
+        } else {
+            SDL_Log("Falha ao salvar '%s': %s", t->caminho, SDL_GetError());
+        }
+        imagem_luma_destruir(t->img);
+        free(t);
+
+        SDL_LockMutex(g->mutex);
+        g->pendentes--;
+    }
+    SDL_UnlockMutex(g->mutex);
+    return 0;
+}
+
+static int gravador_iniciar(void) {
+    memset(&g_gravador, 0, sizeof(g_gravador));
+    g_gravador.mutex = SDL_CreateMutex();
+    g_gravador.cond = SDL_CreateCondition();
+    if (g_gravador.mutex && g_gravador.cond) {
+        g_gravador.thread = SDL_CreateThread(thread_gravador, "gravador", &g_gravador);
+    }
+    if (!g_gravador.thread) {
+        SDL_Log("Thread de gravação indisponível: %s", SDL_GetError());
+        return -1;
+    }
+    return 0;
+}
+
+// Espera as gravações pendentes terminarem e encerra a thread
+static void gravador_encerrar(void) {
+    if (g_gravador.thread) {
+        SDL_LockMutex(g_gravador.mutex);
+        if (g_gravador.pendentes) SDL_Log("Aguardando %d gravação(ões) pendente(s)...", g_gravador.pendentes);
+        g_gravador.encerrar = 1;
+        SDL_SignalCondition(g_gravador.cond);
+        SDL_UnlockMutex(g_gravador.mutex);
+        SDL_WaitThread(g_gravador.thread, NULL);
+    }
+    SDL_DestroyCondition(g_gravador.cond);
+    SDL_DestroyMutex(g_gravador.mutex);
+    memset(&g_gravador, 0, sizeof(g_gravador));
+}
+
+// Próximo nome GRAVACAO_BASE_NNNN.ext cujo número ainda não foi dado a outra tarefa nem existe no disco
+// em nenhum dos formatos (a numeração segue única mesmo trocando de formato)
+static void gravador_nome_unico(char* dst, size_t cap, const char* extensao) {
+    SDL_PathInfo info;
+    int ocupado;
+    do {
+        g_gravador.numero++;
+        ocupado = 0;
+        for (int f = 0; f < N_FORMATOS_GRAVACAO && !ocupado; f++) {
+            SDL_snprintf(dst, cap, "%s_%04d.%s", GRAVACAO_BASE, g_gravador.numero, FORMATOS_GRAVACAO[f].extensao);
+            ocupado = SDL_GetPathInfo(dst, &info);
+        }
+    } while (ocupado);
+    SDL_snprintf(dst, cap, "%s_%04d.%s", GRAVACAO_BASE, g_gravador.numero, extensao);
+}
+
+// Copia 'img' e agenda a gravação; sem a thread de gravação, grava na hora. Retorna 0 se foi aceita.
+static int gravador_agendar(const ImagemLuma* img, FormatoGravacao formato) {
+    if (g_gravador.thread) {
+        SDL_LockMutex(g_gravador.mutex);
+        int cheia = g_gravador.pendentes >= GRAVACOES_PENDENTES_MAX;
+        if (!cheia) g_gravador.pendentes++;
+        SDL_UnlockMutex(g_gravador.mutex);
+        if (cheia) {
+            SDL_Log("Gravação ignorada: já há %d na fila", GRAVACOES_PENDENTES_MAX);
+            return -1;
+        }
+    }
+
+    char caminho[256];
+    gravador_nome_unico(caminho, sizeof(caminho), FORMATOS_GRAVACAO[formato].extensao);
+    if (!g_gravador.thread) {
+        if (gravar_no_formato(img, caminho, formato)) SDL_Log("Imagem salva como '%s'", caminho);
+        else SDL_Log("Falha ao salvar '%s': %s", caminho, SDL_GetError());
+        return 0;
+    }
+
+    TarefaGravacao* t = calloc(1, sizeof(*t));
+    if (t) t->img = imagem_luma_copiar(img);
+    if (!t || !t->img) {
+        free(t);
+        SDL_LockMutex(g_gravador.mutex);
+        g_gravador.pendentes--;
+        SDL_UnlockMutex(g_gravador.mutex);
+        SDL_Log("Gravação ignorada: sem memória para copiar a imagem");
+        return -1;
+    }
+    t->formato = formato;
+    SDL_strlcpy(t->caminho, caminho, sizeof(t->caminho));
+
+    SDL_LockMutex(g_gravador.mutex);
+    if (g_gravador.ultima) g_gravador.ultima->proxima = t;
+    else g_gravador.primeira = t;
+    g_gravador.ultima = t;
+    SDL_SignalCondition(g_gravador.cond);
+    SDL_UnlockMutex(g_gravador.mutex);
+    SDL_Log("Gravando '%s' em segundo plano (%s)", caminho, FORMATOS_GRAVACAO[formato].nome);
+    return 0;
+}
+
+//-------------------------------------------------------------------------------------------------------------------------
+// Cache de resultados em disco: reabrir a mesma imagem pula a decodificação, o cinza, o histograma e a
+// equalização. A chave é o hash do conteúdo do arquivo de entrada (XXH64 de blocos de 4 MiB, calculados em
+// paralelo, e depois o hash dos hashes) junto com os parâmetros que mudam o resultado: versão do layout e pesos
+// do cinza. O nome do arquivo não entra, então cópias e renomeações também acertam.
+//
+// Cada entrada é um arquivo <chave>.cache no mesmo espírito do .luma: cabeçalho de 4 KiB (histograma,
+// estatísticas e LUT de equalização) seguido dos planos com o stride das imagens internas (intensidade, alfa se
+// houver e a equalizada), usados direto do mapeamento como vistas. A entrada é gravada num temporário e
+// renomeada, então quem está com uma entrada antiga mapeada não a vê mudar.
+//
+// Diretório: PROJ1_CACHE, senão $XDG_CACHE_HOME/proj1 ou ~/.cache/proj1 (%LOCALAPPDATA%\proj1 no Windows).
+// Limite: PROJ1_CACHE_MIB (padrão 1024; 0 desliga o cache). Passando do limite, saem primeiro as entradas com a
+// data de modificação mais antiga, que um acerto renova. O total em bytes é contado a cada gravação e o diretório
+// só é varrido na primeira gravação e quando o total passa do limite. Só o que passa pelo SDL_image usa o cache:
+// PGM, PPM e .luma mapeados já chegam sem decodificação que valha guardar. O lote só consulta o cache; gravar
+// nele é opcional (PROJ1_CACHE_LOTE=1), porque lotes de imagens únicas nunca acertam.
+
+#define CACHE_MAGICO "PROJ1CACHE1\n"      // muda junto com CACHE_VERSAO
+#define CACHE_VERSAO 1
+#define CACHE_CABECALHO 4096               // os planos começam em página
+#define CACHE_LIMITE_PADRAO_MIB 1024
+#define CACHE_BLOCO_HASH ((size_t)4 << 20)
+#define CACHE_ALFA 1u                      // flags da entrada
+#define CACHE_CINZA 2u                     // a entrada já era cinza antes da conversão
+
+typedef struct {
+    char magico[16];
+    uint64_t chave;
+    uint64_t tamanho_entrada;  // bytes do arquivo de entrada, conferidos junto com a chave
+    uint32_t w, h, stride, flags;
+    uint64_t total;
+    double media, desvio;      // da original
+    double media_eq, desvio_eq;
+    uint64_t hist[256];        // da original; o da equalizada sai dele pela LUT
+    uint8_t lut_eq[256];
+} CabecalhoCache;
+
+typedef struct {
+    int ativo;
+    char dir[1024];
+    int gravar;                // consultas sempre; gravações só quando o modo pede
+    uint64_t limite;           // bytes
+    uint64_t total;            // bytes no diretório, estimado pelas gravações desde a última varredura
+    int total_conhecido;
+    SDL_SpinLock trava;        // total e total_conhecido
+    SDL_AtomicInt acertos, faltas, gravadas, descartadas;
+    SDL_AtomicInt limpando;    // um worker por vez aplica o limite
+} CacheResultados;
+
+static CacheResultados g_cache;
+
+// Entrada encontrada: o cabeçalho e as vistas apontam para o arquivo mapeado até cache_liberar
+typedef struct {
+    ArquivoMapeado mapa;
+    const CabecalhoCache* cab;
+    ImagemLuma original;       // com o alfa, se houver
+    ImagemLuma equalizada;     // compartilha o alfa da original
+} EntradaCache;
+
+#define XXH_P1 0x9E3779B185EBCA87ull
+#define XXH_P2 0xC2B2AE3D27D4EB4Full
+#define XXH_P3 0x165667B19E3779F9ull
+#define XXH_P4 0x85EBCA77C2B2AE63ull
+#define XXH_P5 0x27D4EB2F165667C5ull
+
+static uint64_t xxh_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t xxh_ler64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t xxh_rodada(uint64_t acc, uint64_t v) {
+    return xxh_rotl(acc + v * XXH_P2, 31) * XXH_P1;
+}
+
+static uint64_t xxh_juntar(uint64_t h, uint64_t v) {
+    return (h ^ xxh_rodada(0, v)) * XXH_P1 + XXH_P4;
+}
+
+// XXH64 (os mesmos valores da referência em máquinas little-endian)
+static uint64_t hash_xxh64(const uint8_t* p, size_t n, uint64_t semente) {
+    const uint8_t* fim = p + n;
+    uint64_t h;
+    if (n >= 32) {
+        uint64_t v1 = semente + XXH_P1 + XXH_P2, v2 = semente + XXH_P2, v3 = semente, v4 = semente - XXH_P1;
+        for (; fim - p >= 32; p += 32) {
+            v1 = xxh_rodada(v1, xxh_ler64(p));
+            v2 = xxh_rodada(v2, xxh_ler64(p + 8));
+            v3 = xxh_rodada(v3, xxh_ler64(p + 16));
+            v4 = xxh_rodada(v4, xxh_ler64(p + 24));
+        }
+        h = xxh_rotl(v1, 1) + xxh_rotl(v2, 7) + xxh_rotl(v3, 12) + xxh_rotl(v4, 18);
+        h = xxh_juntar(xxh_juntar(xxh_juntar(xxh_juntar(h, v1), v2), v3), v4);
+    } else {
+        h = semente + XXH_P5;
+    }
+    h += (uint64_t)n;
+    for (; fim - p >= 8; p += 8) h = xxh_rotl(h ^ xxh_rodada(0, xxh_ler64(p)), 27) * XXH_P1 + XXH_P4;
+    if (fim - p >= 4) {
+        uint32_t k;
+        memcpy(&k, p, sizeof(k));
+        h = xxh_rotl(h ^ (uint64_t)k * XXH_P1, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+    }
+    for (; p < fim; p++) h = xxh_rotl(h ^ (uint64_t)*p * XXH_P5, 11) * XXH_P1;
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    return h ^ (h >> 32);
+}
+
+typedef struct {
+    const uint8_t* dados;
+    size_t n;
+    uint64_t* hashes;          // um por bloco
+} ContextoHash;
+
+static void tarefa_hash(void* data, int bloco) {
+    ContextoHash* ctx = (ContextoHash*)data;
+    size_t ini = (size_t)bloco * CACHE_BLOCO_HASH;
+    size_t n = ctx->n - ini < CACHE_BLOCO_HASH ? ctx->n - ini : CACHE_BLOCO_HASH;
+    ctx->hashes[bloco] = hash_xxh64(ctx->dados + ini, n, (uint64_t)bloco);
+}
+
+// Chave do cache para os bytes de um arquivo de entrada: hash do conteúdo mais os parâmetros da operação
+static uint64_t cache_chave(const uint8_t* dados, size_t n) {
+    uint64_t parametros[6] = { 0, (uint64_t)n, CACHE_VERSAO, PROCIMG_CINZA_R, PROCIMG_CINZA_G, PROCIMG_CINZA_B };
+    ContextoHash ctx;
+    int n_blocos = (int)((n + CACHE_BLOCO_HASH - 1) / CACHE_BLOCO_HASH);
+    ctx.dados = dados;
+    ctx.n = n;
+    ctx.hashes = malloc((size_t)n_blocos * sizeof(uint64_t));
+    if (ctx.hashes) {
+        procimg_paralelo_para(n_blocos, tarefa_hash, &ctx);
+        parametros[0] = hash_xxh64((const uint8_t*)ctx.hashes, (size_t)n_blocos * sizeof(uint64_t), 0);
+        free(ctx.hashes);
+    } else {
+        parametros[0] = hash_xxh64(dados, n, 0);
+    }
+    return hash_xxh64((const uint8_t*)parametros, sizeof(parametros), 0);
+}
+
+// Escolhe o diretório e o limite pelas variáveis de ambiente (chamada no início dos modos que usam o cache);
+// com 'gravar' zerado o cache só é consultado
+static void cache_iniciar(int gravar) {
+    const char* mib = SDL_getenv("PROJ1_CACHE_MIB");
+    const char* dir = SDL_getenv("PROJ1_CACHE");
+    double limite_mib = mib && *mib ? atof(mib) : CACHE_LIMITE_PADRAO_MIB;
+    g_cache.ativo = 0;
+    g_cache.gravar = gravar;
+    g_cache.total = 0;
+    g_cache.total_conhecido = 0;
+    g_cache.dir[0] = '\0';
+    if (dir && *dir) {
+        SDL_strlcpy(g_cache.dir, dir, sizeof(g_cache.dir));
+    } else {
+#if defined(_WIN32)
+        const char* base = SDL_getenv("LOCALAPPDATA");
+        if (base && *base) SDL_snprintf(g_cache.dir, sizeof(g_cache.dir), "%s\\proj1", base);
+#else
+        const char* xdg = SDL_getenv("XDG_CACHE_HOME");
+        const char* home = SDL_getenv("HOME");
+        if (xdg && *xdg) SDL_snprintf(g_cache.dir, sizeof(g_cache.dir), "%s/proj1", xdg);
+        else if (home && *home) SDL_snprintf(g_cache.dir, sizeof(g_cache.dir), "%s/.cache/proj1", home);
+#endif
+    }
+    if (limite_mib <= 0.0 || !g_cache.dir[0]) {
+        SDL_Log("Cache de resultados desligado");
+        return;
+    }
+    if (!SDL_CreateDirectory(g_cache.dir)) {
+        SDL_Log("Cache: não foi possível criar '%s' (%s); seguindo sem cache", g_cache.dir, SDL_GetError());
+        return;
+    }
+    g_cache.limite = (uint64_t)(limite_mib * 1024.0 * 1024.0);
+    g_cache.ativo = 1;
+    SDL_Log("Cache de resultados em '%s' (limite %.0f MiB%s)", g_cache.dir, limite_mib,
+            gravar ? "" : ", só consulta");
+}
+
+static void cache_caminho(char* dst, size_t cap, uint64_t chave) {
+    SDL_snprintf(dst, cap, "%s/%016llx.cache", g_cache.dir, (unsigned long long)chave);
+}
+
+// Confere se o arquivo mapeado é a entrada inteira da chave pedida
+static int cache_validar(const ArquivoMapeado* m, uint64_t chave, size_t tamanho_entrada) {
+    if (m->tamanho < CACHE_CABECALHO) return 0;
+    const CabecalhoCache* c = (const CabecalhoCache*)m->dados;
+    if (memcmp(c->magico, CACHE_MAGICO, sizeof(CACHE_MAGICO) - 1) != 0 || c->chave != chave ||
+        c->tamanho_entrada != (uint64_t)tamanho_entrada || c->w == 0 || c->h == 0 || c->stride < c->w ||
+        c->w > INT32_MAX || c->h > INT32_MAX || c->stride > INT32_MAX) {
+        return 0;
+    }
+    uint64_t planos = (c->flags & CACHE_ALFA) ? 3 : 2;
+    return (uint64_t)m->tamanho == CACHE_CABECALHO + planos * (uint64_t)c->stride * (uint64_t)c->h;
+}
+
+// Renova a data de modificação de uma entrada usada, que é a ordem do descarte (sem mmap fica a da gravação)
+static void cache_renovar(const char* caminho) {
+#if defined(PROJ_MMAP)
+    (void)utimensat(AT_FDCWD, caminho, NULL, 0);
+#else
+    (void)caminho;
+#endif
+}
+
+// Monta o cabeçalho e as vistas de uma entrada já mapeada e validada
+static void cache_vistas(EntradaCache* e) {
+    const CabecalhoCache* c = e->cab = (const CabecalhoCache*)e->mapa.dados;
+    size_t plano = (size_t)c->stride * c->h;
+    uint8_t* p = e->mapa.dados + CACHE_CABECALHO;
+    e->original = vista_luma(p, (int)c->w, (int)c->h, c->stride);
+    if (c->flags & CACHE_ALFA) e->original.a = (p += plano);
+    e->equalizada = vista_luma(p + plano, (int)c->w, (int)c->h, c->stride);
+    e->equalizada.a = e->original.a;
+    e->original.versao = nova_versao_imagem();
+    e->equalizada.versao = nova_versao_imagem();
+}
+
+// Procura a entrada da chave; retorna 0 num acerto, com a entrada mapeada até cache_liberar
+static int cache_buscar(uint64_t chave, size_t tamanho_entrada, EntradaCache* e) {
+    memset(e, 0, sizeof(*e));
+    if (!g_cache.ativo) return -1;
+    char caminho[1100];
+    cache_caminho(caminho, sizeof(caminho), chave);
+    if (mapa_abrir(&e->mapa, caminho) != 0 || !cache_validar(&e->mapa, chave, tamanho_entrada)) {
+        mapa_fechar(&e->mapa);
+        SDL_AddAtomicInt(&g_cache.faltas, 1);
+        return -1;
+    }
+    cache_vistas(e);
+    cache_renovar(caminho);
+    SDL_AddAtomicInt(&g_cache.acertos, 1);
+    return 0;
+}
+
+static void cache_liberar(EntradaCache* e) {
+    mapa_fechar(&e->mapa);
+    memset(e, 0, sizeof(*e));
+}
+
+typedef struct {
+    char* nome;
+    uint64_t bytes;
+    SDL_Time uso;
+} ArquivoCache;
+
+static int comparar_uso(const void* a, const void* b) {
+    SDL_Time x = ((const ArquivoCache*)a)->uso, y = ((const ArquivoCache*)b)->uso;
+    return (x > y) - (x < y);
+}
+
+// Aplica o limite de tamanho: varre o diretório e apaga as entradas usadas há mais tempo até o total caber
+static void cache_limitar(void) {
+    if (!SDL_CompareAndSwapAtomicInt(&g_cache.limpando, 0, 1)) return;
+    int n = 0;
+    char** nomes = SDL_GlobDirectory(g_cache.dir, "*.cache", 0, &n);
+    ArquivoCache* arquivos = nomes && n > 0 ? malloc((size_t)n * sizeof(*arquivos)) : NULL;
+    if (arquivos) {
+        char caminho[1100];
+        SDL_PathInfo info;
+        uint64_t total = 0;
+        int k = 0;
+        for (int i = 0; i < n; i++) {
+            SDL_snprintf(caminho, sizeof(caminho), "%s/%s", g_cache.dir, nomes[i]);
+            if (!SDL_GetPathInfo(caminho, &info) || info.type != SDL_PATHTYPE_FILE) continue;
+            arquivos[k].nome = nomes[i];
+            arquivos[k].bytes = info.size;
+            arquivos[k].uso = info.modify_time;
+            total += arquivos[k++].bytes;
+        }
+        if (total > g_cache.limite) qsort(arquivos, (size_t)k, sizeof(*arquivos), comparar_uso);
+        for (int i = 0; i < k && total > g_cache.limite; i++) {
+            SDL_snprintf(caminho, sizeof(caminho), "%s/%s", g_cache.dir, arquivos[i].nome);
+            if (SDL_RemovePath(caminho)) {
+                total -= arquivos[i].bytes;
+                SDL_AddAtomicInt(&g_cache.descartadas, 1);
+            }
+        }
+        free(arquivos);
+        // A varredura corrige a estimativa, inclusive com o que outros processos gravaram ou apagaram
+        SDL_LockSpinlock(&g_cache.trava);
+        g_cache.total = total;
+        g_cache.total_conhecido = 1;
+        SDL_UnlockSpinlock(&g_cache.trava);
+    } else if (nomes && n == 0) {
+        SDL_LockSpinlock(&g_cache.trava);
+        g_cache.total = 0;
+        g_cache.total_conhecido = 1;
+        SDL_UnlockSpinlock(&g_cache.trava);
+    }
+    SDL_free(nomes);
+    SDL_SetAtomicInt(&g_cache.limpando, 0);
+}
+
+// Soma uma entrada gravada ao total; o diretório só é varrido na primeira vez e quando o total passa do limite
+static void cache_contar(uint64_t bytes) {
+    SDL_LockSpinlock(&g_cache.trava);
+    g_cache.total += bytes;
+    int varrer = !g_cache.total_conhecido || g_cache.total > g_cache.limite;
+    SDL_UnlockSpinlock(&g_cache.trava);
+    if (varrer) cache_limitar();
+}
+
+// Grava a entrada de uma imagem recém-carregada (planos, histograma e se já era cinza); a equalizada é escrita
+// pela LUT direto no arquivo mapeado. Com 'e', a entrada gravada volta mapeada (como num acerto, até
+// cache_liberar) para quem também precisa da equalizada. Retorna 0 se gravou; uma falha aqui só custa o cache.
+static int cache_guardar(uint64_t chave, size_t tamanho_entrada, const ImagemLuma* img, const uint64_t hist[256],
+                         uint64_t total, int era_cinza, EntradaCache* e) {
+    if (e) memset(e, 0, sizeof(*e));
+    if (!g_cache.ativo || !g_cache.gravar) return -1;
+    size_t plano = (size_t)img->stride * (size_t)img->h;
+    size_t bytes = CACHE_CABECALHO + plano * (img->a ? 3 : 2);
+    char caminho[1100];
+    cache_caminho(caminho, sizeof(caminho), chave);
+    // mapa_criar grava num temporário com PID e thread no nome e o renomeia sobre a entrada no fechamento
+    ArquivoMapeado m;
+    if (mapa_criar(&m, caminho, bytes) != 0) {
+        SDL_Log("Cache: não foi possível criar '%s' (%s)", caminho, strerror(errno));
+        return -1;
+    }
+
+    CabecalhoCache* c = (CabecalhoCache*)m.dados;
+    uint64_t hist_eq[256];
+    memset(m.dados, 0, CACHE_CABECALHO);
+    memcpy(c->magico, CACHE_MAGICO, sizeof(CACHE_MAGICO) - 1);
+    c->chave = chave;
+    c->tamanho_entrada = (uint64_t)tamanho_entrada;
+    c->w = (uint32_t)img->w;
+    c->h = (uint32_t)img->h;
+    c->stride = (uint32_t)img->stride;
+    c->flags = (img->a ? CACHE_ALFA : 0u) | (era_cinza ? CACHE_CINZA : 0u);
+    c->total = total;
+    memcpy(c->hist, hist, sizeof(c->hist));
+    procimg_lut_equalizacao(hist, c->lut_eq);
+    histograma_por_lut(hist, c->lut_eq, hist_eq);
+    procimg_estatisticas(hist, &c->media, &c->desvio);
+    procimg_estatisticas(hist_eq, &c->media_eq, &c->desvio_eq);
+
+    uint8_t* p = m.dados + CACHE_CABECALHO;
+    for (int y = 0; y < img->h; y++) {
+        memcpy(p + (size_t)y * img->stride, img->y + (size_t)y * img->stride, (size_t)img->w);
+        if (img->a) memcpy(p + plano + (size_t)y * img->stride, img->a + (size_t)y * img->stride, (size_t)img->w);
+    }
+    ImagemLuma eq = vista_luma(p + (img->a ? 2 : 1) * plano, img->w, img->h, (size_t)img->stride);
+    (void)equalizar_com_lut(img, &eq, c->lut_eq);
+
+    if (!mapa_fechar(&m)) {
+        SDL_Log("Cache: falha ao gravar '%s': %s", caminho, SDL_GetError());
+        return -1;
+    }
+    SDL_AddAtomicInt(&g_cache.gravadas, 1);
+    // Relida do cache de páginas; se outro processo já trocou a entrada, ela ainda precisa ser válida
+    if (e && (mapa_abrir(&e->mapa, caminho) != 0 || !cache_validar(&e->mapa, chave, tamanho_entrada))) {
+        mapa_fechar(&e->mapa);
+    } else if (e) {
+        cache_vistas(e);
+    }
+    cache_contar(bytes);
+    return 0;
+}
+
+static void cache_log(void) {
+    if (!g_cache.ativo) return;
+    int acertos = SDL_GetAtomicInt(&g_cache.acertos), faltas = SDL_GetAtomicInt(&g_cache.faltas);
+    SDL_Log("Cache: %d consulta(s), %d acerto(s) (%.1f%%), %d falta(s); %d entrada(s) gravada(s), %d descartada(s)",
+            acertos + faltas, acertos, acertos + faltas ? 100.0 * acertos / (acertos + faltas) : 0.0, faltas,
+            SDL_GetAtomicInt(&g_cache.gravadas), SDL_GetAtomicInt(&g_cache.descartadas));
+}
+
+// Consulta o cache pelo conteúdo do arquivo (a chave fica em *chave, para a gravação depois de uma falta). Num
+// acerto devolve a original copiada do cache, com o histograma, e deixa a entrada mapeada em *ent para a cópia
+// da equalizada.
+static ImagemLuma* carregar_luma_do_cache(const char* caminho, uint64_t* chave, size_t* tamanho, EntradaCache* ent,
+                                          uint64_t hist[256], uint64_t* total_pixels, int* era_cinza) {
+    ArquivoMapeado in;
+    memset(ent, 0, sizeof(*ent));
+    *chave = 0;
+    *tamanho = 0;
+    if (!g_cache.ativo || mapa_abrir(&in, caminho) != 0) return NULL;
+    *tamanho = in.tamanho;
+    *chave = cache_chave(in.dados, in.tamanho);
+    mapa_fechar(&in);
+    if (cache_buscar(*chave, *tamanho, ent) != 0) return NULL;
+    ImagemLuma* img = imagem_luma_copiar(&ent->original);
+    if (!img) {
+        cache_liberar(ent);
+        return NULL;
+    }
+    memcpy(hist, ent->cab->hist, 256 * sizeof(uint64_t));
+    *total_pixels = ent->cab->total;
+    *era_cinza = (ent->cab->flags & CACHE_CINZA) != 0;
+    return img;
+}
+
+//-------------------------------------------------------------------------------------------------------------------------
+// Modo em lote (sem janelas): processa um diretório inteiro usando um worker por núcleo
+
+typedef struct {
+    const char* dir_entrada;
+    const char* dir_saida;
+    const char* extensao;     // formato de saída: "png", "pgm", "luma" ou "qoi"
+    char** arquivos;          // nomes relativos a dir_entrada
+    int n_arquivos;
+    SDL_AtomicInt proximo;    // índice do próximo arquivo a ser pego por um worker
+    SDL_AtomicInt processadas;
+    SDL_AtomicInt falhas;
+} ContextoLote;
+
+typedef struct {
+    ContextoLote* lote;
+    uint64_t pixels;          // pixels processados por este worker (somados no final)
+} WorkerLote;
+
+// Monta o caminho de saída: <dir_saida>/<nome sem extensão>.<extensao>
+static void caminho_saida_lote(char* dst, size_t cap, const char* dir_saida, const char* nome,
+                               const char* extensao) {
+    const char* barra = strrchr(nome, '/');
+#if defined(_WIN32)
+    const char* barra_win = strrchr(nome, '\\');
+    if (!barra || (barra_win && barra_win > barra)) barra = barra_win;
+#endif
+    const char* base = barra ? barra + 1 : nome;
+    const char* ponto = strrchr(base, '.');
+    int len = ponto ? (int)(ponto - base) : (int)strlen(base);
+    SDL_snprintf(dst, cap, "%s/%.*s.%s", dir_saida, len, base, extensao);
+}
+
+// Cadeia completa de uma imagem: carrega, garante cinza, equaliza no próprio buffer e salva.
+// PGM/PPM/.luma com saída .pgm/.luma vão inteiros pelos arquivos mapeados, sem SDL_image; o resto consulta o
+// cache de resultados antes de decodificar.
+static int processar_imagem_lote(const char* entrada, const char* saida, uint64_t* pixels) {
+    int r = equalizar_arquivo_mapeado(entrada, saida, pixels);
+    if (r <= 0) {
+        if (r < 0) SDL_Log("Lote: falha ao equalizar '%s' em '%s'", entrada, saida);
+        return r;
+    }
+
+    // PGM de 16 bits para PNG/QOI: equalizado nos 16 bits, reduzido só para gravar
+    ImagemLuma16* img16 = carregar_luma16_mapeada(entrada);
+    if (img16) {
+        ImagemLuma* img = imagem_luma_criar(img16->w, img16->h, 0);
+        int ok = img && equalizar_luma16(img16, img, NULL) == 0 && salvar_luma(img, saida);
+        if (!ok) SDL_Log("Lote: falha ao salvar '%s': %s", saida, SDL_GetError());
+        else *pixels += (uint64_t)img16->w * (uint64_t)img16->h;
+        imagem_luma_destruir(img);
+        imagem_luma16_destruir(img16);
+        return ok ? 0 : -1;
+    }
+
+    // O resto passa pelo SDL_image. O arquivo é mapeado uma vez, para a chave do cache e, numa falta, para a
+    // decodificação; num acerto a equalizada vai do cache direto para a saída
+    ArquivoMapeado in;
+    if (mapa_abrir(&in, entrada) != 0) {
+        SDL_Log("Lote: ignorando '%s' (%s)", entrada, strerror(errno));
+        return -1;
+    }
+    size_t tamanho_entrada = in.tamanho;
+    uint64_t chave = g_cache.ativo ? cache_chave(in.dados, in.tamanho) : 0;
+    EntradaCache ent;
+    if (cache_buscar(chave, tamanho_entrada, &ent) == 0) {
+        mapa_fechar(&in);
+        int ok = salvar_luma(&ent.equalizada, saida);
+        if (!ok) SDL_Log("Lote: falha ao salvar '%s': %s", saida, SDL_GetError());
+        else *pixels += ent.cab->total;
+        cache_liberar(&ent);
+        return ok ? 0 : -1;
+    }
+    SDL_IOStream* io = SDL_IOFromConstMem(in.dados, in.tamanho);
+    SDL_Surface* initial_img = io ? IMG_Load_IO(io, true) : NULL;
+    mapa_fechar(&in);
+    if (!initial_img) {
+        SDL_Log("Lote: ignorando '%s' (%s)", entrada, SDL_GetError());
+        return -1;
+    }
+    SurfaceRgba conv;   // pixels do pool de buffers
+    SDL_Surface* rgba = surface_rgba_de(initial_img, &conv) == 0 ? conv.s : NULL;
+    if (!rgba) {
+        SDL_Log("Lote: falha ao converter '%s' para RGBA32: %s", entrada, SDL_GetError());
+        return -1;
+    }
+    if (rgba->w <= 0 || rgba->h <= 0 || !SDL_LockSurface(rgba)) {
+        SDL_Log("Lote: imagem inválida '%s'", entrada);
+        surface_rgba_liberar(&conv);
+        return -1;
+    }
+
+    // Uma passada garante o cinza, separa a intensidade e gera o histograma; a surface RGBA é
+    // liberada logo em seguida e uma segunda passada aplica a LUT de equalização
+    uint64_t hist[256];
+    uint64_t total = 0;
+    int era_cinza = 0;
+    ImagemLuma* img = imagem_luma_de_surface(rgba, hist, &total, &era_cinza);
+    SDL_UnlockSurface(rgba);
+    surface_rgba_liberar(&conv);
+    if (!img || total == 0) {
+        SDL_Log("Lote: não foi possível criar a matriz de mapeamento de '%s'", entrada);
+        imagem_luma_destruir(img);
+        return -1;
+    }
+    // Gravando no cache, a equalizada já sai na entrada e a saída vem dela; senão, sem janela não há o que
+    // alternar: equaliza direto sobre a própria imagem
+    if (cache_guardar(chave, tamanho_entrada, img, hist, total, era_cinza, &ent) == 0 && ent.cab) {
+        imagem_luma_destruir(img);
+        int ok = salvar_luma(&ent.equalizada, saida);
+        if (!ok) SDL_Log("Lote: falha ao salvar '%s': %s", saida, SDL_GetError());
+        else *pixels += ent.cab->total;
+        cache_liberar(&ent);
+        return ok ? 0 : -1;
+    }
+    uint8_t lut_eq[256];
+    procimg_lut_equalizacao(hist, lut_eq);
+    (void)equalizar_com_lut(img, img, lut_eq);
+
+    int ok = salvar_luma(img, saida);
+    if (!ok) SDL_Log("Lote: falha ao salvar '%s': %s", saida, SDL_GetError());
+    else *pixels += (uint64_t)img->w * (uint64_t)img->h;
+
+    imagem_luma_destruir(img);
+    return ok ? 0 : -1;
+}
+
+static int worker_lote(void* data) {
+    WorkerLote* wk = (WorkerLote*)data;
+    ContextoLote* lote = wk->lote;
+    char entrada[4096], saida[4096];
+
+    for (;;) {
+        int i = SDL_AddAtomicInt(&lote->proximo, 1);
+        if (i >= lote->n_arquivos) break;
+
+        SDL_snprintf(entrada, sizeof(entrada), "%s/%s", lote->dir_entrada, lote->arquivos[i]);
+        caminho_saida_lote(saida, sizeof(saida), lote->dir_saida, lote->arquivos[i], lote->extensao);
+
+        if (processar_imagem_lote(entrada, saida, &wk->pixels) == 0) SDL_AddAtomicInt(&lote->processadas, 1);
+        else SDL_AddAtomicInt(&lote->falhas, 1);
+    }
+    return 0;
+}
+
+static int executar_modo_lote(const char* dir_entrada, const char* dir_saida, const char* extensao) {
+    if (!SDL_Init(0)) {
+        printf("Erro ao inicializar SDL: %s\n", SDL_GetError());
+        return 1;
+    }
+    iniciar_procimg();
+    const char* gravar_cache = SDL_getenv("PROJ1_CACHE_LOTE");
+    cache_iniciar(gravar_cache && atoi(gravar_cache) != 0);
+
+    SDL_PathInfo info;
+    if (!SDL_GetPathInfo(dir_entrada, &info) || info.type != SDL_PATHTYPE_DIRECTORY) {
+        fprintf(stderr, "Erro: '%s' não é um diretório.\n", dir_entrada);
+        SDL_Quit();
+        return 1;
+    }
+    if (!SDL_CreateDirectory(dir_saida)) {
+        fprintf(stderr, "Erro: não foi possível criar '%s' (%s)\n", dir_saida, SDL_GetError());
+        SDL_Quit();
+        return 1;
+    }
+
+    int n_entradas = 0;
+    char** entradas = SDL_GlobDirectory(dir_entrada, "*", 0, &n_entradas);
+    if (!entradas) {
+        fprintf(stderr, "Erro ao listar '%s': %s\n", dir_entrada, SDL_GetError());
+        SDL_Quit();
+        return 1;
+    }
+
+    // Mantém somente arquivos regulares (subdiretórios são ignorados)
+    ContextoLote lote;
+    memset(&lote, 0, sizeof(lote));
+    lote.dir_entrada = dir_entrada;
+    lote.dir_saida = dir_saida;
+    lote.extensao = extensao;
+    lote.arquivos = entradas;
+    char caminho[4096];
+    for (int i = 0; i < n_entradas; i++) {
+        SDL_snprintf(caminho, sizeof(caminho), "%s/%s", dir_entrada, entradas[i]);
+        if (SDL_GetPathInfo(caminho, &info) && info.type == SDL_PATHTYPE_FILE) {
+            entradas[lote.n_arquivos++] = entradas[i];
+        }
+    }
+
+    int n_workers = SDL_GetNumLogicalCPUCores();
+    if (n_workers < 1) n_workers = 1;
+    // Com imagens suficientes para todos os núcleos, cada imagem roda em uma thread só;
+    // com poucas imagens, o pool de threads ainda divide cada uma em faixas
+    if (lote.n_arquivos >= n_workers) procimg_definir_threads(1);
+    if (n_workers > lote.n_arquivos) n_workers = lote.n_arquivos > 0 ? lote.n_arquivos : 1;
+
+    WorkerLote* workers = calloc((size_t)n_workers, sizeof(*workers));
+    SDL_Thread** threads = calloc((size_t)n_workers, sizeof(*threads));
+    if (!workers || !threads) {
+        fprintf(stderr, "Erro: sem memória para os workers do lote.\n");
+        free(workers); free(threads); SDL_free(entradas); SDL_Quit();
+        return 1;
+    }
+
+    printf("Lote: %d arquivo(s) em '%s' -> '%s' (.%s) com %d worker(s)\n",
+           lote.n_arquivos, dir_entrada, dir_saida, extensao, n_workers);
+
+    Uint64 t0 = SDL_GetPerformanceCounter();
+
+    // O worker 0 roda na própria thread principal
+    for (int i = 0; i < n_workers; i++) workers[i].lote = &lote;
+    for (int i = 1; i < n_workers; i++) {
+        threads[i] = SDL_CreateThread(worker_lote, "worker_lote", &workers[i]);
+        if (!threads[i]) SDL_Log("Lote: não foi possível criar worker %d: %s", i, SDL_GetError());
+    }
+    worker_lote(&workers[0]);
+
+    uint64_t pixels = workers[0].pixels;
+    for (int i = 1; i < n_workers; i++) {
+        if (threads[i]) SDL_WaitThread(threads[i], NULL);
+        pixels += workers[i].pixels;
+    }
+
+    double segundos = (double)(SDL_GetPerformanceCounter() - t0) / (double)SDL_GetPerformanceFrequency();
+    if (segundos <= 0.0) segundos = 1e-9;
+    int processadas = SDL_GetAtomicInt(&lote.processadas);
+    int falhas = SDL_GetAtomicInt(&lote.falhas);
+
+    printf("Lote concluído: %d imagem(ns) processada(s), %d falha(s) em %.3f s\n", processadas, falhas, segundos);
+    printf("Vazão: %.2f imagens/s | %.2f MPix/s\n",
+           processadas / segundos, (double)pixels / 1e6 / segundos);
+
+    free(threads);
+    free(workers);
+    SDL_free(entradas);
+    cache_log();
+    buffers_log();
+    buffers_esvaziar();
+    procimg_encerrar();
+    SDL_Quit();
+    return falhas > 0 ? 1 : 0;
+}
+
+//-------------------------------------------------------------------------------------------------------------------------
+// Modo streaming: equalização em duas passadas sobre faixas de linhas. A primeira lê a imagem só para
+// o histograma global; a segunda lê de novo, aplica a LUT e grava cada faixa. O pico de memória fica
+// limitado ao tamanho da faixa.
+
+// Escrita em faixas: PGM é gravado conforme as faixas chegam e .luma direto no arquivo mapeado; os demais
+// formatos (PNG, QOI) precisam da imagem inteira
+typedef struct {
+    FILE* f;                  // saída PGM, gravada em 'temporario'
+    char* temporario;
+    ArquivoMapeado mapa;      // saída .luma
+    ImagemLuma plano;         // linhas da saída .luma dentro do mapeamento
+    ImagemLuma* inteira;      // demais formatos: acumula e salva no final
+    const char* caminho;
+    int linha;
+} EscritorFaixas;
+
+static int escritor_abrir(EscritorFaixas* e, const char* caminho, int w, int h) {
+    memset(e, 0, sizeof(*e));
+    e->caminho = caminho;
+    if (termina_com(caminho, ".pgm")) {
+        // O destino só é substituído no fechamento: a 2ª passada ainda lê a entrada, que pode ser o mesmo arquivo
+        e->temporario = nome_temporario(caminho);
+        e->f = e->temporario ? fopen(e->temporario, "wb") : NULL;
+        if (!e->f) {
+            fprintf(stderr, "Erro: não foi possível criar '%s' (%s)\n", caminho, strerror(errno));
+            SDL_free(e->temporario);
+            e->temporario = NULL;
+            return -1;
+        }
+        fprintf(e->f, "P5\n%d %d\n255\n", w, h);
+        return 0;
+    }
+    if (bruto_formato_saida(caminho) == BRUTO_LUMA) return bruto_criar_saida(&e->mapa, caminho, BRUTO_LUMA, w, h, &e->plano);
+    SDL_Log("Aviso: a saída '%s' não é PGM nem .luma; a imagem equalizada será montada inteira na memória.", caminho);
+    e->inteira = imagem_luma_criar(w, h, 0);
+    return e->inteira ? 0 : -1;
+}
+
+static int escritor_escrever(EscritorFaixas* e, const ImagemLuma* faixa) {
+    for (int y = 0; y < faixa->h; y++, e->linha++) {
+        const uint8_t* src = faixa->y + (size_t)y * faixa->stride;
+        if (e->f) {
+            if (fwrite(src, 1, (size_t)faixa->w, e->f) != (size_t)faixa->w) return -1;
+        } else {
+            ImagemLuma* dst = e->inteira ? e->inteira : &e->plano;
+            memcpy(dst->y + (size_t)e->linha * dst->stride, src, (size_t)faixa->w);
+        }
+    }
+    return 0;
+}
+
+// Com 'manter', entrega a saída no destino e retorna 1 se tudo foi gravado; sem, descarta o que foi escrito,
+// deixa o destino como estava e retorna 0
+static int escritor_fechar(EscritorFaixas* e, int manter) {
+    int ok = manter;
+    if (e->f) {
+        ok = fclose(e->f) == 0 && ok && SDL_RenamePath(e->temporario, e->caminho);
+        if (!ok) SDL_RemovePath(e->temporario);
+        SDL_free(e->temporario);
+    }
+    if (e->mapa.dados) {
+        if (manter) ok = mapa_fechar(&e->mapa);
+        else mapa_descartar(&e->mapa);
+    }
+    if (e->inteira) {
+        if (manter) ok = salvar_luma(e->inteira, e->caminho);
+        imagem_luma_destruir(e->inteira);
+    }
+    memset(e, 0, sizeof(*e));
+    return ok;
+}
+
+#define STREAM_BYTES_FAIXA_PADRAO (64u << 20)
+
+static int executar_modo_streaming(const char* entrada, const char* saida, int linhas_por_faixa) {
+    if (!SDL_Init(0)) {
+        printf("Erro ao inicializar SDL: %s\n", SDL_GetError());
+        return 1;
+    }
+    iniciar_procimg();
+
+    LeitorFaixas leitor;
+    if (leitor_abrir(&leitor, entrada) != 0) {
+        procimg_encerrar();
+        SDL_Quit();
+        return 1;
+    }
+    int w = leitor.w, h = leitor.h;
+    if (linhas_por_faixa <= 0) linhas_por_faixa = (int)(STREAM_BYTES_FAIXA_PADRAO / (unsigned)w);
+    if (linhas_por_faixa < 1) linhas_por_faixa = 1;
+    if (linhas_por_faixa > h) linhas_por_faixa = h;
+
+    ImagemLuma* faixa = imagem_luma_criar(w, linhas_por_faixa, 0);
+    if (!faixa) {
+        fprintf(stderr, "Erro: sem memória para uma faixa de %d linhas.\n", linhas_por_faixa);
+        leitor_fechar(&leitor);
+        SDL_Quit();
+        return 1;
+    }
+    printf("Streaming: %dx%d em faixas de %d linhas (%.1f MiB por faixa)\n", w, h, linhas_por_faixa,
+           (double)faixa->stride * linhas_por_faixa / (1024.0 * 1024.0));
+
+    Uint64 t0 = SDL_GetPerformanceCounter();
+    int erro = 0;
+
+    // 1ª passada: histograma global
+    uint64_t hist[256] = {0};
+    uint64_t total = 0;
+    for (;;) {
+        faixa->h = linhas_por_faixa;
+        int n = leitor_ler(&leitor, faixa);
+        if (n <= 0) { erro = n < 0; break; }
+        faixa->h = n;
+
+        uint64_t parcial[256], total_parcial = 0;
+        calcular_histograma(faixa, parcial, &total_parcial);
+        for (int i = 0; i < 256; i++) hist[i] += parcial[i];
+        total += total_parcial;
+    }
+    if (erro || total != (uint64_t)w * (uint64_t)h) {
+        fprintf(stderr, "Erro: leitura incompleta de '%s'.\n", entrada);
+        erro = 1;
+    }
+
+    // 2ª passada: aplica a LUT e grava faixa a faixa
+    EscritorFaixas escritor;
+    int escritor_aberto = 0;
+    if (!erro) {
+        uint8_t lut_eq[256];
+        procimg_lut_equalizacao(hist, lut_eq);
+
+        if (leitor_reiniciar(&leitor) != 0 || escritor_abrir(&escritor, saida, w, h) != 0) erro = 1;
+        else escritor_aberto = 1;
+
+        while (!erro) {
+            faixa->h = linhas_por_faixa;
+            int n = leitor_ler(&leitor, faixa);
+            if (n <= 0) { erro = n < 0; break; }
+            faixa->h = n;
+            (void)equalizar_com_lut(faixa, faixa, lut_eq);
+            if (escritor_escrever(&escritor, faixa) != 0) erro = 1;
+        }
+    }
+    if (escritor_aberto && !escritor_fechar(&escritor, !erro && escritor.linha == h)) erro = 1;
+
+    double segundos = (double)(SDL_GetPerformanceCounter() - t0) / (double)SDL_GetPerformanceFrequency();
+    if (segundos <= 0.0) segundos = 1e-9;
+
+    if (erro) {
+        fprintf(stderr, "Erro: falha no streaming de '%s' para '%s'.\n", entrada, saida);
+    } else {
+        double media = 0.0, desvio = 0.0;
+        procimg_estatisticas(hist, &media, &desvio);
+        printf("Original: media=%.1f (%s), desvio=%.1f (contraste %s)\n",
+               media, class_luminosidade(media), desvio, class_contraste(desvio));
+        printf("Streaming concluído em %.3f s | %.2f MPix/s (duas leituras da entrada)\n",
+               segundos, (double)total / 1e6 / segundos);
+    }
+
+    faixa->h = linhas_por_faixa;
+    imagem_luma_destruir(faixa);
+    leitor_fechar(&leitor);
+    buffers_log();
+    buffers_esvaziar();
+    procimg_encerrar();
+    SDL_Quit();
+    return erro ? 1 : 0;
+}
+
+//-------------------------------------------------------------------------------------------------------------------------
+// Modo sequência: equaliza os quadros de um diretório numerado ou de um vídeo Y4M na entrada padrão. São três
+// etapas, cada uma em sua thread (decodificar -> equalizar -> codificar), ligadas por filas circulares
+// limitadas de um produtor e um consumidor, sem travas. Os quadros codificados voltam ao decodificador por uma
+// fila de reciclagem, então os buffers são alocados só no início (ou quando o tamanho do quadro muda) e a
+// decodificação pode andar até SEQ_QUADROS quadros à frente de um codificador lento.
+
+#if defined(_WIN32)
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+#define SEQ_FILA 8                 // capacidade de cada fila (potência de 2)
+#define SEQ_QUADROS SEQ_FILA       // quadros em circulação; cabem todos em qualquer fila
+#define SEQ_ESPERA_GIRO 64         // tentativas com pause antes de ceder a CPU
+
+typedef struct {
+    ImagemLuma* img;
+    int indice;               // posição na sequência
+    const char* origem;       // nome do arquivo de entrada (NULL no Y4M)
+    int fim;                  // marcador de fim da sequência, sem pixels
+    int tem_hist;             // o histograma já veio da decodificação (PPM)
+    uint64_t hist[256];
+} Quadro;
+
+// Fila circular de um produtor e um consumidor: cada índice só é escrito por um lado, e a publicação do
+// item é a escrita atômica do índice. Os contadores crescem sem parar; a posição é o contador módulo SEQ_FILA.
+typedef struct {
+    SDL_AtomicU32 cabeca;                            // próximo a sair (só o consumidor avança)
+    char separa_cabeca[64 - sizeof(SDL_AtomicU32)];  // índices em linhas de cache diferentes
+    SDL_AtomicU32 cauda;                             // próximo a entrar (só o produtor avança)
+    char separa_cauda[64 - sizeof(SDL_AtomicU32)];
+    Quadro* itens[SEQ_FILA];
+    uint64_t amostras, soma_ocupacao;                // ocupação após cada inserção (só o produtor escreve)
+    int max_ocupacao;
+} FilaSpsc;
+
+static int fila_colocar(FilaSpsc* f, Quadro* q) {
+    Uint32 cauda = SDL_GetAtomicU32(&f->cauda);
+    Uint32 ocupacao = cauda - SDL_GetAtomicU32(&f->cabeca);
+    if (ocupacao >= SEQ_FILA) return 0;
+    f->itens[cauda & (SEQ_FILA - 1)] = q;
+    SDL_SetAtomicU32(&f->cauda, cauda + 1);
+
+    f->amostras++;
+    f->soma_ocupacao += ocupacao + 1;
+    if ((int)ocupacao + 1 > f->max_ocupacao) f->max_ocupacao = (int)ocupacao + 1;
+    return 1;
+}
+
+static Quadro* fila_tirar(FilaSpsc* f) {
+    Uint32 cabeca = SDL_GetAtomicU32(&f->cabeca);
+    if (cabeca == SDL_GetAtomicU32(&f->cauda)) return NULL;
+    Quadro* q = f->itens[cabeca & (SEQ_FILA - 1)];
+    SDL_SetAtomicU32(&f->cabeca, cabeca + 1);
+    return q;
+}
+
+typedef enum { SEQ_DECODIFICAR, SEQ_EQUALIZAR, SEQ_CODIFICAR, N_ETAPAS_SEQ } EtapaSeq;
+
+static const char* const NOMES_ETAPAS_SEQ[N_ETAPAS_SEQ] = { "decodificar", "equalizar", "codificar" };
+
+typedef struct {
+    int quadros;
+    Uint64 ocupada;           // contadores de performance trabalhando
+    Uint64 esperando;         // contadores de performance parada em uma fila
+} MedidaEtapaSeq;
+
+// Vídeo Y4M: só o plano Y (8 bits) é equalizado; a crominância da entrada é descartada
+typedef struct {
+    int w, h;
+    size_t croma;             // bytes de crominância por quadro
+    char taxa[32];            // parâmetro F ("F30000:1001")
+    char aspecto[32];         // parâmetro A ("A1:1")
+} CabecalhoY4m;
+
+typedef struct {
+    FilaSpsc livres;          // codificar -> decodificar (reciclagem)
+    FilaSpsc decodificados;   // decodificar -> equalizar
+    FilaSpsc equalizados;     // equalizar -> codificar
+    Quadro quadros[SEQ_QUADROS];
+    SDL_AtomicInt abortar;    // erro fatal em qualquer etapa: as outras saem das esperas
+    MedidaEtapaSeq medidas[N_ETAPAS_SEQ];
+
+    // entrada: diretório ou Y4M
+    const char* dir_entrada;
+    char** arquivos;
+    int n_arquivos;
+    FILE* y4m_entrada;
+    CabecalhoY4m y4m;
+    uint8_t* descarte;        // crominância lida e jogada fora
+    int falhas;               // arquivos ignorados pelo decodificador
+
+    // saída: diretório ou Y4M
+    const char* dir_saida;
+    const char* extensao;
+    FILE* y4m_saida;
+    int saida_w, saida_h;     // tamanho fixado pelo primeiro quadro do Y4M de saída
+    int codificados;
+    uint64_t pixels;
+} Sequencia;
+
+static void seq_esperar(int* tentativas) {
+    if (++*tentativas < SEQ_ESPERA_GIRO) SDL_CPUPauseInstruction();
+    else if (*tentativas < 2 * SEQ_ESPERA_GIRO) SDL_Delay(0);
+    else SDL_Delay(1);
+}
+
+// Tira um quadro de 'f', esperando se ela estiver vazia; NULL se o pipeline foi abortado
+static Quadro* seq_tirar(Sequencia* s, FilaSpsc* f, MedidaEtapaSeq* m) {
+    Quadro* q = fila_tirar(f);
+    if (q) return q;
+    Uint64 t0 = SDL_GetPerformanceCounter();
+    int tentativas = 0;
+    while (!(q = fila_tirar(f)) && !SDL_GetAtomicInt(&s->abortar)) seq_esperar(&tentativas);
+    m->esperando += SDL_GetPerformanceCounter() - t0;
+    return q;
+}
+
+// Coloca 'q' em 'f', esperando se ela estiver cheia; 0 se o pipeline foi abortado
+static int seq_colocar(Sequencia* s, FilaSpsc* f, Quadro* q, MedidaEtapaSeq* m) {
+    if (fila_colocar(f, q)) return 1;
+    Uint64 t0 = SDL_GetPerformanceCounter();
+    int tentativas = 0, ok;
+    while (!(ok = fila_colocar(f, q)) && !SDL_GetAtomicInt(&s->abortar)) seq_esperar(&tentativas);
+    m->esperando += SDL_GetPerformanceCounter() - t0;
+    return ok;
+}
+
+// Ordem natural dos nomes: trechos numéricos são comparados pelo valor ("q2" antes de "q10")
+static int comparar_nomes_numerados(const void* a, const void* b) {
+    const char* x = *(const char* const*)a;
+    const char* y = *(const char* const*)b;
+    while (*x && *y) {
+        if (SDL_isdigit((unsigned char)*x) && SDL_isdigit((unsigned char)*y)) {
+            while (*x == '0') x++;
+            while (*y == '0') y++;
+            size_t nx = 0, ny = 0;
+            while (SDL_isdigit((unsigned char)x[nx])) nx++;
+            while (SDL_isdigit((unsigned char)y[ny])) ny++;
+            if (nx != ny) return nx < ny ? -1 : 1;
+            int c = strncmp(x, y, nx);
+            if (c) return c;
+            x += nx;
+            y += ny;
+        } else {
+            if (*x != *y) return (unsigned char)*x < (unsigned char)*y ? -1 : 1;
+            x++;
+            y++;
+        }
+    }
+    return (unsigned char)*x - (unsigned char)*y;
+}
+
+// Lê o cabeçalho "YUV4MPEG2 W.. H.. ..." (uma linha) e calcula o tamanho da crominância de cada quadro
+static int y4m_ler_cabecalho(FILE* f, CabecalhoY4m* c) {
+    char linha[512];
+    if (!fgets(linha, sizeof(linha), f) || strncmp(linha, "YUV4MPEG2 ", 10) != 0) {
+        fprintf(stderr, "Erro: a entrada não é um vídeo Y4M.\n");
+        return -1;
+    }
+    memset(c, 0, sizeof(*c));
+    SDL_strlcpy(c->taxa, "F25:1", sizeof(c->taxa));
+    SDL_strlcpy(c->aspecto, "A1:1", sizeof(c->aspecto));
+    const char* croma = "420jpeg";
+
+    for (char* tok = strtok(linha + 10, " \n"); tok; tok = strtok(NULL, " \n")) {
+        switch (tok[0]) {
+        case 'W': c->w = atoi(tok + 1); break;
+        case 'H': c->h = atoi(tok + 1); break;
+        case 'F': SDL_strlcpy(c->taxa, tok, sizeof(c->taxa)); break;
+        case 'A': SDL_strlcpy(c->aspecto, tok, sizeof(c->aspecto)); break;
+        case 'C': croma = tok + 1; break;
+        default: break;   // entrelaçamento e extensões não mudam a equalização
+        }
+    }
+    if (c->w <= 0 || c->h <= 0) {
+        fprintf(stderr, "Erro: Y4M sem dimensões válidas.\n");
+        return -1;
+    }
+    size_t cw = (size_t)(c->w + 1) / 2, ch = (size_t)(c->h + 1) / 2, plano = (size_t)c->w * (size_t)c->h;
+    int oito_bits = !strstr(croma, "p1") && !strstr(croma, "16");   // "420p10", "mono16"...
+    if (oito_bits && strncmp(croma, "420", 3) == 0) c->croma = 2 * cw * ch;
+    else if (strcmp(croma, "422") == 0) c->croma = 2 * cw * (size_t)c->h;
+    else if (strcmp(croma, "444") == 0) c->croma = 2 * plano;
+    else if (strcmp(croma, "444alpha") == 0) c->croma = 3 * plano;
+    else if (strcmp(croma, "mono") == 0) c->croma = 0;
+    else {
+        fprintf(stderr, "Erro: Y4M com amostragem 'C%s' não suportada (só 8 bits).\n", croma);
+        return -1;
+    }
+    return 0;
+}
+
+// Lê o próximo quadro do Y4M; 1 se leu, 0 no fim do vídeo, -1 se o quadro estiver truncado
+static int y4m_ler_quadro(Sequencia* s, Quadro* q) {
+    char linha[256];
+    if (!fgets(linha, sizeof(linha), s->y4m_entrada)) return 0;
+    if (strncmp(linha, "FRAME", 5) != 0) return -1;
+    if (imagem_luma_reusar(&q->img, s->y4m.w, s->y4m.h) != 0) return -1;
+    for (int y = 0; y < q->img->h; y++) {
+        if (fread(q->img->y + (size_t)y * q->img->stride, 1, (size_t)q->img->w, s->y4m_entrada) != (size_t)q->img->w) {
+            return -1;
+        }
+    }
+    if (s->y4m.croma && fread(s->descarte, 1, s->y4m.croma, s->y4m_entrada) != s->y4m.croma) return -1;
+    return 1;
+}
+
+static int thread_decodificar(void* data) {
+    Sequencia* s = (Sequencia*)data;
+    MedidaEtapaSeq* m = &s->medidas[SEQ_DECODIFICAR];
+    char caminho[4096];
+    int indice = 0, proximo_arquivo = 0;
+
+    for (;;) {
+        Quadro* q = seq_tirar(s, &s->livres, m);
+        if (!q) return 0;
+
+        Uint64 t0 = SDL_GetPerformanceCounter();
+        q->fim = 0;
+        q->tem_hist = 0;
+        q->origem = NULL;
+        int lido = 0;
+        if (s->y4m_entrada) {
+            lido = y4m_ler_quadro(s, q);
+            if (lido < 0) {
+                fprintf(stderr, "Erro: quadro %d do Y4M truncado ou inválido.\n", indice);
+                s->falhas++;
+                lido = 0;
+            }
+        } else {
+            while (!lido && proximo_arquivo < s->n_arquivos) {
+                const char* nome = s->arquivos[proximo_arquivo++];
+                SDL_snprintf(caminho, sizeof(caminho), "%s/%s", s->dir_entrada, nome);
+                if (decodificar_arquivo_luma(caminho, &q->img, q->hist, &q->tem_hist) == 0) {
+                    q->origem = nome;
+                    lido = 1;
+                } else {
+                    SDL_Log("Sequência: ignorando '%s' (%s)", caminho, SDL_GetError());
+                    s->falhas++;
+                }
+            }
+        }
+        q->indice = indice;
+        q->fim = !lido;
+        m->ocupada += SDL_GetPerformanceCounter() - t0;
+
+        // Depois de colocado, o quadro pertence às próximas etapas e pode até já ter sido reciclado
+        if (!seq_colocar(s, &s->decodificados, q, m) || !lido) return 0;
+        m->quadros++;
+        indice++;
+    }
+}
+
+static int thread_equalizar(void* data) {
+    Sequencia* s = (Sequencia*)data;
+    MedidaEtapaSeq* m = &s->medidas[SEQ_EQUALIZAR];
+
+    for (;;) {
+        Quadro* q = seq_tirar(s, &s->decodificados, m);
+        if (!q) return 0;
+        int fim = q->fim;
+        if (!fim) {
+            Uint64 t0 = SDL_GetPerformanceCounter();
+            uint64_t total = (uint64_t)q->img->w * (uint64_t)q->img->h;
+            uint8_t lut_eq[256];
+            if (!q->tem_hist) calcular_histograma(q->img, q->hist, &total);
+            procimg_lut_equalizacao(q->hist, lut_eq);
+            (void)equalizar_com_lut(q->img, q->img, lut_eq);
+            m->ocupada += SDL_GetPerformanceCounter() - t0;
+            m->quadros++;
+        }
+        if (!seq_colocar(s, &s->equalizados, q, m) || fim) return 0;
+    }
+}
+
+static int seq_codificar_quadro(Sequencia* s, const Quadro* q) {
+    const ImagemLuma* img = q->img;
+    if (!s->y4m_saida) {
+        char saida[4096];
+        if (q->origem) caminho_saida_lote(saida, sizeof(saida), s->dir_saida, q->origem, s->extensao);
+        else SDL_snprintf(saida, sizeof(saida), "%s/quadro_%06d.%s", s->dir_saida, q->indice, s->extensao);
+        if (salvar_luma(img, saida)) return 0;
+        fprintf(stderr, "Erro: falha ao salvar '%s': %s\n", saida, SDL_GetError());
+        return -1;
+    }
+
+    // Y4M de saída: só o plano Y (Cmono), com o tamanho do primeiro quadro
+    if (s->codificados == 0) {
+        s->saida_w = img->w;
+        s->saida_h = img->h;
+        fprintf(s->y4m_saida, "YUV4MPEG2 W%d H%d %s Ip %s Cmono\n", img->w, img->h,
+                s->y4m_entrada ? s->y4m.taxa : "F25:1", s->y4m_entrada ? s->y4m.aspecto : "A1:1");
+    } else if (img->w != s->saida_w || img->h != s->saida_h) {
+        fprintf(stderr, "Erro: o quadro %d tem %dx%d; o Y4M de saída é %dx%d.\n", q->indice, img->w, img->h,
+                s->saida_w, s->saida_h);
+        return -1;
+    }
+    fputs("FRAME\n", s->y4m_saida);
+    for (int y = 0; y < img->h; y++) {
+        if (fwrite(img->y + (size_t)y * img->stride, 1, (size_t)img->w, s->y4m_saida) != (size_t)img->w) {
+            fprintf(stderr, "Erro: falha ao escrever o Y4M de saída (%s)\n", strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// A codificação roda na thread que chama; devolve os quadros para a fila de reciclagem
+static int etapa_codificar(Sequencia* s) {
+    MedidaEtapaSeq* m = &s->medidas[SEQ_CODIFICAR];
+    for (;;) {
+        Quadro* q = seq_tirar(s, &s->equalizados, m);
+        if (!q || q->fim) return q ? 0 : -1;
+
+        Uint64 t0 = SDL_GetPerformanceCounter();
+        int r = seq_codificar_quadro(s, q);
+        m->ocupada += SDL_GetPerformanceCounter() - t0;
+        if (r != 0) {
+            SDL_SetAtomicInt(&s->abortar, 1);
+            return -1;
+        }
+        m->quadros++;
+        s->codificados++;
+        s->pixels += (uint64_t)q->img->w * (uint64_t)q->img->h;
+        if (!seq_colocar(s, &s->livres, q, m)) return -1;
+    }
+}
+
+// Lista os arquivos regulares de 'dir' em ordem natural; NULL (com mensagem) se não for um diretório
+static char** seq_listar_diretorio(const char* dir, int* n_arquivos) {
+    SDL_PathInfo info;
+    if (!SDL_GetPathInfo(dir, &info) || info.type != SDL_PATHTYPE_DIRECTORY) {
+        fprintf(stderr, "Erro: '%s' não é um diretório.\n", dir);
+        return NULL;
+    }
+    int n_entradas = 0;
+    char** entradas = SDL_GlobDirectory(dir, "*", 0, &n_entradas);
+    if (!entradas) {
+        fprintf(stderr, "Erro ao listar '%s': %s\n", dir, SDL_GetError());
+        return NULL;
+    }
+    char caminho[4096];
+    *n_arquivos = 0;
+    for (int i = 0; i < n_entradas; i++) {
+        SDL_snprintf(caminho, sizeof(caminho), "%s/%s", dir, entradas[i]);
+        if (SDL_GetPathInfo(caminho, &info) && info.type == SDL_PATHTYPE_FILE) entradas[(*n_arquivos)++] = entradas[i];
+    }
+    qsort(entradas, (size_t)*n_arquivos, sizeof(char*), comparar_nomes_numerados);
+    return entradas;
+}
+
+static void seq_relatorio(const Sequencia* s, double segundos) {
+    static const char* const NOMES_FILAS[3] = { "livres", "decodificados", "equalizados" };
+    const FilaSpsc* filas[3] = { &s->livres, &s->decodificados, &s->equalizados };
+    double freq = (double)SDL_GetPerformanceFrequency();
+
+    fprintf(stderr, "Sequência concluída: %d quadro(s), %d falha(s) em %.3f s | %.2f quadros/s | %.2f MPix/s\n",
+            s->codificados, s->falhas, segundos, s->codificados / segundos, (double)s->pixels / 1e6 / segundos);
+    for (int e = 0; e < N_ETAPAS_SEQ; e++) {
+        const MedidaEtapaSeq* m = &s->medidas[e];
+        double ocupada = (double)m->ocupada / freq, esperando = (double)m->esperando / freq;
+        fprintf(stderr, "  %-12s %6d quadro(s) | ocupada %5.1f%% | esperando %5.1f%% | %8.2f quadros/s sozinha\n",
+                NOMES_ETAPAS_SEQ[e], m->quadros, 100.0 * ocupada / segundos, 100.0 * esperando / segundos,
+                ocupada > 0.0 ? m->quadros / ocupada : 0.0);
+    }
+    for (int i = 0; i < 3; i++) {
+        const FilaSpsc* f = filas[i];
+        fprintf(stderr, "  fila %-14s ocupação média %.2f / %d, máxima %d\n", NOMES_FILAS[i],
+                f->amostras ? (double)f->soma_ocupacao / (double)f->amostras : 0.0, SEQ_FILA, f->max_ocupacao);
+    }
+}
+
+// entrada/saida: diretório ou "-" para Y4M na entrada/saída padrão; extensao vale para a saída em diretório
+static int executar_modo_sequencia(const char* entrada, const char* saida, const char* extensao) {
+    if (!SDL_Init(0)) {
+        fprintf(stderr, "Erro ao inicializar SDL: %s\n", SDL_GetError());
+        return 1;
+    }
+    iniciar_procimg();
+
+    Sequencia* s = calloc(1, sizeof(*s));
+    if (!s) {
+        SDL_Quit();
+        return 1;
+    }
+    s->dir_entrada = entrada;
+    s->dir_saida = saida;
+    s->extensao = extensao;
+    int erro = 0;
+
+    if (strcmp(entrada, "-") == 0) {
+#if defined(_WIN32)
+        _setmode(_fileno(stdin), _O_BINARY);
+#endif
+        s->y4m_entrada = stdin;
+        erro = y4m_ler_cabecalho(stdin, &s->y4m) != 0;
+        if (!erro && s->y4m.croma && !(s->descarte = malloc(s->y4m.croma))) erro = 1;
+    } else {
+        erro = !(s->arquivos = seq_listar_diretorio(entrada, &s->n_arquivos));
+    }
+    if (!erro && strcmp(saida, "-") == 0) {
+#if defined(_WIN32)
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        s->y4m_saida = stdout;
+    } else if (!erro && !SDL_CreateDirectory(saida)) {
+        fprintf(stderr, "Erro: não foi possível criar '%s' (%s)\n", saida, SDL_GetError());
+        erro = 1;
+    }
+
+    if (!erro) {
+        if (s->y4m_entrada) {
+            fprintf(stderr, "Sequência: Y4M %dx%d (%s) -> %s\n", s->y4m.w, s->y4m.h, s->y4m.taxa,
+                    s->y4m_saida ? "Y4M" : saida);
+        } else {
+            fprintf(stderr, "Sequência: %d arquivo(s) em '%s' -> %s\n", s->n_arquivos, entrada,
+                    s->y4m_saida ? "Y4M" : saida);
+        }
+        for (int i = 0; i < SEQ_QUADROS; i++) (void)fila_colocar(&s->livres, &s->quadros[i]);
+        s->livres.amostras = s->livres.soma_ocupacao = 0;   // a carga inicial não conta na ocupação
+        s->livres.max_ocupacao = 0;
+
+        Uint64 t0 = SDL_GetPerformanceCounter();
+        SDL_Thread* decodificar = SDL_CreateThread(thread_decodificar, "seq_decodificar", s);
+        SDL_Thread* equalizar = decodificar ? SDL_CreateThread(thread_equalizar, "seq_equalizar", s) : NULL;
+        if (!decodificar || !equalizar) {
+            fprintf(stderr, "Erro: não foi possível criar as threads do pipeline: %s\n", SDL_GetError());
+            SDL_SetAtomicInt(&s->abortar, 1);
+            erro = 1;
+        } else {
+            erro = etapa_codificar(s) != 0;
+        }
+        if (decodificar) SDL_WaitThread(decodificar, NULL);
+        if (equalizar) SDL_WaitThread(equalizar, NULL);
+        if (s->y4m_saida && fflush(s->y4m_saida) != 0) erro = 1;
+
+        double segundos = (double)(SDL_GetPerformanceCounter() - t0) / (double)SDL_GetPerformanceFrequency();
+        if (segundos <= 0.0) segundos = 1e-9;
+        seq_relatorio(s, segundos);
+    }
+
+    for (int i = 0; i < SEQ_QUADROS; i++) imagem_luma_destruir(s->quadros[i].img);
+    int falhas = s->falhas;
+    free(s->descarte);
+    SDL_free(s->arquivos);
+    free(s);
+    buffers_log();
+    buffers_esvaziar();
+    procimg_encerrar();
+    SDL_Quit();
+    return erro || falhas > 0 ? 1 : 0;
+}
+
+//-------------------------------------------------------------------------------------------------------------------------
+// Modo servidor: processo residente que atende pedidos por um socket UNIX. O SDL_Init, a escolha dos kernels e
+// o pool de threads acontecem uma vez só, e não a cada imagem. Cada conexão tem sua thread e seus buffers
+// (imagem de trabalho e área de recepção), reaproveitados entre os pedidos da mesma conexão. Conexões
+// simultâneas dividem os núcleos: quem encontra o pool ocupado roda na própria thread.
+//
+// Protocolo em texto, no estilo de cabeçalhos: um pedido são linhas "chave valor" terminadas por uma linha vazia.
+//   entrada <caminho>          imagem no disco, ou
+//   bytes <n>                  imagem inline: os n bytes do arquivo vêm logo depois da linha vazia
+//   saida <caminho>            formato pela extensão (.png, .pgm, .luma, .qoi)
+//   ops <cinza|equalizar>      operações separadas por vírgula (padrão: equalizar; a conversão para cinza
+//                              sempre acontece)
+//   comando <status|encerrar>  em vez de processar uma imagem
+// A resposta tem o mesmo formato: "ok 1" ou "erro <mensagem>", as estatísticas e uma linha vazia. A conexão
+// pode mandar vários pedidos em sequência.
+
+#if !defined(_WIN32)
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#define PROJ_SOCKET 1
+#endif
+
+#if defined(PROJ_SOCKET)
+
+#define SERVIDOR_CLIENTES_MAX 32
+#define SERVIDOR_LINHA_MAX 4096
+#define SERVIDOR_BYTES_MAX ((size_t)1 << 30)   // maior imagem inline aceita
+#define SERVIDOR_POLL_MS 250                    // intervalo para notar pedidos de encerramento
+
+typedef struct {
+    int fd;
+    uint8_t buf[8192];
+    size_t ini, fim;
+} LeituraSocket;
+
+static int socket_encher(LeituraSocket* l) {
+    ssize_t n;
+    do n = recv(l->fd, l->buf, sizeof(l->buf), 0); while (n < 0 && errno == EINTR);
+    if (n <= 0) return -1;
+    l->ini = 0;
+    l->fim = (size_t)n;
+    return 0;
+}
+
+// Lê uma linha sem o '\n' (e sem '\r'); retorna o tamanho ou -1 no fim da conexão ou se a linha não couber
+static int socket_ler_linha(LeituraSocket* l, char* linha, size_t cap) {
+    size_t n = 0;
+    for (;;) {
+        if (l->ini == l->fim && socket_encher(l) != 0) return -1;
+        char c = (char)l->buf[l->ini++];
+        if (c == '\n') break;
+        if (n + 1 >= cap) return -1;
+        linha[n++] = c;
+    }
+    if (n > 0 && linha[n - 1] == '\r') n--;
+    linha[n] = '\0';
+    return (int)n;
+}
+
+static int socket_ler_bytes(LeituraSocket* l, uint8_t* dst, size_t n) {
+    while (n > 0) {
+        if (l->ini == l->fim) {
+            // O que falta vai direto para o destino, sem passar pelo buffer da linha
+            if (n >= sizeof(l->buf)) {
+                ssize_t r;
+                do r = recv(l->fd, dst, n, 0); while (r < 0 && errno == EINTR);
+                if (r <= 0) return -1;
+                dst += r;
+                n -= (size_t)r;
+                continue;
+            }
+            if (socket_encher(l) != 0) return -1;
+        }
+        size_t k = l->fim - l->ini < n ? l->fim - l->ini : n;
+        memcpy(dst, l->buf + l->ini, k);
+        l->ini += k;
+        dst += k;
+        n -= k;
+    }
+    return 0;
+}
+
+static int socket_enviar(int fd, const char* texto) {
+    size_t n = strlen(texto);
+    while (n > 0) {
+        ssize_t r = send(fd, texto, n, 0);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        texto += r;
+        n -= (size_t)r;
+    }
+    return 0;
+}
+
+typedef struct Servidor Servidor;
+
+typedef struct {
+    int fd;                   // socket da conexão; fechado pela thread principal (-1 = vaga livre)
+    SDL_Thread* thread;
+    SDL_AtomicInt terminou;
+    Servidor* servidor;
+} ClienteServidor;
+
+struct Servidor {
+    int fd;
+    const char* caminho;
+    SDL_AtomicInt encerrar;   // pedido "comando encerrar" ou sinal
+    SDL_Mutex* mutex;         // protege as estatísticas abaixo
+    int pedidos, falhas, conexoes;
+    uint64_t pixels;
+    Uint64 inicio;
+    ClienteServidor clientes[SERVIDOR_CLIENTES_MAX];
+};
+
+static volatile sig_atomic_t g_sinal_encerrar = 0;
+
+static void servidor_sinal(int sinal) {
+    (void)sinal;
+    g_sinal_encerrar = 1;
+}
+
+typedef struct {
+    char entrada[SERVIDOR_LINHA_MAX];
+    char saida[SERVIDOR_LINHA_MAX];
+    char comando[32];
+    size_t bytes;
+    int embutida;             // a imagem vem nos bytes depois do pedido
+    int equalizar;
+} PedidoServidor;
+
+// Lê os cabeçalhos de um pedido; 1 se leu, 0 se a conexão fechou antes de um pedido, -1 em erro de protocolo
+static int servidor_ler_pedido(LeituraSocket* l, PedidoServidor* p, char* erro, size_t cap_erro) {
+    char linha[SERVIDOR_LINHA_MAX];
+    memset(p, 0, sizeof(*p));
+    p->equalizar = 1;
+    int linhas = 0;
+    for (;;) {
+        int n = socket_ler_linha(l, linha, sizeof(linha));
+        if (n < 0) {
+            SDL_snprintf(erro, cap_erro, "linha longa demais ou conexão interrompida");
+            return linhas ? -1 : 0;
+        }
+        if (n == 0) {
+            if (linhas) return 1;
+            continue;   // linhas vazias entre pedidos
+        }
+        linhas++;
+        char* valor = strchr(linha, ' ');
+        if (!valor) {
+            SDL_snprintf(erro, cap_erro, "linha sem valor: '%s'", linha);
+            return -1;
+        }
+        *valor++ = '\0';
+        if (strcmp(linha, "entrada") == 0) {
+            SDL_strlcpy(p->entrada, valor, sizeof(p->entrada));
+        } else if (strcmp(linha, "saida") == 0) {
+            SDL_strlcpy(p->saida, valor, sizeof(p->saida));
+        } else if (strcmp(linha, "comando") == 0) {
+            SDL_strlcpy(p->comando, valor, sizeof(p->comando));
+        } else if (strcmp(linha, "bytes") == 0) {
+            char* fim = NULL;
+            unsigned long long b = strtoull(valor, &fim, 10);
+            if (!fim || *fim || b == 0 || b > SERVIDOR_BYTES_MAX) {
+                SDL_snprintf(erro, cap_erro, "tamanho inline inválido: '%s'", valor);
+                return -1;
+            }
+            p->bytes = (size_t)b;
+            p->embutida = 1;
+        } else if (strcmp(linha, "ops") == 0) {
+            p->equalizar = 0;
+            for (char* op = valor; op; ) {
+                char* virgula = strchr(op, ',');
+                if (virgula) *virgula = '\0';
+                if (strcmp(op, "equalizar") == 0) p->equalizar = 1;
+                else if (strcmp(op, "cinza") != 0) {
+                    SDL_snprintf(erro, cap_erro, "operação desconhecida: '%s'", op);
+                    return -1;
+                }
+                op = virgula ? virgula + 1 : NULL;
+            }
+        } else {
+            SDL_snprintf(erro, cap_erro, "chave desconhecida: '%s'", linha);
+            return -1;
+        }
+    }
+}
+
+static void servidor_status(Servidor* s, char* resposta, size_t cap) {
+    SDL_LockMutex(s->mutex);
+    double segundos = (double)(SDL_GetPerformanceCounter() - s->inicio) / (double)SDL_GetPerformanceFrequency();
+    EstatisticasBuffers b = buffers_estatisticas();
+    SDL_snprintf(resposta, cap, "ok 1\npedidos %d\nfalhas %d\nconexoes %d\nmpix %.3f\nsegundos_ativo %.1f\n"
+                 "threads %d\nbuffers_acertos %llu\nbuffers_faltas %llu\nbuffers_pico_mib %.1f\n"
+                 "buffers_retidos_mib %.1f\n\n", s->pedidos, s->falhas, s->conexoes, (double)s->pixels / 1e6,
+                 segundos, procimg_threads(), (unsigned long long)b.acertos, (unsigned long long)b.faltas,
+                 (double)b.pico_bytes / (1024.0 * 1024.0), (double)b.bytes_retidos / (1024.0 * 1024.0));
+    SDL_UnlockMutex(s->mutex);
+}
+
+// Atende um pedido de imagem; *img é a imagem de trabalho da conexão
+static int servidor_processar(const PedidoServidor* p, const uint8_t* recebido, ImagemLuma** img,
+                              char* resposta, size_t cap) {
+    if (!p->saida[0] || (p->entrada[0] != '\0') == p->embutida) {
+        SDL_snprintf(resposta, cap, "erro o pedido precisa de 'saida' e de 'entrada' ou 'bytes'\n\n");
+        return -1;
+    }
+    double freq = (double)SDL_GetPerformanceFrequency();
+    Uint64 t0 = SDL_GetPerformanceCounter();
+    uint64_t hist[256];
+    int tem_hist = 0;
+    int r = p->embutida ? decodificar_luma(recebido, p->bytes, img, hist, &tem_hist)
+                       : decodificar_arquivo_luma(p->entrada, img, hist, &tem_hist);
+    if (r != 0) {
+        SDL_snprintf(resposta, cap, "erro não foi possível decodificar a entrada: %s\n\n", SDL_GetError());
+        return -1;
+    }
+    Uint64 t1 = SDL_GetPerformanceCounter();
+
+    uint64_t total = (uint64_t)(*img)->w * (uint64_t)(*img)->h;
+    if (!tem_hist) calcular_histograma(*img, hist, &total);
+    double media_orig, desvio_orig, media, desvio;
+    procimg_estatisticas(hist, &media_orig, &desvio_orig);
+    media = media_orig;
+    desvio = desvio_orig;
+    if (p->equalizar) {
+        uint8_t lut_eq[256];
+        uint64_t hist_eq[256];
+        procimg_lut_equalizacao(hist, lut_eq);
+        (void)equalizar_com_lut(*img, *img, lut_eq);
+        histograma_por_lut(hist, lut_eq, hist_eq);
+        procimg_estatisticas(hist_eq, &media, &desvio);
+    }
+    Uint64 t2 = SDL_GetPerformanceCounter();
+
+    if (!salvar_luma(*img, p->saida)) {
+        SDL_snprintf(resposta, cap, "erro falha ao salvar '%s': %s\n\n", p->saida, SDL_GetError());
+        return -1;
+    }
+    Uint64 t3 = SDL_GetPerformanceCounter();
+
+    SDL_snprintf(resposta, cap,
+                 "ok 1\nsaida %s\nlargura %d\naltura %d\nmedia_original %.3f\ndesvio_original %.3f\n"
+                 "media %.3f\ndesvio %.3f\nms_decodificar %.3f\nms_processar %.3f\nms_gravar %.3f\n\n",
+                 p->saida, (*img)->w, (*img)->h, media_orig, desvio_orig, media, desvio,
+                 (double)(t1 - t0) * 1e3 / freq, (double)(t2 - t1) * 1e3 / freq, (double)(t3 - t2) * 1e3 / freq);
+    return 0;
+}
+
+static int thread_cliente_servidor(void* data) {
+    ClienteServidor* c = (ClienteServidor*)data;
+    Servidor* s = c->servidor;
+    LeituraSocket* l = malloc(sizeof(*l));
+    PedidoServidor* p = malloc(sizeof(*p));
+    char resposta[SERVIDOR_LINHA_MAX + 512], erro[256];
+    ImagemLuma* img = NULL;       // reaproveitada entre os pedidos da conexão
+    uint8_t* recebido = NULL;
+    size_t cap_recebido = 0;
+
+    if (l && p) {
+        l->fd = c->fd;
+        l->ini = l->fim = 0;
+    }
+    while (l && p && !SDL_GetAtomicInt(&s->encerrar)) {
+        int r = servidor_ler_pedido(l, p, erro, sizeof(erro));
+        if (r <= 0) {
+            if (r < 0) {
+                SDL_snprintf(resposta, sizeof(resposta), "erro %s\n\n", erro);
+                socket_enviar(c->fd, resposta);
+            }
+            break;
+        }
+        if (p->embutida && p->bytes > cap_recebido) {
+            free(recebido);
+            cap_recebido = p->bytes;
+            if (!(recebido = malloc(cap_recebido))) {
+                cap_recebido = 0;
+                socket_enviar(c->fd, "erro sem memória para a imagem inline\n\n");
+                break;
+            }
+        }
+        if (p->embutida && socket_ler_bytes(l, recebido, p->bytes) != 0) break;
+
+        int ok = 1;
+        if (strcmp(p->comando, "status") == 0) {
+            servidor_status(s, resposta, sizeof(resposta));
+        } else if (strcmp(p->comando, "encerrar") == 0) {
+            SDL_SetAtomicInt(&s->encerrar, 1);
+            SDL_snprintf(resposta, sizeof(resposta), "ok 1\n\n");
+        } else if (p->comando[0]) {
+            SDL_snprintf(resposta, sizeof(resposta), "erro comando desconhecido: '%s'\n\n", p->comando);
+            ok = 0;
+        } else {
+            ok = servidor_processar(p, recebido, &img, resposta, sizeof(resposta)) == 0;
+            SDL_LockMutex(s->mutex);
+            s->pedidos++;
+            if (!ok) s->falhas++;
+            else s->pixels += (uint64_t)img->w * (uint64_t)img->h;
+            SDL_UnlockMutex(s->mutex);
+        }
+        if (!ok) SDL_Log("Servidor: %.*s", (int)strcspn(resposta, "\n"), resposta);
+        if (socket_enviar(c->fd, resposta) != 0) break;
+    }
+
+    imagem_luma_destruir(img);
+    free(recebido);
+    free(p);
+    free(l);
+    SDL_SetAtomicInt(&c->terminou, 1);
+    return 0;
+}
+
+// Junta as threads de conexões que já terminaram e libera as vagas
+static void servidor_recolher(Servidor* s, int todas) {
+    for (int i = 0; i < SERVIDOR_CLIENTES_MAX; i++) {
+        ClienteServidor* c = &s->clientes[i];
+        if (c->fd < 0 || (!todas && !SDL_GetAtomicInt(&c->terminou))) continue;
+        if (todas) shutdown(c->fd, SHUT_RD);   // acorda quem espera o próximo pedido
+        SDL_WaitThread(c->thread, NULL);
+        close(c->fd);
+        c->fd = -1;
+        SDL_LockMutex(s->mutex);
+        s->conexoes--;
+        SDL_UnlockMutex(s->mutex);
+    }
+}
+
+// Cria o socket de escuta; um arquivo de socket antigo só é removido se ninguém estiver atendendo nele
+static int servidor_escutar(const char* caminho) {
+    struct sockaddr_un end;
+    memset(&end, 0, sizeof(end));
+    end.sun_family = AF_UNIX;
+    if (strlen(caminho) >= sizeof(end.sun_path)) {
+        fprintf(stderr, "Erro: caminho de socket longo demais: '%s'\n", caminho);
+        return -1;
+    }
+    SDL_strlcpy(end.sun_path, caminho, sizeof(end.sun_path));
+
+    struct stat st;
+    if (stat(caminho, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        int teste = socket(AF_UNIX, SOCK_STREAM, 0);
+        int ativo = teste >= 0 && connect(teste, (struct sockaddr*)&end, sizeof(end)) == 0;
+        if (teste >= 0) close(teste);
+        if (ativo) {
+            fprintf(stderr, "Erro: já há um servidor em '%s'\n", caminho);
+            return -1;
+        }
+        unlink(caminho);
+    }
+
+    // Só o próprio usuário conversa com o servidor: o socket já nasce 0600 (a umask vale durante o bind), sem
+    // janela entre o bind e o chmod em que outro usuário poderia conectar
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    mode_t umask_anterior = umask(0077);
+    int ligado = fd >= 0 && bind(fd, (struct sockaddr*)&end, sizeof(end)) == 0;
+    int erro = errno;
+    umask(umask_anterior);
+    if (ligado && chmod(caminho, 0600) != 0) {
+        erro = errno;
+        unlink(caminho);
+        ligado = 0;
+    }
+    if (!ligado || listen(fd, SERVIDOR_CLIENTES_MAX) != 0) {
+        if (ligado) erro = errno;
+        fprintf(stderr, "Erro: não foi possível escutar em '%s' (%s)\n", caminho, strerror(erro));
+        if (ligado) unlink(caminho);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int executar_modo_servidor(const char* caminho) {
+    if (!SDL_Init(0)) {
+        fprintf(stderr, "Erro ao inicializar SDL: %s\n", SDL_GetError());
+        return 1;
+    }
+    iniciar_procimg();
+
+    Servidor* s = calloc(1, sizeof(*s));
+    if (!s || !(s->mutex = SDL_CreateMutex()) || (s->fd = servidor_escutar(caminho)) < 0) {
+        if (s) SDL_DestroyMutex(s->mutex);
+        free(s);
+        SDL_Quit();
+        return 1;
+    }
+    s->caminho = caminho;
+    s->inicio = SDL_GetPerformanceCounter();
+    for (int i = 0; i < SERVIDOR_CLIENTES_MAX; i++) s->clientes[i].fd = -1;
+
+    signal(SIGINT, servidor_sinal);
+    signal(SIGTERM, servidor_sinal);
+    signal(SIGPIPE, SIG_IGN);   // cliente que fecha no meio da resposta só encerra a conexão dele
+
+    fprintf(stderr, "Servidor: escutando em '%s' com %d thread(s) no pool (Ctrl+C ou 'comando encerrar' para sair)\n",
+            caminho, procimg_threads());
+
+    while (!SDL_GetAtomicInt(&s->encerrar) && !g_sinal_encerrar) {
+        struct pollfd pfd = { s->fd, POLLIN, 0 };
+        int pronto = poll(&pfd, 1, SERVIDOR_POLL_MS);
+        servidor_recolher(s, 0);
+        if (pronto <= 0) continue;
+
+        int fd = accept(s->fd, NULL, NULL);
+        if (fd < 0) continue;
+        ClienteServidor* c = NULL;
+        for (int i = 0; i < SERVIDOR_CLIENTES_MAX && !c; i++) {
+            if (s->clientes[i].fd < 0) c = &s->clientes[i];
+        }
+        if (!c) {
+            socket_enviar(fd, "erro servidor ocupado\n\n");
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        c->servidor = s;
+        SDL_SetAtomicInt(&c->terminou, 0);
+        c->thread = SDL_CreateThread(thread_cliente_servidor, "cliente_servidor", c);
+        if (!c->thread) {
+            SDL_Log("Servidor: não foi possível criar a thread da conexão: %s", SDL_GetError());
+            close(fd);
+            c->fd = -1;
+            continue;
+        }
+        SDL_LockMutex(s->mutex);
+        s->conexoes++;
+        SDL_UnlockMutex(s->mutex);
+    }
+
+    servidor_recolher(s, 1);
+    close(s->fd);
+    unlink(caminho);
+    fprintf(stderr, "Servidor encerrado: %d pedido(s), %d falha(s), %.2f MPix\n", s->pedidos, s->falhas,
+            (double)s->pixels / 1e6);
+    SDL_DestroyMutex(s->mutex);
+    free(s);
+    buffers_log();
+    buffers_esvaziar();
+    procimg_encerrar();
+    SDL_Quit();
+    return 0;
+}
+
+#else
+
+static int executar_modo_servidor(const char* caminho) {
+    (void)caminho;
+    fprintf(stderr, "Erro: o modo servidor usa sockets UNIX e não está disponível nesta plataforma.\n");
+    return 1;
+}
+
+#endif
+
+//-------------------------------------------------------------------------------------------------------------------------
+// Carga em segundo plano (modo com janelas): as janelas abrem antes de qualquer decodificação e uma thread de carga
+// faz o resto. PGM, PPM e .luma mandam primeiro uma prévia amostrada direto do arquivo mapeado; os formatos do
+// SDL_image mandam a prévia assim que a decodificação termina, antes do cinza e do histograma. Depois chega a
+// original inteira, com histograma e LUT de equalização, e com 16 bits a equalizada, calculada de forma especulativa
+// enquanto a original já está na tela (se for pedida antes, a thread principal espera por ela). Cada resultado chega
+// ao loop por um evento e a exibição se refina: prévia, pirâmide da original com os níveis sob demanda, equalizada.
+// Com 8 bits a equalizada exibida é a LUT sobre a pirâmide da original, e a imagem equalizada inteira só é
+// calculada quando for gravada.
+
+typedef enum { CARGA_PREVIA, CARGA_ORIGINAL, CARGA_EQUALIZADA, CARGA_ERRO } EventoCarga;   // code do evento
+
+#define CARGA_JANELA_W 800       // tamanho da janela principal até as dimensões da imagem serem conhecidas
+#define CARGA_JANELA_H 600
+
+typedef struct {
+    const char* caminho;
+    SDL_Thread* thread;
+    SDL_AtomicInt cancelar;      // janelas fechadas durante a carga: o que ainda não começou é pulado
+    // Cada resultado pertence à thread de carga até o evento dele; depois só a thread principal mexe nele
+    int w, h;                    // já valem no evento da prévia
+    ImagemLuma* previa;
+    ImagemLuma* img;
+    uint64_t hist_orig[256];
+    uint64_t total_orig;
+    uint8_t lut_eq[256];
+    int escala_cinza;
+    ImagemLuma16* img16;
+    Luts16* luts16;
+    ImagemLuma* eq;              // só com 16 bits, alocada antes de CARGA_ORIGINAL e preenchida até CARGA_EQUALIZADA
+    uint64_t hist_eq16[256];
+    char erro[512];
+} Carga;
+
+static Uint32 g_evento_carga = 0;
+
+static void carga_avisar(EventoCarga evento) {
+    SDL_Event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = g_evento_carga;
+    ev.user.code = (Sint32)evento;
+    SDL_PushEvent(&ev);
+}
+
+// Tamanho da prévia: o do nível mais reduzido da pirâmide (cabe em um ladrilho)
+static void tamanho_previa(int w, int h, int* pw, int* ph) {
+    while (w > LADRILHO || h > LADRILHO) {
+        w = (w + 1) / 2;
+        h = (h + 1) / 2;
+    }
+    *pw = w;
+    *ph = h;
+}
+
+static int amostra16(const uint8_t* px) {
+    return px[0] << 8 | px[1];   // PGM de 16 bits é big-endian
+}
+
+// Prévia por vizinho mais próximo direto de pixels brutos (1 = cinza, 2 = cinza de 16 bits, 3 = RGB, 4 = RGBA),
+// lendo só os pixels da prévia. Com 16 bits as amostras são esticadas pela faixa delas mesmas.
+static ImagemLuma* previa_amostrada(const uint8_t* base, size_t pitch, int w, int h, int bytes_pixel) {
+    int pw, ph;
+    tamanho_previa(w, h, &pw, &ph);
+    ImagemLuma* p = imagem_luma_criar(pw, ph, 0);
+    if (!p) return NULL;
+    int minimo = 0, maximo = 65535;
+    for (int passada = bytes_pixel == 2 ? 0 : 1; passada < 2; passada++) {
+        if (passada == 0) {
+            minimo = 65535;
+            maximo = 0;
+        } else if (maximo <= minimo) {
+            maximo = minimo + 1;
+        }
+        for (int y = 0; y < ph; y++) {
+            const uint8_t* linha = base + (size_t)((int64_t)y * h / ph) * pitch;
+            uint8_t* dst = p->y + (size_t)y * p->stride;
+            for (int x = 0; x < pw; x++) {
+                const uint8_t* px = linha + (size_t)((int64_t)x * w / pw) * (size_t)bytes_pixel;
+                if (bytes_pixel == 2) {
+                    int v = amostra16(px);
+                    if (passada == 0) {
+                        if (v < minimo) minimo = v;
+                        if (v > maximo) maximo = v;
+                    } else {
+                        v = v < minimo ? 0 : v > maximo ? 255 : (int)((int64_t)(v - minimo) * 255 / (maximo - minimo));
+                        dst[x] = (uint8_t)v;
+                    }
+                } else {
+                    dst[x] = bytes_pixel >= 3 ? procimg_luma(px[0], px[1], px[2]) : px[0];
+                }
+            }
+        }
+    }
+    return p;
+}
+
+// Falha da carga: a mensagem vai para a thread principal, que a mostra e encerra
+static int carga_falhar(Carga* c, const char* mensagem) {
+    SDL_snprintf(c->erro, sizeof(c->erro), "%s", mensagem);
+    carga_avisar(CARGA_ERRO);
+    return 1;
+}
+
+static int thread_carga(void* data) {
+    Carga* c = (Carga*)data;
+    const char* path = c->caminho;
+    char mensagem[512];
+
+    // Formatos mapeados: prévia direto dos bytes do arquivo, antes de qualquer passada na imagem inteira
+    ArquivoMapeado in;
+    DescritorBruto d;
+    if (mapa_abrir(&in, path) == 0) {
+        if (bruto_identificar(in.dados, in.tamanho, &d) == 0) {
+            c->w = d.w;
+            c->h = d.h;
+            c->previa = previa_amostrada(in.dados + d.offset, d.stride, d.w, d.h,
+                                         d.formato == BRUTO_PPM ? 3 : d.formato == BRUTO_PGM16 ? 2 : 1);
+            if (c->previa) carga_avisar(CARGA_PREVIA);
+        }
+        mapa_fechar(&in);
+    }
+
+    //PGM e .luma vêm direto do arquivo mapeado para o plano de intensidade, sem passar pelo SDL_image. O PGM de
+    //16 bits fica com o plano de 16 bits (medido e equalizado nele) e 'img' é só a redução dele para exibição,
+    //esticando a faixa de intensidades presente sobre 0..255. Os demais formatos passam pelo SDL_image, a menos que
+    //o cache de resultados já tenha o conteúdo do arquivo (aí a original, o histograma e a LUT vêm dele).
+    Uint64 t_etapa = medir_inicio();
+    ImagemLuma* img = NULL;
+    uint64_t chave_cache = 0;
+    size_t tamanho_entrada = 0;
+    EntradaCache ent_cache;
+    memset(&ent_cache, 0, sizeof(ent_cache));
+    int guardar_no_cache = 0;
+    if ((c->img16 = carregar_luma16_mapeada(path)) != NULL) {
+        ImagemLuma16* img16 = c->img16;
+        medir_fim(ETAPA_CARGA_MAPEADA, t_etapa);
+        double media16, desvio16;
+        procimg_estatisticas16(img16->hist, &media16, &desvio16);
+        SDL_Log("Imagem de 16 bits: intensidades de %d a %d, media=%.1f, desvio=%.1f", img16->minimo, img16->maximo,
+                media16, desvio16);
+        t_etapa = medir_inicio();
+        c->luts16 = malloc(sizeof(*c->luts16));
+        img = c->luts16 ? imagem_luma_criar(img16->w, img16->h, 0) : NULL;
+        if (img) {
+            procimg_lut_janela16(img16->minimo, img16->maximo, c->luts16->janela);
+            if (reduzir_luma16(img16, c->luts16->janela, img, c->hist_orig) == 0) c->total_orig = (uint64_t)img->w * img->h;
+        }
+        medir_fim(ETAPA_REDUCAO_16, t_etapa);
+        c->escala_cinza = 1;
+        // A equalizada sai depois que a original já estiver na tela; sem memória para ela, a carga falha agora
+        if (img && !(c->eq = imagem_luma_criar(img16->w, img16->h, 0))) {
+            imagem_luma_destruir(img);
+            return carga_falhar(c, "Erro ao criar cópia para equalização.");
+        }
+    } else if ((img = carregar_luma_mapeada(path, c->hist_orig, &c->total_orig)) != NULL) {
+        medir_fim(ETAPA_CARGA_MAPEADA, t_etapa);
+        c->escala_cinza = 1;
+    } else if ((img = carregar_luma_do_cache(path, &chave_cache, &tamanho_entrada, &ent_cache, c->hist_orig,
+                                             &c->total_orig, &c->escala_cinza)) != NULL) {
+        medir_fim(ETAPA_CACHE, t_etapa);
+        SDL_Log("Cache: acerto (%016llx), media=%.1f, desvio=%.1f", (unsigned long long)chave_cache,
+                ent_cache.cab->media, ent_cache.cab->desvio);
+    } else {
+        if (g_cache.ativo) medir_fim(ETAPA_CACHE, t_etapa);
+        SDL_ClearError();
+        t_etapa = medir_inicio();
+        SDL_Surface* initial_img = IMG_Load(path);
+        medir_fim(ETAPA_IMG_LOAD, t_etapa);
+        if (!initial_img) {
+            SDL_snprintf(mensagem, sizeof(mensagem),
+                         "Erro: o arquivo não é uma imagem suportada ou está corrompido.\nDetalhe: %s", SDL_GetError());
+            return carga_falhar(c, mensagem);
+        }
+
+        t_etapa = medir_inicio();
+        SurfaceRgba conv;   // pixels do pool de buffers
+        SDL_Surface* rgba = surface_rgba_de(initial_img, &conv) == 0 ? conv.s : NULL;
+        medir_fim(ETAPA_CONVERTER_RGBA, t_etapa);
+        if (!rgba) {
+            SDL_snprintf(mensagem, sizeof(mensagem), "Erro: falha ao converter para RGBA32: %s", SDL_GetError());
+            return carga_falhar(c, mensagem);
+        }
+
+        if (rgba->w <= 0 || rgba->h <= 0) {
+            SDL_snprintf(mensagem, sizeof(mensagem), "Erro: dimensões de imagem inválidas (%dx%d).", rgba->w, rgba->h);
+            surface_rgba_liberar(&conv);
+            return carga_falhar(c, mensagem);
+        }
+
+        //garantir cinza na imagem e calcular o histograma na mesma passada; a partir daqui a imagem
+        //fica só como plano de intensidade (mais alfa, se houver) e a surface RGBA é descartada
+        if (!SDL_LockSurface(rgba)) {
+            SDL_snprintf(mensagem, sizeof(mensagem), "Erro ao travar surface para escala de cinza: %s", SDL_GetError());
+            surface_rgba_liberar(&conv);
+            return carga_falhar(c, mensagem);
+        }
+        if (!c->previa) {
+            c->w = rgba->w;
+            c->h = rgba->h;
+            c->previa = previa_amostrada((const uint8_t*)rgba->pixels, (size_t)rgba->pitch, rgba->w, rgba->h, 4);
+            if (c->previa) carga_avisar(CARGA_PREVIA);
+        }
+        t_etapa = medir_inicio();
+        img = imagem_luma_de_surface(rgba, c->hist_orig, &c->total_orig, &c->escala_cinza);
+        medir_fim(ETAPA_CINZA_E_HISTOGRAMA, t_etapa);
+        SDL_UnlockSurface(rgba);
+        surface_rgba_liberar(&conv);
+        guardar_no_cache = g_cache.ativo;
+    }
+
+    //Cria a LUT de equalização (256 entradas, indexada pela intensidade) a partir do mesmo histograma
+    if (!img || c->total_orig == 0) {
+        cache_liberar(&ent_cache);
+        imagem_luma_destruir(img);
+        return carga_falhar(c, "Erro: não foi possível criar a matriz de mapeamento.");
+    }
+    SDL_Log("Imagem %dx%d %s", img->w, img->h,
+            c->escala_cinza ? "já estava em tons de cinza" : "convertida para tons de cinza");
+    t_etapa = medir_inicio();
+    if (ent_cache.cab) memcpy(c->lut_eq, ent_cache.cab->lut_eq, sizeof(c->lut_eq));
+    else procimg_lut_equalizacao(c->hist_orig, c->lut_eq);
+    medir_fim(ETAPA_MAPEAMENTO, t_etapa);
+    cache_liberar(&ent_cache);
+
+    // Depois do evento a thread principal pode tirar os ponteiros da estrutura: daqui em diante só as cópias locais
+    ImagemLuma16* img16 = c->img16;
+    Luts16* luts16 = c->luts16;
+    if (!c->previa) {
+        // Com a prévia já enviada as dimensões são as mesmas e a thread principal pode estar lendo
+        c->w = img->w;
+        c->h = img->h;
+    }
+    c->img = img;
+    carga_avisar(CARGA_ORIGINAL);
+
+    // A original já está com a thread principal (que só lê dela): o que falta fica fora do caminho até a tela
+    if (guardar_no_cache && !SDL_GetAtomicInt(&c->cancelar)) {
+        //a próxima abertura do mesmo conteúdo começa do cache
+        t_etapa = medir_inicio();
+        (void)cache_guardar(chave_cache, tamanho_entrada, img, c->hist_orig, c->total_orig, c->escala_cinza, NULL);
+        medir_fim(ETAPA_CACHE, t_etapa);
+    }
+    // Com 16 bits a equalização é a de 16 bits, reduzida para 8 na mesma passada que gera o histograma dela
+    if (img16 && !SDL_GetAtomicInt(&c->cancelar)) {
+        t_etapa = medir_inicio();
+        procimg_lut_equalizacao16(img16->hist, luts16->eq);
+        lut16_para_8(luts16->eq, luts16->ajuste);
+        (void)reduzir_luma16(img16, luts16->ajuste, c->eq, c->hist_eq16);
+        medir_fim(ETAPA_EQUALIZACAO, t_etapa);
+        carga_avisar(CARGA_EQUALIZADA);
+    }
+    return 0;
+}
+
+// Começa a carga de 'caminho' na thread de carga; os resultados chegam pelos eventos g_evento_carga
+static int carga_iniciar(Carga* c, const char* caminho) {
+    memset(c, 0, sizeof(*c));
+    c->caminho = caminho;
+    c->thread = SDL_CreateThread(thread_carga, "carga", c);
+    if (!c->thread) {
+        fprintf(stderr, "Erro: não foi possível criar a thread de carga: %s\n", SDL_GetError());
+        return -1;
+    }
+    return 0;
+}
+
+// Espera a thread de carga terminar (a equalizada de 16 bits, se havia, fica pronta)
+static void carga_concluir(Carga* c) {
+    if (c->thread) SDL_WaitThread(c->thread, NULL);
+    c->thread = NULL;
+}
+
+// Cancela o que ainda não começou, espera a thread e libera o que não foi entregue à thread principal
+static void carga_encerrar(Carga* c) {
+    SDL_SetAtomicInt(&c->cancelar, 1);
+    carga_concluir(c);
+    imagem_luma_destruir(c->previa);
+    imagem_luma_destruir(c->img);
+    imagem_luma_destruir(c->eq);
+    imagem_luma16_destruir(c->img16);
+    free(c->luts16);
+    c->previa = c->img = c->eq = NULL;
+    c->img16 = NULL;
+    c->luts16 = NULL;
+}
+
+// Tamanho da janela principal para a imagem: o da imagem, reduzido para caber na tela (o zoom/pan mostra o resto)
+static void janela_para_imagem(SDL_Window* win, int w, int h) {
+    int win_w = w, win_h = h;
+    SDL_Rect usable;
+    if (SDL_GetDisplayUsableBounds(SDL_GetPrimaryDisplay(), &usable) && usable.w > 0 && usable.h > 0) {
+        double s = fmin(1.0, fmin(usable.w * 0.85 / w, usable.h * 0.85 / h));
+        win_w = (int)(w * s) > 1 ? (int)(w * s) : 1;
+        win_h = (int)(h * s) > 1 ? (int)(h * s) : 1;
+    }
+    SDL_SetWindowSize(win, win_w, win_h);
+    SDL_SetWindowPosition(win, SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED);
+}
+
+// Enquanto a original não chega, as janelas respondem e mostram a prévia (quando houver) e o tempo de carga.
+// Retorna 0 com a original pronta, 1 se as janelas foram fechadas e -1 se a carga falhou.
+static int esperar_carga(Carga* c, SDL_Window* win_main, SDL_Renderer* ren_main, SDL_Window* win_sec,
+                         SDL_Renderer* ren_sec, int sec_w, int sec_h) {
+    SDL_Texture* tex_previa = NULL;
+    Uint64 inicio = SDL_GetTicks();
+    int r = 2, sujo = 1;   // 2 = ainda carregando
+    const char* nome = strrchr(c->caminho, '/');
+    nome = nome ? nome + 1 : c->caminho;
+    char texto[256];
+    SDL_snprintf(texto, sizeof(texto), "Carregando %s...", nome);
+    SDL_SetWindowTitle(win_sec, texto);
+
+    while (r == 2) {
+        SDL_Event e;
+        int tem_evento = SDL_WaitEventTimeout(&e, sujo ? 0 : OVERLAY_INTERVALO_MS);
+        if (!tem_evento) sujo = 1;   // o tempo decorrido anda
+        // Para no evento que encerra a espera: os seguintes ficam na fila para o loop principal
+        for (; tem_evento && r == 2; tem_evento = r == 2 && SDL_PollEvent(&e)) {
+            if (e.type == SDL_EVENT_QUIT || e.type == SDL_EVENT_WINDOW_CLOSE_REQUESTED ||
+                (e.type == SDL_EVENT_KEY_DOWN && e.key.scancode == SDL_SCANCODE_ESCAPE)) {
+                r = 1;
+            } else if (e.type == g_evento_carga && e.user.code == CARGA_PREVIA) {
+                // As dimensões já são conhecidas: a janela assume o tamanho da imagem e a prévia entra
+                janela_para_imagem(win_main, c->w, c->h);
+                place_side_window(win_main, win_sec, sec_w, sec_h);
+                tex_previa = textura_de_luma(ren_main, c->previa);
+                sujo = 1;
+            } else if (e.type == g_evento_carga) {
+                r = e.user.code == CARGA_ORIGINAL ? 0 : e.user.code == CARGA_ERRO ? -1 : r;
+            } else if (e.type >= SDL_EVENT_WINDOW_FIRST && e.type <= SDL_EVENT_WINDOW_LAST) {
+                if (e.type == SDL_EVENT_WINDOW_MOVED && e.window.windowID == SDL_GetWindowID(win_main)) {
+                    place_side_window(win_main, win_sec, sec_w, sec_h);
+                }
+                sujo = 1;
+            }
+        }
+        if (!sujo || r != 2) continue;
+        sujo = 0;
+
+        int vw, vh;
+        SDL_GetWindowSize(win_main, &vw, &vh);
+        SDL_SetRenderDrawColor(ren_main, 12, 12, 12, 255);
+        SDL_RenderClear(ren_main);
+        if (tex_previa) {
+            // Prévia ampliada para a imagem inteira caber na janela, como na vista ajustada
+            double zoom = fmin((double)vw / c->w, (double)vh / c->h);
+            SDL_FRect dst = { (float)((vw - c->w * zoom) * 0.5), (float)((vh - c->h * zoom) * 0.5),
+                              (float)(c->w * zoom), (float)(c->h * zoom) };
+            SDL_RenderTexture(ren_main, tex_previa, NULL, &dst);
+        }
+        SDL_RenderPresent(ren_main);
+
+        SDL_SetRenderDrawColor(ren_sec, 22, 22, 28, 255);
+        SDL_RenderClear(ren_sec);
+        if (g_ui_font) {
+            SDL_Color fg = (SDL_Color){230,230,240,255};
+            char decorrido[64];
+            SDL_snprintf(decorrido, sizeof(decorrido), "%.1f s%s", (double)(SDL_GetTicks() - inicio) / 1000.0,
+                         tex_previa ? " (prévia)" : "");
+            render_texto(ren_sec, g_ui_font, texto, fg, 16.0f, 16.0f, 0);
+            render_texto(ren_sec, g_ui_font, decorrido, fg, 16.0f, 40.0f, 0);
+        }
+        SDL_RenderPresent(ren_sec);
+    }
+
+    if (tex_previa) SDL_DestroyTexture(tex_previa);
+    // Sem prévia a janela ainda está no tamanho provisório
+    if (r == 0 && !c->previa) {
+        janela_para_imagem(win_main, c->w, c->h);
+        place_side_window(win_main, win_sec, sec_w, sec_h);
+    }
+    return r;
+}
+
+//-------------------------------------------------------------------------------------------------------------------------
+
+// bench.c inclui este arquivo com PROJ_SEM_MAIN para medir os kernels sem a interface
+#if !defined(PROJ_SEM_MAIN)
+static TTF_Font* g_fonte_overlay = NULL; // fonte menor do overlay de tempos (só a janela usa)
+
+int main(int argc, char* argv[]) {
+    // "--trace <arquivo.json>" pode vir no fim da linha de comando de qualquer modo
+    const char* caminho_trace = NULL;
+    if (argc >= 4 && strcmp(argv[argc - 2], "--trace") == 0) {
+        caminho_trace = argv[argc - 1];
+        argc -= 2;
+    }
+    if (medicoes_iniciar(caminho_trace) != 0) return 1;
+
+    if (argc >= 2 && strcmp(argv[1], "--batch") == 0) {
+        const char* extensao = argc >= 5 ? argv[4] : "png";
+        if (argc < 4 || (strcmp(extensao, "png") != 0 && strcmp(extensao, "pgm") != 0 &&
+                         strcmp(extensao, "luma") != 0 && strcmp(extensao, "qoi") != 0)) {
+            printf("Uso: %s --batch <dir_entrada> <dir_saida> [png|pgm|luma|qoi]\n", argv[0]);
+            return 1;
+        }
+        return executar_modo_lote(argv[2], argv[3], extensao);
+    }
+    if (argc >= 2 && strcmp(argv[1], "--stream") == 0) {
+        if (argc < 4) {
+            printf("Uso: %s --stream <entrada> <saida.pgm> [linhas_por_faixa]\n", argv[0]);
+            return 1;
+        }
+        return executar_modo_streaming(argv[2], argv[3], argc >= 5 ? atoi(argv[4]) : 0);
+    }
+    if (argc >= 2 && strcmp(argv[1], "--seq") == 0) {
+        const char* extensao = argc >= 5 ? argv[4] : "png";
+        if (argc < 4 || (strcmp(extensao, "png") != 0 && strcmp(extensao, "pgm") != 0 &&
+                         strcmp(extensao, "luma") != 0 && strcmp(extensao, "qoi") != 0)) {
+            printf("Uso: %s --seq <dir_entrada|-> <dir_saida|-> [png|pgm|luma|qoi]  (\"-\" = Y4M em stdin/stdout)\n",
+                   argv[0]);
+            return 1;
+        }
+        return executar_modo_sequencia(argv[2], argv[3], extensao);
+    }
+    if (argc >= 2 && strcmp(argv[1], "--servidor") == 0) {
+        if (argc < 3) {
+            printf("Uso: %s --servidor <caminho_do_socket>\n", argv[0]);
+            return 1;
+        }
+        return executar_modo_servidor(argv[2]);
+    }
+    if (argc < 2) {
+        printf("Erro! É preciso passar a imagem ao executar!\n");
+        printf("Uso: %s caminho/para/imagem.png [--clahe <colunas>x<linhas> [limite]] [--trace trace.json]\n", argv[0]);
+        printf("     %s --batch <dir_entrada> <dir_saida> [png|pgm|luma|qoi]\n", argv[0]);
+        printf("     %s --stream <entrada> <saida.pgm> [linhas_por_faixa]\n", argv[0]);
+        printf("     %s --seq <dir_entrada|-> <dir_saida|-> [png|pgm|luma|qoi]\n", argv[0]);
+        printf("     %s --servidor <caminho_do_socket>\n", argv[0]);
+        return 1;
+    }
+    const char* path = argv[1];
+
+    // --clahe: abre já mostrando o CLAHE com a grade e o limite dados
+    ParametrosClahe par_clahe = { CLAHE_BLOCOS_PADRAO, CLAHE_BLOCOS_PADRAO, CLAHE_LIMITE_PADRAO };
+    ModoExibicao modo_inicial = EXIBIR_ORIGINAL;
+    if (argc >= 3 && strcmp(argv[2], "--clahe") == 0) {
+        if (argc < 4 || sscanf(argv[3], "%dx%d", &par_clahe.blocos_x, &par_clahe.blocos_y) != 2 ||
+            par_clahe.blocos_x < 1 || par_clahe.blocos_y < 1) {
+            printf("Uso: %s caminho/para/imagem.png --clahe <colunas>x<linhas> [limite]\n", argv[0]);
+            return 1;
+        }
+        if (argc >= 5) par_clahe.limite = atof(argv[4]);
+        modo_inicial = EXIBIR_CLAHE;
+    }
+
+    if (!SDL_Init(SDL_INIT_VIDEO)) {
+        printf("Erro ao inicializar SDL: %s\n", SDL_GetError());
+        return 1;
+    }
+
+    SDL_SetLogPriority(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_DEBUG);
+    iniciar_procimg();
+    cache_iniciar(1);
+
+    Uint64 t_etapa = medir_inicio();
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "Erro: não foi possível abrir '%s' (%s)\n", path, strerror(errno));
+        SDL_Quit();
+        return 1;
+    }
+    fclose(f);
+    medir_fim(ETAPA_ABRIR_ARQUIVO, t_etapa);
+
+    {
+        //Janelas abrem antes da carga, com um tamanho provisório; a thread de carga manda a prévia, a original e
+        //(com 16 bits) a equalizada, e a janela principal assume o tamanho da imagem assim que ele é conhecido
+        int win_w = CARGA_JANELA_W, win_h = CARGA_JANELA_H;
+        SDL_Window* win_main = SDL_CreateWindow("Proj1 - Principal (Imagem)",
+                                                win_w, win_h, SDL_WINDOW_RESIZABLE);
+        if (!win_main) {
+            printf("Erro ao criar janela principal: %s\n", SDL_GetError());
+            SDL_Quit();
+            return 1;
+        }
+        SDL_SetWindowPosition(win_main, SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED);
+
+        SDL_Renderer* ren_main = SDL_CreateRenderer(win_main, NULL);
+        if (!ren_main) {
+            printf("Erro ao criar renderer principal: %s\n", SDL_GetError());
+            SDL_DestroyWindow(win_main);
+            SDL_Quit(); return 1;
+        }
+        SDL_SetRenderVSync(ren_main, 1);
+
+        // 2) Janela secundária (NORMAL) ao lado
+        const int SEC_W = 480;
+        const int SEC_H = 610;
+
+        SDL_Window* win_sec = SDL_CreateWindow("Proj1 - Secundaria (Histograma)", SEC_W, SEC_H, 0);
+        if (!win_sec) {
+            printf("Erro ao criar janela secundária: %s\n", SDL_GetError());
+            SDL_DestroyRenderer(ren_main); SDL_DestroyWindow(win_main);
+            SDL_Quit(); return 1;
+        }
+        place_side_window(win_main, win_sec, SEC_W, SEC_H);
+
+        SDL_Renderer* ren_sec = SDL_CreateRenderer(win_sec, NULL);
+        if (!ren_sec) {
+            printf("Erro ao criar renderer secundário: %s\n", SDL_GetError());
+            SDL_DestroyWindow(win_sec);
+            SDL_DestroyRenderer(ren_main); SDL_DestroyWindow(win_main);
+            SDL_Quit(); return 1;
+        }
+        SDL_SetRenderVSync(ren_sec, 1);
 
         if (!TTF_Init()) {
             fprintf(stderr, "Erro ao inicializar SDL_ttf: %s\n", SDL_GetError());
         } else {
             g_ui_font = open_ui_font(18);
+            g_fonte_overlay = open_ui_font(12);
             if (!g_ui_font) {
                 fprintf(stderr, "Aviso: nenhuma fonte TTF encontrada. Coloque 'DejaVuSans.ttf' ao lado do executável.\n");
             } else {
@@ -535,31 +5065,121 @@ int main(int argc, char* argv[]) {
             }
         }
 
-        // Estado do botão e histograma
-        int equalizado_on = 0; // começa mostrando original
-        uint32_t hist[256];
-        uint64_t total = 0;
-        calcular_histograma(img, hist, &total); // histograma da imagem atual (original)
-        double media = 0.0, desvio = 0.0;
-        estatisticas_do_histograma(hist, total, &media, &desvio);
+        // Um bloco de eventos: níveis da pirâmide e resultados da carga
+        g_evento_piramide = SDL_RegisterEvents(2);
+        g_evento_carga = g_evento_piramide + 1;
+        Carga carga;
+        int r = carga_iniciar(&carga, path) == 0 ? esperar_carga(&carga, win_main, ren_main, win_sec, ren_sec,
+                                                                 SEC_W, SEC_H) : -1;
+        if (r != 0) {
+            // Janelas fechadas ou carga com erro: some com as janelas já, o resto espera a thread de carga
+            SDL_HideWindow(win_sec);
+            SDL_HideWindow(win_main);
+            carga_encerrar(&carga);
+            if (r < 0 && carga.erro[0] != '\0') fprintf(stderr, "%s\n", carga.erro);
+            SDL_DestroyRenderer(ren_sec); SDL_DestroyWindow(win_sec);
+            SDL_DestroyRenderer(ren_main); SDL_DestroyWindow(win_main);
+            if (g_ui_font) TTF_CloseFont(g_ui_font);
+            if (g_fonte_overlay) TTF_CloseFont(g_fonte_overlay);
+            TTF_Quit();
+            buffers_esvaziar();
+            procimg_encerrar();
+            SDL_Quit();
+            return r < 0;
+        }
 
-        // Atualiza título com as infos
+        // A original é da thread principal daqui em diante; img16 e luts16 ainda são lidos pela thread de carga
+        // até a equalizada de 16 bits ficar pronta (ver eq_pendente)
+        ImagemLuma* img = carga.img;
+        ImagemLuma16* img16 = carga.img16;
+        Luts16* luts16 = carga.luts16;
+        carga.img = NULL;
+        carga.img16 = NULL;
+        carga.luts16 = NULL;
+        const uint64_t* hist_orig = carga.hist_orig;
+        uint64_t total_orig = carga.total_orig;
+        const uint8_t* lut_eq = carga.lut_eq;
+        int w = img->w, h = img->h;
+        SDL_GetWindowSize(win_main, &win_w, &win_h);
+        SDL_SetWindowTitle(win_sec, "Proj1 - Secundaria (Histograma)");
+        // Com 8 bits a equalizada inteira só existe quando for gravada; com 16 bits é a da carga
+        ImagemLuma* eq = NULL;
+        int eq_pendente = img16 != NULL, equalizada_chegou = 0;
+
+        // pirâmide de ladrilhos da original (só a prévia sai agora; o resto sob demanda). A equalizada é a mesma
+        // pirâmide exibida pela LUT do ajuste, reescrita direto nas texturas quando o controle deslizante muda.
+        t_etapa = medir_inicio();
+        Piramide pir_orig;
+        piramide_criar(&pir_orig, ren_main, img);
+        // Com 16 bits a equalizada não é uma LUT da original exibida: tem pirâmide própria, refeita a cada ajuste
+        // (a primeira sai quando a equalizada chega da carga)
+        Piramide pir_eq;
+        memset(&pir_eq, 0, sizeof(pir_eq));
+        medir_fim(ETAPA_TEXTURAS, t_etapa);
+        // A imagem CLAHE só é calculada quando for exibida pela primeira vez
+        ImagemLuma* clahe = NULL;
+        Piramide pir_clahe;
+        memset(&pir_clahe, 0, sizeof(pir_clahe));
+        int clahe_desatualizado = 1;
+        Piramide* pir_atual = &pir_orig;
+
+        Vista vista;
+        vista_ajustar(&vista, w, h, win_w, win_h);
+
+        // Estado do botão e histograma: o botão passa para a próxima imagem (original, equalizada, CLAHE)
+        ModoExibicao modo_exibicao = modo_inicial;
+        int exibicao_mudou = 1;   // refaz histograma, título e, se preciso, o CLAHE antes do próximo quadro
+        // O histograma da original já veio da carga e o da equalizada é derivado dele pela LUT: trocar de
+        // imagem só consulta o cache, qualquer que seja o tamanho da imagem
+        CacheHistogramas cache_histogramas;
+        memset(&cache_histogramas, 0, sizeof(cache_histogramas));
+        const HistogramaImagem* hist_img = cache_histogramas_guardar(&cache_histogramas, img->versao, hist_orig, total_orig);
+        // Ajuste da equalizada: começa em mistura 100%, que é a própria equalização
+        ModoAjuste modo_ajuste = AJUSTE_MISTURA;
+        double valor_ajuste = 1.0;
+        uint8_t lut_ajuste[256];
+        memcpy(lut_ajuste, lut_eq, sizeof(lut_ajuste));
+        uint64_t versao_ajuste = nova_versao_imagem();   // versão do histograma da equalizada exibida
+        int ajuste_mudou = 0, eq_desatualizada = !img16, arrastando = 0;
+        // Região selecionada: cantos em coordenadas da imagem enquanto arrasta, retângulo inteiro consultado
+        ProcimgIndiceHistograma* indice_orig = NULL;    // também serve à equalizada (pela LUT do ajuste)
+        ProcimgIndiceHistograma* indice_clahe = NULL;
+        ProcimgIndiceHistograma* indice_eq = NULL;      // equalizada de 16 bits, que tem imagem própria
+        int bins_roi = 0;                               // posição em BINS_ROI
+        int roi_ativa = 0, selecionando = 0, roi_mudou = 0, titulo_mudou = 1;
+        double roi_ax = 0.0, roi_ay = 0.0, roi_bx = 0.0, roi_by = 0.0;
+        int roi_x = 0, roi_y = 0, roi_w = 0, roi_h = 0;
+        HistogramaImagem hist_roi;
+        memset(&hist_roi, 0, sizeof(hist_roi));
+        const HistogramaImagem* hist_atual = hist_img;
         char titulo_sec[256];
-        snprintf(titulo_sec, sizeof(titulo_sec),
-                 "Hist: media=%.1f (%s), desvio=%.1f (contraste %s)  |  Botao: Equalizado",
-                 media, class_luminosidade(media), desvio, class_contraste(desvio));
-        SDL_SetWindowTitle(win_sec, titulo_sec);
 
-        // Áreas na secundária: histograma e botão
-        SDL_FRect area_hist = (SDL_FRect){ 16, 16, SEC_W - 32, SEC_H - 16 - 120 };
+        // Áreas na secundária: histograma, controle deslizante do ajuste e botão
+        SDL_FRect area_hist = (SDL_FRect){ 16, 16, SEC_W - 32, SEC_H - 16 - 170 };
+        SDL_FRect area_ajuste = (SDL_FRect){ 176, SEC_H - 104.0f, SEC_W - 16 - 176, 16.0f };
         SDL_FRect area_btn  = (SDL_FRect){ SEC_W/2.0f - 120.0f, SEC_H - 60.0f, 240.0f, 40.0f };
 
         int running = 1;
         int btn_hover = 0, btn_pressed = 0;
+        int overlay_tempos = 0;
+        // Cada janela só é redesenhada quando algo nela muda; sem nada pendente o loop dorme até o próximo evento
+        int sujo_principal = 1, sujo_histograma = 1;
+        // O gráfico fica em textura e só é refeito quando a versão do histograma ou o modo (tecla H) mudam
+        CacheHistograma cache_hist;
+        memset(&cache_hist, 0, sizeof(cache_hist));
+        ModoHistograma modo_hist = HIST_LINEAR;
+        // S só agenda a gravação; F escolhe o formato
+        FormatoGravacao formato_gravacao = GRAVAR_PNG;
+        gravador_iniciar();
 
         while (running) {
             SDL_Event e;
-            while (SDL_PollEvent(&e)) {
+            // Com o overlay ligado, acorda de tempos em tempos para atualizar os valores
+            int espera = (sujo_principal || sujo_histograma) ? 0 : overlay_tempos ? OVERLAY_INTERVALO_MS : -1;
+            int tem_evento = SDL_WaitEventTimeout(&e, espera);
+            if (!tem_evento && overlay_tempos) sujo_histograma = 1;
+
+            for (; tem_evento; tem_evento = SDL_PollEvent(&e)) {
                 if (e.type == SDL_EVENT_QUIT) running = 0;
                 else if (e.type == SDL_EVENT_WINDOW_CLOSE_REQUESTED) running = 0;
 
@@ -567,129 +5187,405 @@ int main(int argc, char* argv[]) {
                 else if ((e.type == SDL_EVENT_WINDOW_MOVED || e.type == SDL_EVENT_WINDOW_RESIZED) &&
                           e.window.windowID == SDL_GetWindowID(win_main)) {
                     place_side_window(win_main, win_sec, SEC_W, SEC_H);
+                    int vw, vh;
+                    SDL_GetWindowSize(win_main, &vw, &vh);
+                    if (vista.ajustada) vista_ajustar(&vista, w, h, vw, vh);
+                    sujo_principal = 1;
+                }
+                // Um nível da pirâmide ficou pronto na thread de fundo
+                else if (g_evento_piramide && e.type == g_evento_piramide) {
+                    sujo_principal = 1;
+                }
+                // A equalizada de 16 bits ficou pronta na thread de carga
+                else if (e.type == g_evento_carga && e.user.code == CARGA_EQUALIZADA) {
+                    equalizada_chegou = 1;
+                }
+                // Exposta, restaurada, mudou de escala...: redesenha a janela do evento
+                else if (e.type >= SDL_EVENT_WINDOW_FIRST && e.type <= SDL_EVENT_WINDOW_LAST) {
+                    if (e.window.windowID == SDL_GetWindowID(win_main)) sujo_principal = 1;
+                    else sujo_histograma = 1;
+                }
+                // Conteúdo de texturas alvo pode ter sido perdido
+                else if (e.type == SDL_EVENT_RENDER_TARGETS_RESET || e.type == SDL_EVENT_RENDER_DEVICE_RESET) {
+                    cache_histograma_invalidar(&cache_hist);
+                    sujo_principal = sujo_histograma = 1;
                 }
                 else if (e.type == SDL_EVENT_KEY_DOWN) {
-                    // ESC sai; S salva o que está visível AGORA
-                    if (e.key.scancode == SDL_SCANCODE_ESCAPE) {
+                    // ESC sai; S salva o que está visível AGORA; F troca o formato de gravação; T mostra/esconde
+                    // os tempos; H troca o modo do gráfico; M troca o ajuste do controle deslizante (mistura ou corte);
+                    // B troca os bins do histograma da região; [ ] e G ajustam o CLAHE; +/- zoom, 0 ajusta na
+                    // janela, 1 = 100%, setas movem a imagem
+                    int vw, vh;
+                    SDL_GetWindowSize(win_main, &vw, &vh);
+                    SDL_Scancode sc = e.key.scancode;
+                    if (sc == SDL_SCANCODE_ESCAPE) {
                         running = 0;
-                    } else if (e.key.scancode == SDL_SCANCODE_S) {
-                        // Salva diretamente a imagem em memória (sem passar pelo renderer)
-                        SDL_Surface* atual = equalizado_on ? eq : img;
-                        if (IMG_SavePNG(atual, "output_image.png")) {
-                            SDL_Log("Imagem salva como 'output_image.png'");
+                    } else if (sc == SDL_SCANCODE_EQUALS || sc == SDL_SCANCODE_KP_PLUS ||
+                               sc == SDL_SCANCODE_MINUS || sc == SDL_SCANCODE_KP_MINUS) {
+                        double fator = (sc == SDL_SCANCODE_EQUALS || sc == SDL_SCANCODE_KP_PLUS) ? 1.25 : 0.8;
+                        vista_zoom(&vista, fator, vw * 0.5f, vh * 0.5f, w, h, vw, vh);
+                        sujo_principal = 1;
+                    } else if (sc == SDL_SCANCODE_0) {
+                        vista_ajustar(&vista, w, h, vw, vh);
+                        sujo_principal = 1;
+                    } else if (sc == SDL_SCANCODE_1) {
+                        vista_zoom(&vista, 1.0 / vista.zoom, vw * 0.5f, vh * 0.5f, w, h, vw, vh);
+                        sujo_principal = 1;
+                    } else if (sc == SDL_SCANCODE_LEFT || sc == SDL_SCANCODE_RIGHT ||
+                               sc == SDL_SCANCODE_UP || sc == SDL_SCANCODE_DOWN) {
+                        float passo_x = vw / 8.0f, passo_y = vh / 8.0f;
+                        vista_mover(&vista, sc == SDL_SCANCODE_LEFT ? passo_x : sc == SDL_SCANCODE_RIGHT ? -passo_x : 0.0f,
+                                    sc == SDL_SCANCODE_UP ? passo_y : sc == SDL_SCANCODE_DOWN ? -passo_y : 0.0f, w, h);
+                        sujo_principal = 1;
+                    } else if (sc == SDL_SCANCODE_T) {
+                        overlay_tempos = !overlay_tempos;
+                        sujo_histograma = 1;
+                    } else if (sc == SDL_SCANCODE_H) {
+                        modo_hist = (ModoHistograma)((modo_hist + 1) % N_MODOS_HISTOGRAMA);
+                        SDL_Log("Histograma: modo %s", NOMES_MODOS_HISTOGRAMA[modo_hist]);
+                        sujo_histograma = 1;
+                    } else if (sc == SDL_SCANCODE_B) {
+                        // Menos bins: o índice da região é refeito com células menores na próxima consulta
+                        bins_roi = (bins_roi + 1) % N_BINS_ROI;
+                        procimg_indice_destruir(indice_orig);
+                        procimg_indice_destruir(indice_clahe);
+                        procimg_indice_destruir(indice_eq);
+                        indice_orig = indice_clahe = indice_eq = NULL;
+                        SDL_Log("Região: histograma com %d bins", BINS_ROI[bins_roi]);
+                        if (roi_ativa) roi_mudou = 1;
+                    } else if (sc == SDL_SCANCODE_M) {
+                        modo_ajuste = (ModoAjuste)((modo_ajuste + 1) % N_MODOS_AJUSTE);
+                        ajuste_mudou = 1;
+                    } else if (sc == SDL_SCANCODE_S) {
+                        // Copia a imagem em memória (sem passar pelo renderer) e grava em segundo plano; a
+                        // equalizada só é criada e refeita aqui, com a LUT do ajuste atual
+                        if (modo_exibicao == EXIBIR_EQUALIZADA && eq_desatualizada) {
+                            if (!eq) eq = imagem_luma_criar_como(img);
+                            if (eq) {
+                                t_etapa = medir_inicio();
+                                (void)equalizar_com_lut(img, eq, lut_ajuste);
+                                medir_fim(ETAPA_EQUALIZACAO, t_etapa);
+                                eq_desatualizada = 0;
+                            }
+                        }
+                        const ImagemLuma* gravar = modo_exibicao == EXIBIR_CLAHE ? clahe :
+                                                   modo_exibicao == EXIBIR_EQUALIZADA ? eq : img;
+                        if (gravar) gravador_agendar(gravar, formato_gravacao);
+                        else SDL_Log("Gravação: sem memória para a imagem equalizada");
+                    } else if (sc == SDL_SCANCODE_F) {
+                        formato_gravacao = (FormatoGravacao)((formato_gravacao + 1) % N_FORMATOS_GRAVACAO);
+                        SDL_Log("Formato de gravação: %s", FORMATOS_GRAVACAO[formato_gravacao].nome);
+                    } else if (sc == SDL_SCANCODE_LEFTBRACKET || sc == SDL_SCANCODE_RIGHTBRACKET ||
+                               sc == SDL_SCANCODE_G) {
+                        // [ e ] mudam o limite de corte do CLAHE; G troca a grade (4x4, 8x8, 16x16)
+                        if (sc == SDL_SCANCODE_G) {
+                            int n = par_clahe.blocos_x >= 16 ? 4 : par_clahe.blocos_x >= 8 ? 16 : 8;
+                            par_clahe.blocos_x = par_clahe.blocos_y = n;
                         } else {
-                            SDL_Log("Falha ao salvar 'output_image.png': %s", SDL_GetError());
+                            par_clahe.limite += sc == SDL_SCANCODE_RIGHTBRACKET ? 0.5 : -0.5;
+                            if (par_clahe.limite < 1.0) par_clahe.limite = 1.0;
                         }
+                        clahe_desatualizado = 1;
+                        if (modo_exibicao == EXIBIR_CLAHE) exibicao_mudou = 1;
+                        else SDL_Log("CLAHE: grade %dx%d, limite %.1f (aplicado ao exibir)",
+                                     par_clahe.blocos_x, par_clahe.blocos_y, par_clahe.limite);
                     }
 
+                } else if (e.type == SDL_EVENT_MOUSE_WHEEL && e.wheel.windowID == SDL_GetWindowID(win_main)) {
+                    // Roda do mouse: zoom em torno do cursor
+                    int vw, vh;
+                    SDL_GetWindowSize(win_main, &vw, &vh);
+                    float passos = e.wheel.direction == SDL_MOUSEWHEEL_FLIPPED ? -e.wheel.y : e.wheel.y;
+                    vista_zoom(&vista, pow(1.25, passos), e.wheel.mouse_x, e.wheel.mouse_y, w, h, vw, vh);
+                    sujo_principal = 1;
                 } else if (e.type == SDL_EVENT_MOUSE_MOTION) {
-                    if (e.motion.windowID == SDL_GetWindowID(win_sec)) {
+                    // Arrastar com o botão esquerdo na janela principal move a imagem; com o direito, seleciona
+                    if (selecionando && e.motion.windowID == SDL_GetWindowID(win_main)) {
+                        int vw, vh;
+                        SDL_GetWindowSize(win_main, &vw, &vh);
+                        vista_para_imagem(&vista, e.motion.x, e.motion.y, vw, vh, &roi_bx, &roi_by);
+                        roi_mudou = 1;
+                    } else if (e.motion.windowID == SDL_GetWindowID(win_main) && (e.motion.state & SDL_BUTTON_LMASK)) {
+                        vista_mover(&vista, e.motion.xrel, e.motion.yrel, w, h);
+                        sujo_principal = 1;
+                    } else if (e.motion.windowID == SDL_GetWindowID(win_sec)) {
                         float mx = (float)e.motion.x;
                         float my = (float)e.motion.y;
-                        btn_hover = (mx >= area_btn.x && mx <= area_btn.x + area_btn.w &&
+                        if (arrastando) {
+                            double v = fmin(fmax((mx - area_ajuste.x) / area_ajuste.w, 0.0), 1.0);
+                            if (v != valor_ajuste) {
+                                valor_ajuste = v;
+                                ajuste_mudou = sujo_histograma = 1;
+                            }
+                        }
+                        int hover = (mx >= area_btn.x && mx <= area_btn.x + area_btn.w &&
                                      my >= area_btn.y && my <= area_btn.y + area_btn.h);
+                        if (hover != btn_hover) sujo_histograma = 1;
+                        btn_hover = hover;
                     }
                 } else if (e.type == SDL_EVENT_MOUSE_BUTTON_DOWN) {
-                    if (e.button.windowID == SDL_GetWindowID(win_sec) && e.button.button == SDL_BUTTON_LEFT) {
+                    if (e.button.windowID == SDL_GetWindowID(win_main) && e.button.button == SDL_BUTTON_RIGHT) {
+                        // Começa uma seleção de região
+                        int vw, vh;
+                        SDL_GetWindowSize(win_main, &vw, &vh);
+                        vista_para_imagem(&vista, e.button.x, e.button.y, vw, vh, &roi_ax, &roi_ay);
+                        roi_bx = roi_ax;
+                        roi_by = roi_ay;
+                        selecionando = 1;
+                    } else if (e.button.windowID == SDL_GetWindowID(win_sec) && e.button.button == SDL_BUTTON_LEFT) {
                         float mx = (float)e.button.x, my = (float)e.button.y;
                         if (mx >= area_btn.x && mx <= area_btn.x + area_btn.w &&
                             my >= area_btn.y && my <= area_btn.y + area_btn.h) {
                             btn_pressed = 1;
+                            sujo_histograma = 1;
+                        } else if (mx >= area_ajuste.x - 8 && mx <= area_ajuste.x + area_ajuste.w + 8 &&
+                                   my >= area_ajuste.y - 8 && my <= area_ajuste.y + area_ajuste.h + 8) {
+                            // Clicar no trilho já leva o controle para lá; arrastar continua pelo movimento
+                            arrastando = 1;
+                            valor_ajuste = fmin(fmax((mx - area_ajuste.x) / area_ajuste.w, 0.0), 1.0);
+                            ajuste_mudou = 1;
                         }
                     }
                 } else if (e.type == SDL_EVENT_MOUSE_BUTTON_UP) {
+                    if (arrastando && e.button.button == SDL_BUTTON_LEFT) {
+                        arrastando = 0;
+                        sujo_histograma = 1;
+                    }
+                    if (selecionando && e.button.button == SDL_BUTTON_RIGHT) {
+                        // Soltar refaz a consulta exata; um clique sem arrastar desfaz a seleção
+                        selecionando = 0;
+                        if (fabs(roi_bx - roi_ax) < 1.0 && fabs(roi_by - roi_ay) < 1.0) {
+                            if (roi_ativa) exibicao_mudou = 1;
+                            roi_ativa = roi_mudou = 0;
+                        } else {
+                            roi_mudou = 1;
+                        }
+                    }
                     if (btn_pressed && e.button.windowID == SDL_GetWindowID(win_sec) &&
                         e.button.button == SDL_BUTTON_LEFT) {
                         float mx = (float)e.button.x, my = (float)e.button.y;
                         int inside = (mx >= area_btn.x && mx <= area_btn.x + area_btn.w &&
                                       my >= area_btn.y && my <= area_btn.y + area_btn.h);
                         btn_pressed = 0;
+                        sujo_histograma = 1;
                         if (inside) {
-                            // Toggle entre imagens original e equalizada
-                            equalizado_on = !equalizado_on;
-                            tex_atual = equalizado_on ? tex_eq : tex_orig;
-
-                            // Recalcula histograma da imagem atualmente exibida
-                            if (equalizado_on) calcular_histograma(eq, hist, &total);
-                            else calcular_histograma(img, hist, &total);
-                            estatisticas_do_histograma(hist, total, &media, &desvio);
-
-                            snprintf(titulo_sec, sizeof(titulo_sec),
-                                     "Hist: media=%.1f (%s), desvio=%.1f (contraste %s)  |  Botao: %s",
-                                     media, class_luminosidade(media), desvio, class_contraste(desvio),
-                                     equalizado_on ? "Original" : "Equalizado");
-                            SDL_SetWindowTitle(win_sec, titulo_sec);
+                            // Passa para a próxima imagem: original -> equalizada -> CLAHE -> original
+                            modo_exibicao = (ModoExibicao)((modo_exibicao + 1) % N_MODOS_EXIBICAO);
+                            exibicao_mudou = 1;
                         }
                     }
                 }
             }
 
-            // Render principal
-            int vw, vh;
-            SDL_GetWindowSize(win_main, &vw, &vh);
-            SDL_SetRenderDrawColor(ren_main, 12, 12, 12, 255);
-            SDL_RenderClear(ren_main);
-            SDL_FRect dst = (SDL_FRect){0, 0, (float)vw, (float)vh};
-            SDL_RenderTexture(ren_main, tex_atual, NULL, &dst);
-            SDL_RenderPresent(ren_main);
+            // Os movimentos do controle acumulados neste lote de eventos viram uma LUT só: refazer a LUT e o
+            // histograma custa 256 entradas, e a pirâmide só reescreve os ladrilhos visíveis no próximo quadro.
+            // Com 16 bits a equalizada é reduzida de novo da imagem de 16 bits e ganha outra pirâmide, então o
+            // ajuste só é aplicado ao soltar o controle.
+            // 16 bits: a equalizada da carga entra quando chega ou, se for pedida antes (exibida ou ajustada),
+            // a thread principal espera a carga terminá-la
+            if (eq_pendente && (equalizada_chegou || ajuste_mudou || modo_exibicao == EXIBIR_EQUALIZADA)) {
+                eq_pendente = 0;
+                carga_concluir(&carga);
+                eq = carga.eq;
+                carga.eq = NULL;
+                (void)cache_histogramas_guardar(&cache_histogramas, eq->versao, carga.hist_eq16, total_orig);
+                t_etapa = medir_inicio();
+                piramide_criar(&pir_eq, ren_main, eq);
+                medir_fim(ETAPA_TEXTURAS, t_etapa);
+            }
 
-            // Render secundária: histograma + textos + botão
-            SDL_SetRenderDrawColor(ren_sec, 22, 22, 28, 255);
-            SDL_RenderClear(ren_sec);
-            render_histograma(ren_sec, area_hist, hist);
-
-            if (g_ui_font) {
-                char l1[128], l2[128];
-                snprintf(l1, sizeof(l1), "Média: %.1f (%s)", media, class_luminosidade(media));
-                snprintf(l2, sizeof(l2), "Desvio padrão: %.1f (%s)", desvio, class_contraste(desvio));
-                SDL_Color fg = (SDL_Color){230,230,240,255};
-
-                SDL_Surface* s1 = TTF_RenderText_Blended(g_ui_font, l1, strlen(l1), fg);
-                if (s1) {
-                    SDL_Texture* t1 = SDL_CreateTextureFromSurface(ren_sec, s1);
-                    if (t1) {
-                        SDL_SetTextureBlendMode(t1, SDL_BLENDMODE_BLEND);
-                        SDL_FRect d1 = { area_hist.x, area_hist.y + area_hist.h + 8, (float)s1->w, (float)s1->h };
-                        SDL_RenderTexture(ren_sec, t1, NULL, &d1);
-                        SDL_DestroyTexture(t1);
-                    }
-                    SDL_DestroySurface(s1);
+            if (ajuste_mudou && !(img16 && arrastando)) {
+                ajuste_mudou = 0;
+                t_etapa = medir_inicio();
+                if (img16) {
+                    int ok = lut_do_ajuste16(img16, luts16->eq, luts16->janela, modo_ajuste, valor_ajuste,
+                                             luts16->ajuste) == 0;
+                    medir_fim(ETAPA_MAPEAMENTO, t_etapa);
+                    uint64_t hist_eq[256];
+                    piramide_destruir(&pir_eq);
+                    t_etapa = medir_inicio();
+                    if (ok) ok = reduzir_luma16(img16, luts16->ajuste, eq, hist_eq) == 0;
+                    medir_fim(ETAPA_REDUCAO_16, t_etapa);
+                    if (ok) (void)cache_histogramas_guardar(&cache_histogramas, eq->versao, hist_eq, total_orig);
+                    t_etapa = medir_inicio();
+                    piramide_criar(&pir_eq, ren_main, eq);
+                    medir_fim(ETAPA_TEXTURAS, t_etapa);
+                    procimg_indice_destruir(indice_eq);
+                    indice_eq = NULL;
+                } else {
+                    lut_do_ajuste(hist_orig, lut_eq, modo_ajuste, valor_ajuste, lut_ajuste);
+                    versao_ajuste = nova_versao_imagem();
+                    medir_fim(ETAPA_MAPEAMENTO, t_etapa);
+                    eq_desatualizada = 1;
                 }
+                modo_exibicao = EXIBIR_EQUALIZADA;
+                exibicao_mudou = 1;
+            }
 
-                SDL_Surface* s2 = TTF_RenderText_Blended(g_ui_font, l2, strlen(l2), fg);
-                if (s2) {
-                    SDL_Texture* t2 = SDL_CreateTextureFromSurface(ren_sec, s2);
-                    if (t2) {
-                        SDL_SetTextureBlendMode(t2, SDL_BLENDMODE_BLEND);
-                        SDL_FRect d2 = { area_hist.x, area_hist.y + area_hist.h + 8 + 22, (float)s2->w, (float)s2->h };
-                        SDL_RenderTexture(ren_sec, t2, NULL, &d2);
-                        SDL_DestroyTexture(t2);
+            if (exibicao_mudou) {
+                exibicao_mudou = 0;
+                if (modo_exibicao == EXIBIR_CLAHE && clahe_desatualizado) {
+                    if (atualizar_clahe(ren_main, img, &clahe, &pir_clahe, &par_clahe) == 0) {
+                        clahe_desatualizado = 0;
+                        procimg_indice_destruir(indice_clahe);
+                        indice_clahe = NULL;
+                    } else {
+                        SDL_Log("CLAHE: falha ao processar a imagem");
+                        modo_exibicao = EXIBIR_ORIGINAL;
                     }
-                    SDL_DestroySurface(s2);
                 }
+                int eq_propria = img16 && modo_exibicao == EXIBIR_EQUALIZADA;
+                pir_atual = modo_exibicao == EXIBIR_CLAHE ? &pir_clahe : eq_propria ? &pir_eq : &pir_orig;
+                if (modo_exibicao != EXIBIR_CLAHE && !eq_propria) {
+                    piramide_definir_lut(&pir_orig, modo_exibicao == EXIBIR_EQUALIZADA ? lut_ajuste : NULL);
+                }
+
+                // Histograma da imagem atualmente exibida (do cache por versão; o do ajuste já vem derivado)
+                t_etapa = medir_inicio();
+                hist_atual = eq_propria ? histograma_da_imagem(&cache_histogramas, eq) :
+                             modo_exibicao == EXIBIR_EQUALIZADA ?
+                             cache_histogramas_derivar(&cache_histogramas, versao_ajuste, hist_orig, total_orig, lut_ajuste) :
+                             histograma_da_imagem(&cache_histogramas, modo_exibicao == EXIBIR_CLAHE ? clahe : img);
+                medir_fim(ETAPA_HISTOGRAMA, t_etapa);
+                if (roi_ativa) roi_mudou = 1;
+                titulo_mudou = 1;
+                sujo_principal = sujo_histograma = 1;
+            }
+
+            // Região: histograma pelo índice da imagem exibida, no lugar do da imagem inteira
+            if (roi_mudou) {
+                roi_mudou = 0;
+                roi_ativa = 1;
+                roi_x = (int)floor(fmax(fmin(roi_ax, roi_bx), 0.0));
+                roi_y = (int)floor(fmax(fmin(roi_ay, roi_by), 0.0));
+                roi_w = (int)ceil(fmin(fmax(roi_ax, roi_bx), (double)w)) - roi_x;
+                roi_h = (int)ceil(fmin(fmax(roi_ay, roi_by), (double)h)) - roi_y;
+                if (roi_w < 0) roi_w = 0;
+                if (roi_h < 0) roi_h = 0;
+                int eq_propria = img16 && modo_exibicao == EXIBIR_EQUALIZADA;
+                const ProcimgIndiceHistograma* indice =
+                    modo_exibicao == EXIBIR_CLAHE ? indice_da_imagem(&indice_clahe, clahe, BINS_ROI[bins_roi]) :
+                    eq_propria ? indice_da_imagem(&indice_eq, eq, BINS_ROI[bins_roi]) :
+                                 indice_da_imagem(&indice_orig, img, BINS_ROI[bins_roi]);
+                t_etapa = medir_inicio();
+                if (indice && histograma_da_regiao(indice, roi_x, roi_y, roi_w, roi_h, !selecionando,
+                                                   modo_exibicao == EXIBIR_EQUALIZADA && !eq_propria ? lut_ajuste : NULL,
+                                                   &hist_roi) == 0) {
+                    hist_atual = &hist_roi;
+                }
+                medir_fim(ETAPA_HISTOGRAMA, t_etapa);
+                titulo_mudou = 1;
+                sujo_principal = sujo_histograma = 1;
             }
 
-            render_botao(ren_sec, area_btn, btn_hover, btn_pressed, equalizado_on ? "Original" : "Equalizado");
+            if (titulo_mudou) {
+                titulo_mudou = 0;
+                char regiao[64] = "";
+                if (roi_ativa) snprintf(regiao, sizeof(regiao), "Regiao %dx%d em (%d, %d)  |  ", roi_w, roi_h, roi_x, roi_y);
+                else if (img16) snprintf(regiao, sizeof(regiao), "16 bits (%d a %d)  |  ", img16->minimo, img16->maximo);
+                snprintf(titulo_sec, sizeof(titulo_sec),
+                         "%sHist: media=%.1f (%s), desvio=%.1f (contraste %s)  |  Botao: %s", regiao,
+                         hist_atual->media, class_luminosidade(hist_atual->media),
+                         hist_atual->desvio, class_contraste(hist_atual->desvio),
+                         NOMES_MODOS_EXIBICAO[(modo_exibicao + 1) % N_MODOS_EXIBICAO]);
+                SDL_SetWindowTitle(win_sec, titulo_sec);
+            }
+
+            if (!sujo_principal && !sujo_histograma) continue;
+            // Quadro = trabalho de redesenho das janelas sujas (com vsync, inclui a espera do present)
+            Uint64 t_quadro = medir_inicio();
+
+            // Render principal
+            if (sujo_principal) {
+                t_etapa = medir_inicio();
+                int vw, vh;
+                SDL_GetWindowSize(win_main, &vw, &vh);
+                SDL_SetRenderDrawColor(ren_main, 12, 12, 12, 255);
+                SDL_RenderClear(ren_main);
+                // Ladrilhos que ainda não couberam no orçamento deste quadro saem nos próximos
+                int pendente = render_piramide(ren_main, pir_atual, &vista, vw, vh);
+                if (roi_ativa) render_selecao(ren_main, &vista, vw, vh, roi_x, roi_y, roi_w, roi_h);
+                SDL_RenderPresent(ren_main);
+                medir_fim(ETAPA_RENDER_PRINCIPAL, t_etapa);
+                sujo_principal = pendente;
+            }
+
+            // Render secundária: histograma + textos + botão
+            if (sujo_histograma) {
+                t_etapa = medir_inicio();
+                SDL_SetRenderDrawColor(ren_sec, 22, 22, 28, 255);
+                SDL_RenderClear(ren_sec);
+                render_histograma(ren_sec, &cache_hist, area_hist, hist_atual->hist, hist_atual->versao, modo_hist);
+
+                if (g_ui_font) {
+                    char l1[128], l2[128];
+                    double media = hist_atual->media, desvio = hist_atual->desvio;
+                    snprintf(l1, sizeof(l1), "Média: %.1f (%s)", media, class_luminosidade(media));
+                    snprintf(l2, sizeof(l2), "Desvio padrão: %.1f (%s)", desvio, class_contraste(desvio));
+                    SDL_Color fg = (SDL_Color){230,230,240,255};
+                    render_texto(ren_sec, g_ui_font, l1, fg, area_hist.x, area_hist.y + area_hist.h + 8, 0);
+                    render_texto(ren_sec, g_ui_font, l2, fg, area_hist.x, area_hist.y + area_hist.h + 8 + 22, 0);
+                }
+
+                char rotulo_ajuste[64];
+                if (modo_ajuste == AJUSTE_MISTURA) {
+                    snprintf(rotulo_ajuste, sizeof(rotulo_ajuste), "Mistura: %.0f%%", valor_ajuste * 100.0);
+                } else {
+                    snprintf(rotulo_ajuste, sizeof(rotulo_ajuste), "Corte: %.1fx",
+                             1.0 + valor_ajuste * (AJUSTE_CORTE_MAX - 1.0));
+                }
+                render_controle_deslizante(ren_sec, area_ajuste, valor_ajuste, arrastando, rotulo_ajuste, area_hist.x);
+                render_botao(ren_sec, area_btn, btn_hover, btn_pressed,
+                             NOMES_MODOS_EXIBICAO[(modo_exibicao + 1) % N_MODOS_EXIBICAO]);
+                if (overlay_tempos) {
+                    render_overlay_tempos(ren_sec, g_fonte_overlay ? g_fonte_overlay : g_ui_font, area_hist);
+                }
 
-            SDL_RenderPresent(ren_sec);
+                SDL_RenderPresent(ren_sec);
+                medir_fim(ETAPA_RENDER_HISTOGRAMA, t_etapa);
+                sujo_histograma = 0;
+            }
 
-            SDL_Delay(16); // ~60 FPS
+            medir_fim(ETAPA_QUADRO, t_quadro);
         }
 
-        // Limpeza
-        SDL_DestroyTexture(tex_orig);
-        SDL_DestroyTexture(tex_eq);
+        double quadro_medio = 0.0, quadro_max = 0.0;
+        medicoes_quadros(&quadro_medio, &quadro_max);
+        SDL_Log("Tempo: %d quadros, media %.2f ms, max %.2f ms (ultimos %d)", g_medicoes.n_quadros,
+                quadro_medio, quadro_max, QUADROS_MEDIA);
+
+        // Limpeza (gravações já agendadas terminam antes de sair)
+        gravador_encerrar();
+        cache_textos_limpar();
+        cache_histograma_destruir(&cache_hist);
+        piramide_destruir(&pir_orig);
+        piramide_destruir(&pir_eq);
+        piramide_destruir(&pir_clahe);
+        procimg_indice_destruir(indice_orig);
+        procimg_indice_destruir(indice_clahe);
+        procimg_indice_destruir(indice_eq);
+        imagem_luma_destruir(clahe);
         SDL_DestroyRenderer(ren_main);
         SDL_DestroyWindow(win_main);
         SDL_DestroyRenderer(ren_sec);
         SDL_DestroyWindow(win_sec);
+
+        // A thread de carga pode estar na equalizada de 16 bits, que lê img16 e luts16
+        carga_encerrar(&carga);
+        imagem_luma_destruir(eq);
+        imagem_luma_destruir(img);
+        imagem_luma16_destruir(img16);
+        free(luts16);
     }
 
-    free(matriz);
-    SDL_DestroySurface(eq);
-    SDL_DestroySurface(img);
     if (g_ui_font) TTF_CloseFont(g_ui_font);
+    if (g_fonte_overlay) TTF_CloseFont(g_fonte_overlay);
     TTF_Quit();
+    cache_log();
+    buffers_log();
+    buffers_esvaziar();
+    procimg_encerrar();
     SDL_Quit();
     return 0;
 }
+#endif
@@ -0,0 +1,1304 @@
+// Universidade Presbiteriana Mackenzie – Computação Visual – Projeto 1
+//
+// procimg: implementação do núcleo de processamento (interface em procimg.h). Não depende de SDL: threads,
+// travas e atômicos vêm do sistema (pthreads ou Win32) e a detecção de SIMD usa cpuid.
+
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L // pthreads, posix_memalign e sysconf com -std=c99
+#endif
+#include "procimg.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+//-------------------------------------------------------------------------------------------------------------------------
+// Threads, travas e atômicos do sistema
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+typedef CRITICAL_SECTION Trava;
+typedef CONDITION_VARIABLE Condicao;
+typedef HANDLE Thread;
+typedef volatile LONG AtomicoInt;
+#define RETORNO_THREAD DWORD WINAPI
+
+static void trava_iniciar(Trava* t) { InitializeCriticalSection(t); }
+static void trava_destruir(Trava* t) { DeleteCriticalSection(t); }
+static void trava_fechar(Trava* t) { EnterCriticalSection(t); }
+static void trava_abrir(Trava* t) { LeaveCriticalSection(t); }
+static void condicao_iniciar(Condicao* c) { InitializeConditionVariable(c); }
+static void condicao_destruir(Condicao* c) { (void)c; }
+static void condicao_esperar(Condicao* c, Trava* t) { SleepConditionVariableCS(c, t, INFINITE); }
+static void condicao_sinalizar(Condicao* c) { WakeConditionVariable(c); }
+static void condicao_sinalizar_todas(Condicao* c) { WakeAllConditionVariable(c); }
+
+static int thread_criar(Thread* t, DWORD (WINAPI *fn)(void*), void* arg) {
+    *t = CreateThread(NULL, 0, fn, arg, 0, NULL);
+    return *t ? 0 : -1;
+}
+
+static void thread_esperar(Thread t) {
+    WaitForSingleObject(t, INFINITE);
+    CloseHandle(t);
+}
+
+static int atomico_somar(AtomicoInt* a, int v) { return (int)InterlockedExchangeAdd(a, v); }
+static int atomico_trocar_se(AtomicoInt* a, int esperado, int novo) {
+    return InterlockedCompareExchange(a, novo, esperado) == esperado;
+}
+static int atomico_ler(AtomicoInt* a) { return (int)InterlockedCompareExchange(a, 0, 0); }
+static void atomico_gravar(AtomicoInt* a, int v) { InterlockedExchange(a, v); }
+
+static int nucleos_logicos(void) {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+}
+
+static void* alocar_alinhado(size_t n) { return _aligned_malloc(n, 64); }
+static void liberar_alinhado(void* p, size_t n) { (void)n; _aligned_free(p); }
+
+#else
+#include <pthread.h>
+#include <unistd.h>
+
+typedef pthread_mutex_t Trava;
+typedef pthread_cond_t Condicao;
+typedef pthread_t Thread;
+typedef int AtomicoInt;
+#define RETORNO_THREAD void*
+
+static void trava_iniciar(Trava* t) { pthread_mutex_init(t, NULL); }
+static void trava_destruir(Trava* t) { pthread_mutex_destroy(t); }
+static void trava_fechar(Trava* t) { pthread_mutex_lock(t); }
+static void trava_abrir(Trava* t) { pthread_mutex_unlock(t); }
+static void condicao_iniciar(Condicao* c) { pthread_cond_init(c, NULL); }
+static void condicao_destruir(Condicao* c) { pthread_cond_destroy(c); }
+static void condicao_esperar(Condicao* c, Trava* t) { pthread_cond_wait(c, t); }
+static void condicao_sinalizar(Condicao* c) { pthread_cond_signal(c); }
+static void condicao_sinalizar_todas(Condicao* c) { pthread_cond_broadcast(c); }
+
+static int thread_criar(Thread* t, void* (*fn)(void*), void* arg) {
+    return pthread_create(t, NULL, fn, arg) == 0 ? 0 : -1;
+}
+
+static void thread_esperar(Thread t) { pthread_join(t, NULL); }
+
+static int atomico_somar(AtomicoInt* a, int v) { return __atomic_fetch_add(a, v, __ATOMIC_SEQ_CST); }
+static int atomico_trocar_se(AtomicoInt* a, int esperado, int novo) {
+    return __atomic_compare_exchange_n(a, &esperado, novo, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+static int atomico_ler(AtomicoInt* a) { return __atomic_load_n(a, __ATOMIC_SEQ_CST); }
+static void atomico_gravar(AtomicoInt* a, int v) { __atomic_store_n(a, v, __ATOMIC_SEQ_CST); }
+
+static int nucleos_logicos(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+static void* alocar_alinhado(size_t n) {
+    void* p = NULL;
+    return posix_memalign(&p, 64, n) == 0 ? p : NULL;
+}
+static void liberar_alinhado(void* p, size_t n) { (void)n; free(p); }
+#endif
+
+//-------------------------------------------------------------------------------------------------------------------------
+// Pool de threads persistente: divide um trabalho em faixas (normalmente faixas de linhas da imagem).
+// Quem chama também executa faixas. Se o pool já estiver em uso (por exemplo, vários workers do modo
+// em lote ao mesmo tempo), a chamada simplesmente roda todas as faixas na própria thread.
+
+typedef struct {
+    ProcimgTarefa fn;
+    void* ctx;
+    int n_faixas;
+    AtomicoInt proxima;     // próxima faixa ainda não pega
+    int pendentes;          // faixas não concluídas (protegido pela trava)
+    int ativos;             // workers que ainda seguram este trabalho (protegido pela trava)
+} TrabalhoPool;
+
+typedef struct {
+    Trava trava;
+    Condicao cond_trabalho;
+    Condicao cond_fim;
+    Thread* threads;
+    int n_threads;          // workers além da thread que chama
+    TrabalhoPool* atual;    // trabalho aberto (NULL quando não há faixas a pegar)
+    int encerrar;
+    AtomicoInt em_uso;      // 1 enquanto alguém está usando o pool
+    int sincronizacao;      // trava e condições criadas
+} PoolThreads;
+
+static PoolThreads g_pool;
+static int g_pool_max_threads = 0; // 0 = um por núcleo lógico
+
+// Executa faixas até acabarem; retorna quantas esta thread concluiu
+static int pool_executar_faixas(TrabalhoPool* t) {
+    int feitas = 0;
+    for (;;) {
+        int i = atomico_somar(&t->proxima, 1);
+        if (i >= t->n_faixas) break;
+        t->fn(t->ctx, i);
+        feitas++;
+    }
+    return feitas;
+}
+
+static RETORNO_THREAD pool_worker(void* data) {
+    PoolThreads* p = (PoolThreads*)data;
+    trava_fechar(&p->trava);
+    for (;;) {
+        while (!p->encerrar && !p->atual) condicao_esperar(&p->cond_trabalho, &p->trava);
+        if (p->encerrar) break;
+
+        TrabalhoPool* t = p->atual;
+        t->ativos++;
+        trava_abrir(&p->trava);
+
+        int feitas = pool_executar_faixas(t);
+
+        trava_fechar(&p->trava);
+        if (p->atual == t) p->atual = NULL; // não há mais faixas para pegar
+        t->pendentes -= feitas;
+        t->ativos--;
+        if (t->pendentes == 0 && t->ativos == 0) condicao_sinalizar(&p->cond_fim);
+    }
+    trava_abrir(&p->trava);
+    return 0;
+}
+
+// O pool é iniciado pela primeira operação; operações concorrentes antes disso esperam a vez
+static AtomicoInt g_pool_estado = 0;   // 0 = parado, 1 = iniciando, 2 = pronto
+
+static void pool_iniciar(void) {
+    if (atomico_ler(&g_pool_estado) == 2) return;
+    while (!atomico_trocar_se(&g_pool_estado, 0, 1)) {
+        if (atomico_ler(&g_pool_estado) == 2) return;
+    }
+
+    int n = g_pool_max_threads > 0 ? g_pool_max_threads : nucleos_logicos();
+    if (n > 1) {
+        trava_iniciar(&g_pool.trava);
+        condicao_iniciar(&g_pool.cond_trabalho);
+        condicao_iniciar(&g_pool.cond_fim);
+        g_pool.sincronizacao = 1;
+        g_pool.threads = calloc((size_t)(n - 1), sizeof(*g_pool.threads));
+        for (int i = 0; g_pool.threads && i < n - 1; i++) {
+            if (thread_criar(&g_pool.threads[i], pool_worker, &g_pool) != 0) break;
+            g_pool.n_threads++;
+        }
+    }
+    atomico_gravar(&g_pool_estado, 2);
+}
+
+void procimg_encerrar(void) {
+    if (atomico_ler(&g_pool_estado) != 2) return;
+    if (g_pool.sincronizacao) {
+        trava_fechar(&g_pool.trava);
+        g_pool.encerrar = 1;
+        condicao_sinalizar_todas(&g_pool.cond_trabalho);
+        trava_abrir(&g_pool.trava);
+        for (int i = 0; i < g_pool.n_threads; i++) thread_esperar(g_pool.threads[i]);
+        condicao_destruir(&g_pool.cond_fim);
+        condicao_destruir(&g_pool.cond_trabalho);
+        trava_destruir(&g_pool.trava);
+    }
+    free(g_pool.threads);
+    memset(&g_pool, 0, sizeof(g_pool));
+    atomico_gravar(&g_pool_estado, 0);
+}
+
+void procimg_definir_threads(int n) {
+    g_pool_max_threads = n < 0 ? 0 : n;
+}
+
+int procimg_threads(void) {
+    pool_iniciar();
+    return g_pool.n_threads + 1;
+}
+
+void procimg_paralelo_para(int n_faixas, ProcimgTarefa fn, void* ctx) {
+    if (n_faixas <= 0) return;
+    pool_iniciar();
+
+    if (n_faixas == 1 || g_pool.n_threads == 0 || !atomico_trocar_se(&g_pool.em_uso, 0, 1)) {
+        for (int i = 0; i < n_faixas; i++) fn(ctx, i);
+        return;
+    }
+
+    TrabalhoPool t;
+    t.fn = fn;
+    t.ctx = ctx;
+    t.n_faixas = n_faixas;
+    atomico_gravar(&t.proxima, 0);
+    t.pendentes = n_faixas;
+    t.ativos = 0;
+
+    trava_fechar(&g_pool.trava);
+    g_pool.atual = &t;
+    condicao_sinalizar_todas(&g_pool.cond_trabalho);
+    trava_abrir(&g_pool.trava);
+
+    int feitas = pool_executar_faixas(&t);
+
+    trava_fechar(&g_pool.trava);
+    if (g_pool.atual == &t) g_pool.atual = NULL;
+    t.pendentes -= feitas;
+    while (t.pendentes > 0 || t.ativos > 0) condicao_esperar(&g_pool.cond_fim, &g_pool.trava);
+    trava_abrir(&g_pool.trava);
+
+    atomico_gravar(&g_pool.em_uso, 0);
+}
+
+// Imagens pequenas não compensam o custo de sincronizar
+#define PIXELS_MIN_POR_FAIXA (256 * 1024)
+
+int procimg_faixas(int largura, int altura) {
+    uint64_t pixels = (uint64_t)largura * (uint64_t)altura;
+    int n = procimg_threads();
+    if (pixels / PIXELS_MIN_POR_FAIXA < (uint64_t)n) n = (int)(pixels / PIXELS_MIN_POR_FAIXA);
+    if (n > altura) n = altura;
+    return n < 1 ? 1 : n;
+}
+
+//-------------------------------------------------------------------------------------------------------------------------
+// Kernels de linha colorida -> intensidade de 8 bits. Os formatos de 4 bytes só diferem na ordem dos
+// coeficientes; cada kernel é instanciado para RGBA e BGRA.
+
+#define CR PROCIMG_CINZA_R
+#define CG PROCIMG_CINZA_G
+#define CB PROCIMG_CINZA_B
+
+static inline void cinza4_escalar(const uint8_t* src, uint8_t* dst, int w, int c0, int c1, int c2) {
+    for (int x = 0; x < w; x++, src += 4) {
+        dst[x] = (uint8_t)((c0 * src[0] + c1 * src[1] + c2 * src[2] + (1 << (PROCIMG_CINZA_FRAC - 1)))
+                           >> PROCIMG_CINZA_FRAC);
+    }
+}
+
+static void cinza_rgba_escalar(const uint8_t* src, uint8_t* dst, int w) { cinza4_escalar(src, dst, w, CR, CG, CB); }
+static void cinza_bgra_escalar(const uint8_t* src, uint8_t* dst, int w) { cinza4_escalar(src, dst, w, CB, CG, CR); }
+
+static void cinza_rgb_escalar(const uint8_t* src, uint8_t* dst, int w) {
+    for (int x = 0; x < w; x++, src += 3) dst[x] = procimg_luma(src[0], src[1], src[2]);
+}
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define PROCIMG_X86 1
+#include <immintrin.h>
+#if defined(__GNUC__) || defined(__clang__)
+#define ALVO_SSE2 __attribute__((target("sse2")))
+#define ALVO_AVX2 __attribute__((target("avx2")))
+#else
+#define ALVO_SSE2
+#define ALVO_AVX2
+#endif
+
+// 4 pixels por iteração: pmaddwd faz c0*p0+c1*p1 e c2*p2+A*0 por pixel, depois soma os pares
+ALVO_SSE2 static inline void cinza4_sse2(const uint8_t* src, uint8_t* dst, int w, short c0, short c1, short c2) {
+    const __m128i coef  = _mm_setr_epi16(c0, c1, c2, 0, c0, c1, c2, 0);
+    const __m128i arred = _mm_set1_epi32(1 << (PROCIMG_CINZA_FRAC - 1));
+    const __m128i zero  = _mm_setzero_si128();
+    int x = 0;
+    for (; x + 4 <= w; x += 4) {
+        __m128i px = _mm_loadu_si128((const __m128i*)(src + 4 * x));
+        __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(px, zero), coef);   // p0.rg p0.ba p1.rg p1.ba
+        __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(px, zero), coef);   // p2.rg p2.ba p3.rg p3.ba
+        lo = _mm_add_epi32(lo, _mm_shuffle_epi32(lo, _MM_SHUFFLE(2, 3, 0, 1)));
+        hi = _mm_add_epi32(hi, _mm_shuffle_epi32(hi, _MM_SHUFFLE(2, 3, 0, 1)));
+        __m128i y = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi),
+                                                    _MM_SHUFFLE(2, 0, 2, 0)));
+        y = _mm_srli_epi32(_mm_add_epi32(y, arred), PROCIMG_CINZA_FRAC);
+        y = _mm_packus_epi16(_mm_packs_epi32(y, y), zero);
+        int32_t quatro = _mm_cvtsi128_si32(y);
+        memcpy(dst + x, &quatro, 4);
+    }
+    cinza4_escalar(src + 4 * x, dst + x, w - x, c0, c1, c2);
+}
+
+// Mesmo esquema do SSE2 com 8 pixels por iteração (as operações trabalham por lane de 128 bits)
+ALVO_AVX2 static inline void cinza4_avx2(const uint8_t* src, uint8_t* dst, int w, short c0, short c1, short c2) {
+    const __m256i coef  = _mm256_setr_epi16(c0, c1, c2, 0, c0, c1, c2, 0, c0, c1, c2, 0, c0, c1, c2, 0);
+    const __m256i arred = _mm256_set1_epi32(1 << (PROCIMG_CINZA_FRAC - 1));
+    const __m256i zero  = _mm256_setzero_si256();
+    int x = 0;
+    for (; x + 8 <= w; x += 8) {
+        __m256i px = _mm256_loadu_si256((const __m256i*)(src + 4 * x));
+        __m256i lo = _mm256_madd_epi16(_mm256_unpacklo_epi8(px, zero), coef);
+        __m256i hi = _mm256_madd_epi16(_mm256_unpackhi_epi8(px, zero), coef);
+        lo = _mm256_add_epi32(lo, _mm256_shuffle_epi32(lo, _MM_SHUFFLE(2, 3, 0, 1)));
+        hi = _mm256_add_epi32(hi, _mm256_shuffle_epi32(hi, _MM_SHUFFLE(2, 3, 0, 1)));
+        __m256i y = _mm256_castps_si256(_mm256_shuffle_ps(_mm256_castsi256_ps(lo), _mm256_castsi256_ps(hi),
+                                                          _MM_SHUFFLE(2, 0, 2, 0)));
+        y = _mm256_srli_epi32(_mm256_add_epi32(y, arred), PROCIMG_CINZA_FRAC);
+        y = _mm256_packus_epi16(_mm256_packs_epi32(y, y), zero);   // 4 bytes úteis no início de cada lane
+        int32_t lane0 = _mm_cvtsi128_si32(_mm256_castsi256_si128(y));
+        int32_t lane1 = _mm_cvtsi128_si32(_mm256_extracti128_si256(y, 1));
+        memcpy(dst + x, &lane0, 4);
+        memcpy(dst + x + 4, &lane1, 4);
+    }
+    cinza4_sse2(src + 4 * x, dst + x, w - x, c0, c1, c2);
+}
+
+ALVO_SSE2 static void cinza_rgba_sse2(const uint8_t* src, uint8_t* dst, int w) { cinza4_sse2(src, dst, w, CR, CG, CB); }
+ALVO_SSE2 static void cinza_bgra_sse2(const uint8_t* src, uint8_t* dst, int w) { cinza4_sse2(src, dst, w, CB, CG, CR); }
+ALVO_AVX2 static void cinza_rgba_avx2(const uint8_t* src, uint8_t* dst, int w) { cinza4_avx2(src, dst, w, CR, CG, CB); }
+ALVO_AVX2 static void cinza_bgra_avx2(const uint8_t* src, uint8_t* dst, int w) { cinza4_avx2(src, dst, w, CB, CG, CR); }
+
+// AVX2 precisa do suporte da CPU e de o sistema salvar os registradores YMM
+#if defined(_MSC_VER)
+#include <intrin.h>
+static int cpu_tem_sse2(void) {
+    int r[4];
+    __cpuid(r, 1);
+    return (r[3] & (1 << 26)) != 0;
+}
+
+static int cpu_tem_avx2(void) {
+    int r[4];
+    __cpuid(r, 0);
+    if (r[0] < 7) return 0;
+    __cpuid(r, 1);
+    if (!(r[2] & (1 << 27)) || !(r[2] & (1 << 28))) return 0;   // OSXSAVE e AVX
+    if ((_xgetbv(0) & 6) != 6) return 0;                        // estados XMM e YMM
+    __cpuidex(r, 7, 0);
+    return (r[1] & (1 << 5)) != 0;
+}
+#else
+static int cpu_tem_sse2(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+}
+
+static int cpu_tem_avx2(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+#endif
+
+typedef struct {
+    ProcimgCinzaLinha rgba, bgra;
+    const char* nome;
+} KernelsCinza;
+
+static KernelsCinza g_kernels;
+static AtomicoInt g_kernels_estado = 0;   // 0 = a escolher, 1 = escolhendo, 2 = prontos
+
+// Escolhe o melhor kernel disponível na CPU atual (uma vez, no primeiro uso)
+static const KernelsCinza* kernels_cinza(void) {
+    if (atomico_ler(&g_kernels_estado) == 2) return &g_kernels;
+    if (atomico_trocar_se(&g_kernels_estado, 0, 1)) {
+        g_kernels.rgba = cinza_rgba_escalar;
+        g_kernels.bgra = cinza_bgra_escalar;
+        g_kernels.nome = "escalar";
+#if defined(PROCIMG_X86)
+        if (cpu_tem_avx2()) {
+            g_kernels.rgba = cinza_rgba_avx2;
+            g_kernels.bgra = cinza_bgra_avx2;
+            g_kernels.nome = "avx2";
+        } else if (cpu_tem_sse2()) {
+            g_kernels.rgba = cinza_rgba_sse2;
+            g_kernels.bgra = cinza_bgra_sse2;
+            g_kernels.nome = "sse2";
+        }
+#endif
+        atomico_gravar(&g_kernels_estado, 2);
+    }
+    while (atomico_ler(&g_kernels_estado) != 2) {}
+    return &g_kernels;
+}
+
+const char* procimg_kernel_cinza(void) {
+    return kernels_cinza()->nome;
+}
+
+ProcimgCinzaLinha procimg_cinza_linha(ProcimgFormato formato) {
+    switch (formato) {
+        case PROCIMG_RGB24: return cinza_rgb_escalar;
+        case PROCIMG_RGBA32: return kernels_cinza()->rgba;
+        case PROCIMG_BGRA32: return kernels_cinza()->bgra;
+        default: return NULL;
+    }
+}
+
+//-------------------------------------------------------------------------------------------------------------------------
+// Histograma: cada faixa de linhas preenche seu próprio parcial e no final os bins são somados
+
+static void* (*g_obter)(size_t) = NULL;
+static void (*g_devolver)(void*, size_t) = NULL;
+
+void procimg_definir_alocador(void* (*obter)(size_t n), void (*devolver)(void* p, size_t n)) {
+    g_obter = obter && devolver ? obter : NULL;
+    g_devolver = obter && devolver ? devolver : NULL;
+}
+
+// Memória de trabalho pelo alocador configurado (alinhada a 64 bytes)
+static void* memoria_obter(size_t n) {
+    return g_obter ? g_obter(n) : alocar_alinhado(n);
+}
+
+static void memoria_devolver(void* p, size_t n) {
+    if (!p) return;
+    if (g_devolver) g_devolver(p, n);
+    else liberar_alinhado(p, n);
+}
+
+ProcimgHistogramaParcial* procimg_parciais_alocar(int n_faixas) {
+    return memoria_obter((size_t)n_faixas * sizeof(ProcimgHistogramaParcial));
+}
+
+void procimg_parciais_liberar(ProcimgHistogramaParcial* parciais, int n_faixas) {
+    memoria_devolver(parciais, (size_t)n_faixas * sizeof(ProcimgHistogramaParcial));
+}
+
+void procimg_histograma_linha(const uint8_t* p, int w, ProcimgHistogramaParcial* parcial) {
+    uint32_t (*c)[256] = parcial->c;
+    int x = 0;
+    for (; x + 4 <= w; x += 4) {
+        c[0][p[x]]++; c[1][p[x + 1]]++; c[2][p[x + 2]]++; c[3][p[x + 3]]++;
+    }
+    for (; x < w; x++) c[0][p[x]]++;
+}
+
+void procimg_parciais_somar(const ProcimgHistogramaParcial* parciais, int n_faixas, uint64_t hist[256]) {
+    for (int f = 0; f < n_faixas; f++)
+        for (int k = 0; k < PROCIMG_HIST_COPIAS; k++)
+            for (int i = 0; i < 256; i++) hist[i] += parciais[f].c[k][i];
+}
+
+//-------------------------------------------------------------------------------------------------------------------------
+// Operações
+
+static int bytes_por_pixel(ProcimgFormato formato) {
+    switch (formato) {
+        case PROCIMG_CINZA8: return 1;
+        case PROCIMG_CINZA16: return 2;
+        case PROCIMG_RGB24: return 3;
+        case PROCIMG_RGBA32:
+        case PROCIMG_BGRA32: return 4;
+        default: return 0;
+    }
+}
+
+static int imagem_valida(const ProcimgImagem* img) {
+    if (!img || !img->pixels || img->largura <= 0 || img->altura <= 0) return 0;
+    int bpp = bytes_por_pixel(img->formato);
+    // Linhas de 16 bits são lidas como uint16_t: começo e stride precisam ser pares
+    if (bpp == 2 && (((uintptr_t)img->pixels | (uintptr_t)img->stride) & 1)) return 0;
+    return bpp > 0 && (int64_t)img->stride >= (int64_t)img->largura * bpp;
+}
+
+static int mesmo_tamanho(const ProcimgImagem* a, const ProcimgImagem* b) {
+    return a->largura == b->largura && a->altura == b->altura;
+}
+
+typedef struct {
+    const ProcimgImagem* src;
+    const ProcimgImagem* dst;
+    const ProcimgImagem* alfa;      // NULL se não pedido
+    ProcimgCinzaLinha cinza_linha;  // NULL: origem já é CINZA8
+    ProcimgHistogramaParcial* parciais;   // NULL se não pedido
+    int n_faixas;
+} ContextoCinza;
+
+static void tarefa_cinza(void* data, int faixa) {
+    ContextoCinza* ctx = (ContextoCinza*)data;
+    int y0, y1, w = ctx->src->largura;
+    procimg_faixa_linhas(ctx->src->altura, ctx->n_faixas, faixa, &y0, &y1);
+    ProcimgHistogramaParcial* parcial = ctx->parciais ? &ctx->parciais[faixa] : NULL;
+    if (parcial) memset(parcial, 0, sizeof(*parcial));
+    for (int y = y0; y < y1; y++) {
+        const uint8_t* row = ctx->src->pixels + (size_t)y * ctx->src->stride;
+        uint8_t* ly = ctx->dst->pixels + (size_t)y * ctx->dst->stride;
+        // Alfa antes do cinza: com dst sobre src, a linha em cinza sobrescreve o começo da linha colorida
+        if (ctx->alfa) {
+            uint8_t* la = ctx->alfa->pixels + (size_t)y * ctx->alfa->stride;
+            for (int x = 0; x < w; x++) la[x] = row[4 * x + 3];
+        }
+        if (ctx->cinza_linha) ctx->cinza_linha(row, ly, w);
+        else if (ly != row) memcpy(ly, row, (size_t)w);
+        if (parcial) procimg_histograma_linha(ly, w, parcial);
+    }
+}
+
+int procimg_escala_de_cinza(const ProcimgImagem* src, const ProcimgImagem* dst, const ProcimgImagem* alfa,
+                            uint64_t hist[256]) {
+    if (!imagem_valida(src) || !imagem_valida(dst) || !mesmo_tamanho(src, dst)) return PROCIMG_ERRO_ARGUMENTO;
+    if (dst->formato != PROCIMG_CINZA8 || src->formato == PROCIMG_CINZA16) return PROCIMG_ERRO_FORMATO;
+    if (alfa) {
+        if (!imagem_valida(alfa) || !mesmo_tamanho(src, alfa)) return PROCIMG_ERRO_ARGUMENTO;
+        if (alfa->formato != PROCIMG_CINZA8 || bytes_por_pixel(src->formato) != 4) return PROCIMG_ERRO_FORMATO;
+    }
+
+    ContextoCinza ctx;
+    ctx.src = src;
+    ctx.dst = dst;
+    ctx.alfa = alfa;
+    ctx.cinza_linha = procimg_cinza_linha(src->formato);
+    ctx.n_faixas = procimg_faixas(src->largura, src->altura);
+    ctx.parciais = NULL;
+    if (hist) {
+        ctx.parciais = procimg_parciais_alocar(ctx.n_faixas);
+        if (!ctx.parciais) return PROCIMG_ERRO_MEMORIA;
+    }
+    procimg_paralelo_para(ctx.n_faixas, tarefa_cinza, &ctx);
+    if (hist) {
+        memset(hist, 0, 256 * sizeof(uint64_t));
+        procimg_parciais_somar(ctx.parciais, ctx.n_faixas, hist);
+        procimg_parciais_liberar(ctx.parciais, ctx.n_faixas);
+    }
+    return PROCIMG_OK;
+}
+
+typedef struct {
+    const ProcimgImagem* img;
+    int n_faixas;
+    ProcimgHistogramaParcial* parciais;   // um por faixa
+} ContextoHistograma;
+
+static void tarefa_histograma(void* data, int faixa) {
+    ContextoHistograma* ctx = (ContextoHistograma*)data;
+    int y0, y1;
+    procimg_faixa_linhas(ctx->img->altura, ctx->n_faixas, faixa, &y0, &y1);
+    ProcimgHistogramaParcial* parcial = &ctx->parciais[faixa];
+    memset(parcial, 0, sizeof(*parcial));
+    for (int y = y0; y < y1; y++) {
+        procimg_histograma_linha(ctx->img->pixels + (size_t)y * ctx->img->stride, ctx->img->largura, parcial);
+    }
+}
+
+int procimg_histograma(const ProcimgImagem* img, uint64_t hist[256]) {
+    if (!hist || !imagem_valida(img)) return PROCIMG_ERRO_ARGUMENTO;
+    if (img->formato != PROCIMG_CINZA8) return PROCIMG_ERRO_FORMATO;
+    memset(hist, 0, 256 * sizeof(uint64_t));
+
+    ContextoHistograma ctx;
+    ctx.img = img;
+    ctx.n_faixas = procimg_faixas(img->largura, img->altura);
+    ctx.parciais = procimg_parciais_alocar(ctx.n_faixas);
+    if (!ctx.parciais) {
+        // Sem memória para os parciais: uma faixa só, usando um parcial na pilha
+        ProcimgHistogramaParcial unico;
+        ctx.n_faixas = 1;
+        ctx.parciais = &unico;
+        tarefa_histograma(&ctx, 0);
+        procimg_parciais_somar(&unico, 1, hist);
+        return PROCIMG_OK;
+    }
+    procimg_paralelo_para(ctx.n_faixas, tarefa_histograma, &ctx);
+    procimg_parciais_somar(ctx.parciais, ctx.n_faixas, hist);
+    procimg_parciais_liberar(ctx.parciais, ctx.n_faixas);
+    return PROCIMG_OK;
+}
+
+static uint64_t total_do_histograma(const uint64_t* hist, int n) {
+    uint64_t total = 0;
+    for (int i = 0; i < n; i++) total += hist[i];
+    return total;
+}
+
+// Média e desvio de 'bins' bins de 'largura' intensidades cada, o primeiro centrado em 'centro0'
+static void estatisticas_de(const uint64_t* hist, int bins, double largura, double centro0, double* media,
+                            double* desvio) {
+    *media = 0.0;
+    *desvio = 0.0;
+    uint64_t total = 0;
+    double soma = 0.0;
+    for (int i = 0; i < bins; i++) {
+        total += hist[i];
+        soma += (centro0 + i * largura) * (double)hist[i];
+    }
+    if (total == 0) return;
+    double mu = soma / (double)total;
+    double var = 0.0;
+    for (int i = 0; i < bins; i++) {
+        double d = centro0 + i * largura - mu;
+        var += d * d * (double)hist[i];
+    }
+    var /= (double)total;
+    *media = mu;
+    *desvio = sqrt(var);
+}
+
+void procimg_estatisticas(const uint64_t hist[256], double* media, double* desvio) {
+    procimg_estatisticas_bins(hist, 256, media, desvio);
+}
+
+void procimg_estatisticas_bins(const uint64_t* hist, int bins, double* media, double* desvio) {
+    if (bins < 1 || bins > 256) {
+        *media = *desvio = 0.0;
+        return;
+    }
+    double largura = 256.0 / bins;
+    // Com 256 bins, o centro de cada bin é a própria intensidade
+    estatisticas_de(hist, bins, largura, (largura - 1.0) * 0.5, media, desvio);
+}
+
+void procimg_estatisticas16(const uint64_t* hist, double* media, double* desvio) {
+    estatisticas_de(hist, PROCIMG_BINS16, 1.0, 0.0, media, desvio);
+}
+
+// Equalização pela cdf de um histograma de 'n' bins (256 ou PROCIMG_BINS16) para [0, n - 1]; o resultado vai
+// para 'lut8' ou, se for NULL, para 'lut16'
+static void lut_equalizacao_n(const uint64_t* hist, int n, uint8_t* lut8, uint16_t* lut16) {
+    uint64_t total = total_do_histograma(hist, n);
+
+    // cdf_min: quantidade de pixels da menor intensidade presente
+    uint64_t cdf_min = 0;
+    for (int i = 0; i < n; i++) {
+        if (hist[i]) { cdf_min = hist[i]; break; }
+    }
+
+    // Imagem vazia ou com uma única intensidade: nada a redistribuir
+    int identidade = total == 0 || cdf_min == total;
+    double den = (double)(total - cdf_min);
+    uint64_t cdf = 0;
+    for (int i = 0; i < n; i++) {
+        long val = i;
+        if (!identidade) {
+            cdf += hist[i];
+            val = cdf < cdf_min ? 0 : lround(((double)(cdf - cdf_min) / den) * (n - 1));
+            if (val > n - 1) val = n - 1;
+        }
+        if (lut8) lut8[i] = (uint8_t)val;
+        else lut16[i] = (uint16_t)val;
+    }
+}
+
+void procimg_lut_equalizacao(const uint64_t hist[256], uint8_t lut[256]) {
+    lut_equalizacao_n(hist, 256, lut, NULL);
+}
+
+typedef struct {
+    const ProcimgImagem* src;
+    const ProcimgImagem* dst;
+    const uint8_t* lut;
+    int n_faixas;
+} ContextoLut;
+
+static void tarefa_lut(void* data, int faixa) {
+    ContextoLut* ctx = (ContextoLut*)data;
+    int y0, y1, w = ctx->src->largura;
+    procimg_faixa_linhas(ctx->src->altura, ctx->n_faixas, faixa, &y0, &y1);
+    const uint8_t* lut = ctx->lut;
+    for (int y = y0; y < y1; y++) {
+        const uint8_t* s = ctx->src->pixels + (size_t)y * ctx->src->stride;
+        uint8_t* d = ctx->dst->pixels + (size_t)y * ctx->dst->stride;
+        for (int x = 0; x < w; x++) d[x] = lut[s[x]];
+    }
+}
+
+int procimg_aplicar_lut(const ProcimgImagem* src, const ProcimgImagem* dst, const uint8_t lut[256]) {
+    if (!lut || !imagem_valida(src) || !imagem_valida(dst) || !mesmo_tamanho(src, dst)) return PROCIMG_ERRO_ARGUMENTO;
+    if (src->formato != PROCIMG_CINZA8 || dst->formato != PROCIMG_CINZA8) return PROCIMG_ERRO_FORMATO;
+
+    ContextoLut ctx;
+    ctx.src = src;
+    ctx.dst = dst;
+    ctx.lut = lut;
+    ctx.n_faixas = procimg_faixas(src->largura, src->altura);
+    procimg_paralelo_para(ctx.n_faixas, tarefa_lut, &ctx);
+    return PROCIMG_OK;
+}
+
+int procimg_equalizar(const ProcimgImagem* src, const ProcimgImagem* dst, uint64_t hist_original[256],
+                      uint64_t hist_equalizado[256]) {
+    if (!imagem_valida(src) || !imagem_valida(dst) || !mesmo_tamanho(src, dst)) return PROCIMG_ERRO_ARGUMENTO;
+    if (src->formato != PROCIMG_CINZA8 || dst->formato != PROCIMG_CINZA8) return PROCIMG_ERRO_FORMATO;
+
+    uint64_t hist[256];
+    uint8_t lut[256];
+    int r = procimg_histograma(src, hist);
+    if (r != PROCIMG_OK) return r;
+    procimg_lut_equalizacao(hist, lut);
+    r = procimg_aplicar_lut(src, dst, lut);
+    if (r != PROCIMG_OK) return r;
+
+    // Todo pixel de intensidade i virou lut[i]: o histograma de saída sai do de entrada em O(256)
+    if (hist_equalizado) {
+        uint64_t eq[256] = {0};
+        for (int i = 0; i < 256; i++) eq[lut[i]] += hist[i];
+        memcpy(hist_equalizado, eq, sizeof(eq));
+    }
+    if (hist_original) memcpy(hist_original, hist, sizeof(hist));
+    return PROCIMG_OK;
+}
+
+//-------------------------------------------------------------------------------------------------------------------------
+// 16 bits. Cada faixa conta num parcial próprio de 65536 contadores de 32 bits (256 KiB, que cabem no L2), e as
+// faixas são uma por thread, para que os parciais sejam poucos e a soma final custe threads x 65536. Contar
+// direto no parcial saiu mais rápido que distribuir os pixels pelo byte alto antes (como num radix sort) para
+// manter só uma linha de 256 contadores ativa no L1: a distribuição acrescenta uma passada e uma cadeia de
+// dependência por pixel que custa mais que as faltas no L1 que ela evita.
+
+typedef struct {
+    const ProcimgImagem* img;
+    int n_faixas;
+    uint32_t* parciais;     // PROCIMG_BINS16 contadores por faixa
+} ContextoHistograma16;
+
+static void tarefa_histograma16(void* data, int faixa) {
+    ContextoHistograma16* ctx = (ContextoHistograma16*)data;
+    int y0, y1, w = ctx->img->largura;
+    procimg_faixa_linhas(ctx->img->altura, ctx->n_faixas, faixa, &y0, &y1);
+    uint32_t* parcial = ctx->parciais + (size_t)faixa * PROCIMG_BINS16;
+    memset(parcial, 0, PROCIMG_BINS16 * sizeof(uint32_t));
+    for (int y = y0; y < y1; y++) {
+        const uint16_t* linha = (const uint16_t*)(ctx->img->pixels + (size_t)y * ctx->img->stride);
+        for (int x = 0; x < w; x++) parcial[linha[x]]++;
+    }
+}
+
+int procimg_histograma16(const ProcimgImagem* img, uint64_t* hist) {
+    if (!hist || !imagem_valida(img)) return PROCIMG_ERRO_ARGUMENTO;
+    if (img->formato != PROCIMG_CINZA16) return PROCIMG_ERRO_FORMATO;
+
+    ContextoHistograma16 ctx;
+    ctx.img = img;
+    ctx.n_faixas = procimg_faixas(img->largura, img->altura);
+    if (ctx.n_faixas > procimg_threads()) ctx.n_faixas = procimg_threads();
+    // Cada parcial de 32 bits conta no máximo uma faixa; faixas acima de 4 Gi pixels são divididas
+    while ((uint64_t)img->largura * (uint64_t)(img->altura / ctx.n_faixas + 1) > UINT32_MAX) ctx.n_faixas++;
+    size_t bytes = (size_t)ctx.n_faixas * PROCIMG_BINS16 * sizeof(uint32_t);
+    ctx.parciais = (uint32_t*)memoria_obter(bytes);
+    if (!ctx.parciais) return PROCIMG_ERRO_MEMORIA;
+    procimg_paralelo_para(ctx.n_faixas, tarefa_histograma16, &ctx);
+
+    memset(hist, 0, PROCIMG_BINS16 * sizeof(uint64_t));
+    for (int f = 0; f < ctx.n_faixas; f++) {
+        const uint32_t* parcial = ctx.parciais + (size_t)f * PROCIMG_BINS16;
+        for (int i = 0; i < PROCIMG_BINS16; i++) hist[i] += parcial[i];
+    }
+    memoria_devolver(ctx.parciais, bytes);
+    return PROCIMG_OK;
+}
+
+void procimg_lut_equalizacao16(const uint64_t* hist, uint16_t* lut) {
+    lut_equalizacao_n(hist, PROCIMG_BINS16, NULL, lut);
+}
+
+typedef struct {
+    const ProcimgImagem* src;
+    const ProcimgImagem* dst;
+    const uint16_t* lut16;                // aplicação de 16 bits
+    const uint8_t* lut8;                  // redução para 8 bits
+    ProcimgHistogramaParcial* parciais;   // redução: NULL se não pedido
+    int n_faixas;
+} ContextoLut16;
+
+static void tarefa_lut16(void* data, int faixa) {
+    ContextoLut16* ctx = (ContextoLut16*)data;
+    int y0, y1, w = ctx->src->largura;
+    procimg_faixa_linhas(ctx->src->altura, ctx->n_faixas, faixa, &y0, &y1);
+    ProcimgHistogramaParcial* parcial = ctx->parciais ? &ctx->parciais[faixa] : NULL;
+    if (parcial) memset(parcial, 0, sizeof(*parcial));
+    for (int y = y0; y < y1; y++) {
+        const uint16_t* s = (const uint16_t*)(ctx->src->pixels + (size_t)y * ctx->src->stride);
+        uint8_t* d = ctx->dst->pixels + (size_t)y * ctx->dst->stride;
+        if (ctx->lut16) {
+            uint16_t* d16 = (uint16_t*)d;
+            for (int x = 0; x < w; x++) d16[x] = ctx->lut16[s[x]];
+        } else {
+            // Em ordem crescente: sobre a própria origem, o byte x só é escrito depois de lido o pixel x
+            for (int x = 0; x < w; x++) d[x] = ctx->lut8[s[x]];
+            if (parcial) procimg_histograma_linha(d, w, parcial);
+        }
+    }
+}
+
+int procimg_aplicar_lut16(const ProcimgImagem* src, const ProcimgImagem* dst, const uint16_t* lut) {
+    if (!lut || !imagem_valida(src) || !imagem_valida(dst) || !mesmo_tamanho(src, dst)) return PROCIMG_ERRO_ARGUMENTO;
+    if (src->formato != PROCIMG_CINZA16 || dst->formato != PROCIMG_CINZA16) return PROCIMG_ERRO_FORMATO;
+
+    ContextoLut16 ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.src = src;
+    ctx.dst = dst;
+    ctx.lut16 = lut;
+    ctx.n_faixas = procimg_faixas(src->largura, src->altura);
+    procimg_paralelo_para(ctx.n_faixas, tarefa_lut16, &ctx);
+    return PROCIMG_OK;
+}
+
+int procimg_equalizar16(const ProcimgImagem* src, const ProcimgImagem* dst, uint64_t* hist_original,
+                        uint64_t* hist_equalizado) {
+    if (!imagem_valida(src) || !imagem_valida(dst) || !mesmo_tamanho(src, dst)) return PROCIMG_ERRO_ARGUMENTO;
+    if (src->formato != PROCIMG_CINZA16 || dst->formato != PROCIMG_CINZA16) return PROCIMG_ERRO_FORMATO;
+
+    // 512 KiB de histograma e 128 KiB de LUT: memória de trabalho, não pilha
+    size_t bytes_hist = PROCIMG_BINS16 * sizeof(uint64_t), bytes_lut = PROCIMG_BINS16 * sizeof(uint16_t);
+    uint64_t* hist = (uint64_t*)memoria_obter(bytes_hist);
+    uint16_t* lut = (uint16_t*)memoria_obter(bytes_lut);
+    int r = hist && lut ? procimg_histograma16(src, hist) : PROCIMG_ERRO_MEMORIA;
+    if (r == PROCIMG_OK) {
+        procimg_lut_equalizacao16(hist, lut);
+        r = procimg_aplicar_lut16(src, dst, lut);
+    }
+    if (r == PROCIMG_OK) {
+        if (hist_equalizado) {
+            memset(hist_equalizado, 0, bytes_hist);
+            for (int i = 0; i < PROCIMG_BINS16; i++) hist_equalizado[lut[i]] += hist[i];
+        }
+        if (hist_original) memcpy(hist_original, hist, bytes_hist);
+    }
+    if (hist) memoria_devolver(hist, bytes_hist);
+    if (lut) memoria_devolver(lut, bytes_lut);
+    return r;
+}
+
+int procimg_reduzir16(const ProcimgImagem* src, const ProcimgImagem* dst, const uint8_t* lut, uint64_t hist[256]) {
+    if (!lut || !imagem_valida(src) || !imagem_valida(dst) || !mesmo_tamanho(src, dst)) return PROCIMG_ERRO_ARGUMENTO;
+    if (src->formato != PROCIMG_CINZA16 || dst->formato != PROCIMG_CINZA8) return PROCIMG_ERRO_FORMATO;
+
+    ContextoLut16 ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.src = src;
+    ctx.dst = dst;
+    ctx.lut8 = lut;
+    ctx.n_faixas = procimg_faixas(src->largura, src->altura);
+    if (hist) {
+        ctx.parciais = procimg_parciais_alocar(ctx.n_faixas);
+        if (!ctx.parciais) return PROCIMG_ERRO_MEMORIA;
+    }
+    procimg_paralelo_para(ctx.n_faixas, tarefa_lut16, &ctx);
+    if (hist) {
+        memset(hist, 0, 256 * sizeof(uint64_t));
+        procimg_parciais_somar(ctx.parciais, ctx.n_faixas, hist);
+        procimg_parciais_liberar(ctx.parciais, ctx.n_faixas);
+    }
+    return PROCIMG_OK;
+}
+
+void procimg_lut_janela16(int minimo, int maximo, uint8_t* lut) {
+    // Janela vazia (imagem de uma intensidade só): a faixa inteira de 16 bits
+    if (maximo <= minimo) {
+        minimo = 0;
+        maximo = PROCIMG_BINS16 - 1;
+    }
+    double escala = 255.0 / (maximo - minimo);
+    for (int i = 0; i < PROCIMG_BINS16; i++) {
+        lut[i] = i <= minimo ? 0 : i >= maximo ? 255 : (uint8_t)lround((i - minimo) * escala);
+    }
+}
+
+//-------------------------------------------------------------------------------------------------------------------------
+// CLAHE: cada bloco da grade tem o próprio histograma, cortado no limite com o excesso redistribuído por
+// igual, e vira uma LUT de equalização. Cada pixel interpola bilinearmente as LUTs dos quatro blocos cujos
+// centros o cercam (perto das bordas, dos dois ou do único mais próximo), então o custo por pixel não
+// depende do tamanho dos blocos. Os histogramas saem em paralelo, uma tarefa por bloco; a aplicação roda por
+// faixas de linhas, buscando os quatro valores das LUTs em trechos da linha e misturando-os em ponto fixo
+// (pesos Q7), com SSE2 onde houver.
+
+#define CLAHE_PESO_BITS 7
+#define CLAHE_PESO (1 << CLAHE_PESO_BITS)
+#define CLAHE_TRECHO 256          // pixels buscados nas LUTs antes de cada mistura
+#define CLAHE_BLOCOS_MAX 256      // por eixo
+
+typedef struct {
+    const ProcimgImagem* src;
+    const ProcimgImagem* dst;
+    int blocos_x, blocos_y;
+    double limite;
+    uint8_t* luts;                // blocos_y * blocos_x LUTs de 256 entradas, por linhas de blocos
+    // Interpolação horizontal, por coluna: deslocamento das LUTs da esquerda e da direita na linha de blocos
+    // e o peso da direita (0..CLAHE_PESO-1)
+    uint32_t* coluna_esq;
+    uint32_t* coluna_dir;
+    uint8_t* peso_x;
+    int n_faixas;
+} ContextoClahe;
+
+static void tarefa_clahe_bloco(void* data, int bloco) {
+    ContextoClahe* ctx = (ContextoClahe*)data;
+    const ProcimgImagem* src = ctx->src;
+    int bx = bloco % ctx->blocos_x, by = bloco / ctx->blocos_x;
+    int x0, x1, y0, y1;
+    procimg_faixa_linhas(src->largura, ctx->blocos_x, bx, &x0, &x1);
+    procimg_faixa_linhas(src->altura, ctx->blocos_y, by, &y0, &y1);
+
+    ProcimgHistogramaParcial parcial;
+    memset(&parcial, 0, sizeof(parcial));
+    for (int y = y0; y < y1; y++) {
+        procimg_histograma_linha(src->pixels + (size_t)y * src->stride + x0, x1 - x0, &parcial);
+    }
+    uint32_t hist[256];
+    for (int i = 0; i < 256; i++) {
+        hist[i] = 0;
+        for (int k = 0; k < PROCIMG_HIST_COPIAS; k++) hist[i] += parcial.c[k][i];
+    }
+
+    // Corte: o que passa do limite é espalhado por igual; a sobra da divisão vai para bins espaçados
+    uint32_t n = (uint32_t)(x1 - x0) * (uint32_t)(y1 - y0);
+    if (ctx->limite > 0.0) {
+        double limite_bin = ctx->limite * (double)n / 256.0;
+        uint32_t limite = limite_bin < 1.0 ? 1u : limite_bin > (double)n ? n : (uint32_t)limite_bin;
+        uint32_t excesso = 0;
+        for (int i = 0; i < 256; i++) {
+            if (hist[i] > limite) {
+                excesso += hist[i] - limite;
+                hist[i] = limite;
+            }
+        }
+        uint32_t por_bin = excesso / 256, resto = excesso % 256;
+        for (int i = 0; i < 256; i++) hist[i] += por_bin;
+        if (resto) {
+            uint32_t passo = 256 / resto;
+            for (uint32_t i = 0; i < 256 && resto; i += passo, resto--) hist[i]++;
+        }
+    }
+
+    uint8_t* lut = ctx->luts + (size_t)bloco * 256;
+    uint64_t cdf = 0;
+    for (int i = 0; i < 256; i++) {
+        cdf += hist[i];
+        lut[i] = (uint8_t)((cdf * 255 + n / 2) / n);
+    }
+}
+
+// Mistura de um trecho: cima = a*(P-px) + b*px, baixo = c*(P-px) + d*px, saida = (cima*(P-py) + baixo*py) / P^2
+static void clahe_misturar_escalar(const uint8_t* a, const uint8_t* b, const uint8_t* c, const uint8_t* d,
+                                   const uint8_t* px, int py, uint8_t* saida, int n) {
+    for (int i = 0; i < n; i++) {
+        int cima = a[i] * (CLAHE_PESO - px[i]) + b[i] * px[i];
+        int baixo = c[i] * (CLAHE_PESO - px[i]) + d[i] * px[i];
+        saida[i] = (uint8_t)((cima * (CLAHE_PESO - py) + baixo * py + (1 << (2 * CLAHE_PESO_BITS - 1)))
+                             >> (2 * CLAHE_PESO_BITS));
+    }
+}
+
+#if defined(PROCIMG_X86) && (defined(__SSE2__) || defined(_M_X64))
+// 8 pixels por iteração: as misturas horizontais cabem em 16 bits (no máximo 255 * P) e a vertical é um pmaddwd
+static void clahe_misturar(const uint8_t* a, const uint8_t* b, const uint8_t* c, const uint8_t* d,
+                           const uint8_t* px, int py, uint8_t* saida, int n) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i peso = _mm_set1_epi16(CLAHE_PESO);
+    const __m128i pesos_y = _mm_set1_epi32((int)((uint32_t)py << 16 | (uint32_t)(CLAHE_PESO - py)));
+    const __m128i arred = _mm_set1_epi32(1 << (2 * CLAHE_PESO_BITS - 1));
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i va = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(a + i)), zero);
+        __m128i vb = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(b + i)), zero);
+        __m128i vc = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(c + i)), zero);
+        __m128i vd = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(d + i)), zero);
+        __m128i wd = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(px + i)), zero);
+        __m128i we = _mm_sub_epi16(peso, wd);
+        __m128i cima = _mm_add_epi16(_mm_mullo_epi16(va, we), _mm_mullo_epi16(vb, wd));
+        __m128i baixo = _mm_add_epi16(_mm_mullo_epi16(vc, we), _mm_mullo_epi16(vd, wd));
+        __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi16(cima, baixo), pesos_y);
+        __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi16(cima, baixo), pesos_y);
+        lo = _mm_srai_epi32(_mm_add_epi32(lo, arred), 2 * CLAHE_PESO_BITS);
+        hi = _mm_srai_epi32(_mm_add_epi32(hi, arred), 2 * CLAHE_PESO_BITS);
+        __m128i r = _mm_packus_epi16(_mm_packs_epi32(lo, hi), zero);
+        _mm_storel_epi64((__m128i*)(saida + i), r);
+    }
+    clahe_misturar_escalar(a + i, b + i, c + i, d + i, px + i, py, saida + i, n - i);
+}
+#else
+#define clahe_misturar clahe_misturar_escalar
+#endif
+
+// Bloco de 'p' (coordenada dobrada do centro do pixel) e peso do seguinte; 'centros' são as coordenadas
+// dobradas dos centros dos blocos
+static void clahe_vizinhos(const int* centros, int n, int p, int* b0, int* b1, int* peso) {
+    if (p <= centros[0]) { *b0 = *b1 = 0; *peso = 0; return; }
+    if (p >= centros[n - 1]) { *b0 = *b1 = n - 1; *peso = 0; return; }
+    int b = 0;
+    while (centros[b + 1] <= p) b++;
+    int dist = centros[b + 1] - centros[b];
+    *b0 = b;
+    *b1 = b + 1;
+    *peso = ((p - centros[b]) * CLAHE_PESO + dist / 2) / dist;
+    if (*peso >= CLAHE_PESO) *peso = CLAHE_PESO - 1;
+}
+
+static void tarefa_clahe_aplicar(void* data, int faixa) {
+    ContextoClahe* ctx = (ContextoClahe*)data;
+    const ProcimgImagem* src = ctx->src;
+    int w = src->largura, y0, y1;
+    procimg_faixa_linhas(src->altura, ctx->n_faixas, faixa, &y0, &y1);
+
+    int centros_y[CLAHE_BLOCOS_MAX];
+    for (int b = 0; b < ctx->blocos_y; b++) {
+        int a0, a1;
+        procimg_faixa_linhas(src->altura, ctx->blocos_y, b, &a0, &a1);
+        centros_y[b] = a0 + a1;
+    }
+
+    uint8_t a[CLAHE_TRECHO], b[CLAHE_TRECHO], c[CLAHE_TRECHO], d[CLAHE_TRECHO];
+    size_t linha_luts = (size_t)ctx->blocos_x * 256;
+    for (int y = y0; y < y1; y++) {
+        int b0, b1, py;
+        clahe_vizinhos(centros_y, ctx->blocos_y, 2 * y + 1, &b0, &b1, &py);
+        const uint8_t* cima = ctx->luts + (size_t)b0 * linha_luts;
+        const uint8_t* baixo = ctx->luts + (size_t)b1 * linha_luts;
+        const uint8_t* s = src->pixels + (size_t)y * src->stride;
+        uint8_t* o = ctx->dst->pixels + (size_t)y * ctx->dst->stride;
+        // Cada trecho é lido inteiro antes de ser escrito, então o destino pode ser a origem
+        for (int x0 = 0; x0 < w; x0 += CLAHE_TRECHO) {
+            int n = w - x0 < CLAHE_TRECHO ? w - x0 : CLAHE_TRECHO;
+            const uint32_t* esq = ctx->coluna_esq + x0;
+            const uint32_t* dir = ctx->coluna_dir + x0;
+            for (int i = 0; i < n; i++) {
+                uint8_t v = s[x0 + i];
+                a[i] = cima[esq[i] + v];
+                b[i] = cima[dir[i] + v];
+                c[i] = baixo[esq[i] + v];
+                d[i] = baixo[dir[i] + v];
+            }
+            clahe_misturar(a, b, c, d, ctx->peso_x + x0, py, o + x0, n);
+        }
+    }
+}
+
+int procimg_clahe(const ProcimgImagem* src, const ProcimgImagem* dst, int blocos_x, int blocos_y, double limite) {
+    if (!imagem_valida(src) || !imagem_valida(dst) || !mesmo_tamanho(src, dst)) return PROCIMG_ERRO_ARGUMENTO;
+    if (src->formato != PROCIMG_CINZA8 || dst->formato != PROCIMG_CINZA8) return PROCIMG_ERRO_FORMATO;
+    if (blocos_x < 1 || blocos_y < 1) return PROCIMG_ERRO_ARGUMENTO;
+    if (blocos_x > CLAHE_BLOCOS_MAX) blocos_x = CLAHE_BLOCOS_MAX;
+    if (blocos_y > CLAHE_BLOCOS_MAX) blocos_y = CLAHE_BLOCOS_MAX;
+    if (blocos_x > src->largura) blocos_x = src->largura;
+    if (blocos_y > src->altura) blocos_y = src->altura;
+
+    int w = src->largura;
+    ContextoClahe ctx;
+    ctx.src = src;
+    ctx.dst = dst;
+    ctx.blocos_x = blocos_x;
+    ctx.blocos_y = blocos_y;
+    ctx.limite = limite;
+    size_t n_luts = (size_t)blocos_x * (size_t)blocos_y * 256;
+    size_t n_colunas = (size_t)w * sizeof(uint32_t);
+    ctx.luts = memoria_obter(n_luts);
+    ctx.coluna_esq = memoria_obter(n_colunas);
+    ctx.coluna_dir = memoria_obter(n_colunas);
+    ctx.peso_x = memoria_obter((size_t)w);
+    int r = PROCIMG_ERRO_MEMORIA;
+    if (ctx.luts && ctx.coluna_esq && ctx.coluna_dir && ctx.peso_x) {
+        // Todas as LUTs ficam prontas antes da aplicação, que pode então sobrescrever a origem
+        procimg_paralelo_para(blocos_x * blocos_y, tarefa_clahe_bloco, &ctx);
+
+        int centros_x[CLAHE_BLOCOS_MAX];
+        for (int b = 0; b < blocos_x; b++) {
+            int a0, a1;
+            procimg_faixa_linhas(w, blocos_x, b, &a0, &a1);
+            centros_x[b] = a0 + a1;
+        }
+        for (int x = 0; x < w; x++) {
+            int b0, b1, px;
+            clahe_vizinhos(centros_x, blocos_x, 2 * x + 1, &b0, &b1, &px);
+            ctx.coluna_esq[x] = (uint32_t)b0 * 256;
+            ctx.coluna_dir[x] = (uint32_t)b1 * 256;
+            ctx.peso_x[x] = (uint8_t)px;
+        }
+
+        ctx.n_faixas = procimg_faixas(w, src->altura);
+        procimg_paralelo_para(ctx.n_faixas, tarefa_clahe_aplicar, &ctx);
+        r = PROCIMG_OK;
+    }
+    memoria_devolver(ctx.luts, n_luts);
+    memoria_devolver(ctx.coluna_esq, n_colunas);
+    memoria_devolver(ctx.coluna_dir, n_colunas);
+    memoria_devolver(ctx.peso_x, (size_t)w);
+    return r;
+}
+
+//-------------------------------------------------------------------------------------------------------------------------
+// Índice de histograma integral. integral[(cy * (colunas + 1) + cx) * bins + b] conta os pixels do bin b em
+// [0, B(cx)) x [0, B(cy)), com B(i) = min(i * celula, lado da imagem). Os contadores são de 32 bits: a soma
+// dos quatro cantos é feita em aritmética módulo 2^32, então o resultado é exato para qualquer região com
+// menos de 4 G pixels, mesmo que os acumulados passem disso.
+
+#define INDICE_CELULA_MIN 8
+#define INDICE_CELULA_MAX 4096
+
+struct ProcimgIndiceHistograma {
+    ProcimgImagem img;        // os pixels continuam sendo do chamador
+    int bins, desloc;         // bin = intensidade >> desloc
+    int celula;
+    int colunas, linhas;      // células; a última de cada eixo pode ser parcial
+    uint32_t* integral;       // (linhas + 1) x (colunas + 1) x bins
+    size_t bytes;
+};
+
+static size_t indice_bytes(int largura, int altura, int bins, int celula) {
+    size_t colunas = (size_t)(largura + celula - 1) / celula, linhas = (size_t)(altura + celula - 1) / celula;
+    return (colunas + 1) * (linhas + 1) * (size_t)bins * sizeof(uint32_t);
+}
+
+static uint32_t* indice_linha(const ProcimgIndiceHistograma* ind, int cy) {
+    return ind->integral + (size_t)cy * (size_t)(ind->colunas + 1) * (size_t)ind->bins;
+}
+
+// Linha de células cy: conta os pixels de cada célula e acumula da esquerda para a direita
+static void tarefa_indice_linha(void* data, int cy) {
+    const ProcimgIndiceHistograma* ind = (const ProcimgIndiceHistograma*)data;
+    int bins = ind->bins, desloc = ind->desloc, c = ind->celula, w = ind->img.largura;
+    uint32_t* linha = indice_linha(ind, cy + 1);
+    memset(linha, 0, (size_t)(ind->colunas + 1) * (size_t)bins * sizeof(uint32_t));
+    int y0 = cy * c, y1 = y0 + c < ind->img.altura ? y0 + c : ind->img.altura;
+    for (int y = y0; y < y1; y++) {
+        const uint8_t* p = ind->img.pixels + (size_t)y * ind->img.stride;
+        for (int cx = 0; cx < ind->colunas; cx++) {
+            uint32_t* h = linha + (size_t)(cx + 1) * bins;
+            int x1 = (cx + 1) * c < w ? (cx + 1) * c : w;
+            for (int x = cx * c; x < x1; x++) h[p[x] >> desloc]++;
+        }
+    }
+    for (int cx = 1; cx <= ind->colunas; cx++) {
+        uint32_t* h = linha + (size_t)cx * bins;
+        const uint32_t* ant = h - bins;
+        for (int b = 0; b < bins; b++) h[b] += ant[b];
+    }
+}
+
+typedef struct {
+    const ProcimgIndiceHistograma* ind;
+    int n_faixas;
+} ContextoIndiceColunas;
+
+// Faixa de colunas do vetor de cada linha: acumula de cima para baixo
+static void tarefa_indice_colunas(void* data, int faixa) {
+    ContextoIndiceColunas* ctx = (ContextoIndiceColunas*)data;
+    const ProcimgIndiceHistograma* ind = ctx->ind;
+    int i0, i1;
+    procimg_faixa_linhas((ind->colunas + 1) * ind->bins, ctx->n_faixas, faixa, &i0, &i1);
+    for (int cy = 2; cy <= ind->linhas; cy++) {
+        uint32_t* l = indice_linha(ind, cy);
+        const uint32_t* ant = indice_linha(ind, cy - 1);
+        for (int i = i0; i < i1; i++) l[i] += ant[i];
+    }
+}
+
+int procimg_indice_criar(const ProcimgImagem* img, int bins, int celula, ProcimgIndiceHistograma** indice) {
+    if (!indice) return PROCIMG_ERRO_ARGUMENTO;
+    *indice = NULL;
+    if (!imagem_valida(img) || bins < 1 || bins > 256 || (bins & (bins - 1)) != 0 || celula < 0) {
+        return PROCIMG_ERRO_ARGUMENTO;
+    }
+    if (img->formato != PROCIMG_CINZA8) return PROCIMG_ERRO_FORMATO;
+    if (celula == 0) {
+        celula = INDICE_CELULA_MIN;
+        while (celula < INDICE_CELULA_MAX &&
+               indice_bytes(img->largura, img->altura, bins, celula) > PROCIMG_INDICE_MEMORIA_PADRAO) {
+            celula *= 2;
+        }
+    }
+
+    ProcimgIndiceHistograma* ind = (ProcimgIndiceHistograma*)calloc(1, sizeof(*ind));
+    if (!ind) return PROCIMG_ERRO_MEMORIA;
+    ind->img = *img;
+    ind->bins = bins;
+    while ((256 >> ind->desloc) > bins) ind->desloc++;
+    ind->celula = celula;
+    ind->colunas = (img->largura + celula - 1) / celula;
+    ind->linhas = (img->altura + celula - 1) / celula;
+    ind->bytes = indice_bytes(img->largura, img->altura, bins, celula);
+    ind->integral = (uint32_t*)memoria_obter(ind->bytes);
+    if (!ind->integral) {
+        free(ind);
+        return PROCIMG_ERRO_MEMORIA;
+    }
+
+    // Linha 0 (borda de cima) é zero; cada linha de células é independente, depois as colunas se acumulam
+    memset(ind->integral, 0, (size_t)(ind->colunas + 1) * (size_t)bins * sizeof(uint32_t));
+    procimg_paralelo_para(ind->linhas, tarefa_indice_linha, ind);
+    ContextoIndiceColunas ctx;
+    ctx.ind = ind;
+    ctx.n_faixas = procimg_threads();
+    if (ctx.n_faixas > (ind->colunas + 1) * bins / 64) ctx.n_faixas = (ind->colunas + 1) * bins / 64;
+    if (ctx.n_faixas < 1) ctx.n_faixas = 1;
+    procimg_paralelo_para(ctx.n_faixas, tarefa_indice_colunas, &ctx);
+
+    *indice = ind;
+    return PROCIMG_OK;
+}
+
+void procimg_indice_destruir(ProcimgIndiceHistograma* indice) {
+    if (!indice) return;
+    memoria_devolver(indice->integral, indice->bytes);
+    free(indice);
+}
+
+void procimg_indice_info(const ProcimgIndiceHistograma* indice, int* bins, int* celula, size_t* bytes) {
+    if (bins) *bins = indice ? indice->bins : 0;
+    if (celula) *celula = indice ? indice->celula : 0;
+    if (bytes) *bytes = indice ? indice->bytes : 0;
+}
+
+// hist += células [cx0, cx1) x [cy0, cy1), pelos quatro cantos
+static void indice_somar_celulas(const ProcimgIndiceHistograma* ind, int cx0, int cy0, int cx1, int cy1,
+                                 uint64_t* hist) {
+    int bins = ind->bins;
+    const uint32_t* a = indice_linha(ind, cy0) + (size_t)cx0 * bins;
+    const uint32_t* b = indice_linha(ind, cy0) + (size_t)cx1 * bins;
+    const uint32_t* c = indice_linha(ind, cy1) + (size_t)cx0 * bins;
+    const uint32_t* d = indice_linha(ind, cy1) + (size_t)cx1 * bins;
+    for (int i = 0; i < bins; i++) hist[i] += (uint32_t)(d[i] - b[i] - c[i] + a[i]);
+}
+
+// hist += pixels de [x0, x1) x [y0, y1)
+static void indice_somar_pixels(const ProcimgIndiceHistograma* ind, int x0, int y0, int x1, int y1,
+                                uint64_t* hist) {
+    for (int y = y0; y < y1; y++) {
+        const uint8_t* p = ind->img.pixels + (size_t)y * ind->img.stride;
+        for (int x = x0; x < x1; x++) hist[p[x] >> ind->desloc]++;
+    }
+}
+
+// Borda de célula mais próxima de 'pos' (para cima com 'teto', para baixo sem), entre 0 e n; o lado da imagem
+// conta como a borda n, mesmo com a última célula parcial
+static int indice_borda(int pos, int lado, int celula, int n, int modo) {
+    if (pos >= lado) return n;
+    int b = modo > 0 ? (pos + celula - 1) / celula : modo < 0 ? pos / celula : (pos + celula / 2) / celula;
+    return b > n ? n : b;
+}
+
+static int indice_pos(int borda, int lado, int celula) {
+    return borda * celula < lado ? borda * celula : lado;
+}
+
+int procimg_indice_consultar(const ProcimgIndiceHistograma* indice, int x, int y, int largura, int altura, int exato,
+                             uint64_t* hist) {
+    if (!indice || !hist) return PROCIMG_ERRO_ARGUMENTO;
+    const ProcimgIndiceHistograma* ind = indice;
+    memset(hist, 0, (size_t)ind->bins * sizeof(uint64_t));
+
+    // Recorte à imagem
+    int x1 = x + largura, y1 = y + altura;
+    if (x < 0) x = 0;
+    if (y < 0) y = 0;
+    if (x1 > ind->img.largura) x1 = ind->img.largura;
+    if (y1 > ind->img.altura) y1 = ind->img.altura;
+    if (x1 <= x || y1 <= y) return PROCIMG_OK;
+
+    int c = ind->celula, w = ind->img.largura, h = ind->img.altura;
+    if (!exato) {
+        int cx0 = indice_borda(x, w, c, ind->colunas, 0), cx1 = indice_borda(x1, w, c, ind->colunas, 0);
+        int cy0 = indice_borda(y, h, c, ind->linhas, 0), cy1 = indice_borda(y1, h, c, ind->linhas, 0);
+        // Pelo menos uma célula em cada eixo
+        if (cx1 <= cx0) { cx1 = cx0 + 1 <= ind->colunas ? cx0 + 1 : ind->colunas; cx0 = cx1 - 1; }
+        if (cy1 <= cy0) { cy1 = cy0 + 1 <= ind->linhas ? cy0 + 1 : ind->linhas; cy0 = cy1 - 1; }
+        indice_somar_celulas(ind, cx0, cy0, cx1, cy1, hist);
+        return PROCIMG_OK;
+    }
+
+    // Células inteiras dentro do retângulo pelo índice; o que sobra nas bordas, pixel a pixel
+    int cx0 = indice_borda(x, w, c, ind->colunas, 1), cx1 = indice_borda(x1, w, c, ind->colunas, -1);
+    int cy0 = indice_borda(y, h, c, ind->linhas, 1), cy1 = indice_borda(y1, h, c, ind->linhas, -1);
+    if (cx1 <= cx0 || cy1 <= cy0) {
+        indice_somar_pixels(ind, x, y, x1, y1, hist);
+        return PROCIMG_OK;
+    }
+    int px0 = indice_pos(cx0, w, c), px1 = indice_pos(cx1, w, c);
+    int py0 = indice_pos(cy0, h, c), py1 = indice_pos(cy1, h, c);
+    indice_somar_celulas(ind, cx0, cy0, cx1, cy1, hist);
+    indice_somar_pixels(ind, x, y, x1, py0, hist);        // faixa de cima
+    indice_somar_pixels(ind, x, py1, x1, y1, hist);       // de baixo
+    indice_somar_pixels(ind, x, py0, px0, py1, hist);     // esquerda
+    indice_somar_pixels(ind, px1, py0, x1, py1, hist);    // direita
+    return PROCIMG_OK;
+}
@@ -0,0 +1,230 @@
+// Universidade Presbiteriana Mackenzie – Computação Visual – Projeto 1
+//
+// procimg: o núcleo de processamento do projeto como biblioteca em C puro, sem SDL. Escala de cinza,
+// histograma, estatísticas, LUT de equalização, equalização (também em 16 bits), CLAHE e histogramas de
+// regiões trabalham direto sobre a memória do chamador (ponteiro, largura, altura, stride e formato), sem
+// cópias; o destino pode ser a própria origem. As funções dividem a imagem em faixas de linhas e as executam
+// em um pool de threads interno, criado no primeiro uso, e escolhem o kernel SIMD pela CPU em que estão rodando.
+//
+// Compilação como biblioteca estática:
+//   gcc -std=c99 -O2 -Wall -Wextra -c procimg.c && ar rcs libprocimg.a procimg.o
+//   (fora do Windows, quem liga com a biblioteca também precisa de -lpthread -lm)
+//
+// Uso a partir de C++: o cabeçalho já declara tudo como extern "C".
+
+#ifndef PROCIMG_H
+#define PROCIMG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    PROCIMG_CINZA8,    // 1 byte por pixel: intensidade
+    PROCIMG_RGB24,     // bytes R, G, B
+    PROCIMG_RGBA32,    // bytes R, G, B, A
+    PROCIMG_BGRA32,    // bytes B, G, R, A
+    PROCIMG_CINZA16    // 2 bytes por pixel: intensidade em uint16_t na ordem da CPU (ponteiro e stride pares)
+} ProcimgFormato;
+
+// Retornos: 0 em sucesso, negativo em erro
+enum {
+    PROCIMG_OK = 0,
+    PROCIMG_ERRO_ARGUMENTO = -1,   // ponteiro nulo, tamanho inválido, stride menor que a linha ou tamanhos diferentes
+    PROCIMG_ERRO_FORMATO = -2,     // formato que a operação não aceita
+    PROCIMG_ERRO_MEMORIA = -3
+};
+
+// Descreve uma imagem do chamador. A biblioteca não guarda o ponteiro depois que a função retorna.
+typedef struct {
+    uint8_t* pixels;
+    int largura, altura;
+    int stride;                    // bytes do início de uma linha ao início da próxima
+    ProcimgFormato formato;
+} ProcimgImagem;
+
+static inline ProcimgImagem procimg_imagem(void* pixels, int largura, int altura, int stride, ProcimgFormato formato) {
+    ProcimgImagem img;
+    img.pixels = (uint8_t*)pixels;
+    img.largura = largura;
+    img.altura = altura;
+    img.stride = stride;
+    img.formato = formato;
+    return img;
+}
+
+//-------------------------------------------------------------------------------------------------------------------------
+// Operações
+
+// Converte 'src' (qualquer formato de 8 bits por canal) para intensidade em 'dst' (CINZA8, mesmo tamanho), com
+// Y = 0.2125R + 0.7154G + 0.0721B. 'dst' pode ocupar os mesmos bytes de 'src' com o mesmo stride: cada linha
+// em cinza fica no começo da linha colorida. Opcionais (NULL para pular): 'alfa' (CINZA8) recebe o canal A
+// de origens RGBA32/BGRA32, e 'hist' recebe o histograma do resultado, somado na mesma passada.
+int procimg_escala_de_cinza(const ProcimgImagem* src, const ProcimgImagem* dst, const ProcimgImagem* alfa,
+                            uint64_t hist[256]);
+
+// Histograma de uma imagem CINZA8
+int procimg_histograma(const ProcimgImagem* img, uint64_t hist[256]);
+
+// Média e desvio padrão das intensidades descritas pelo histograma
+void procimg_estatisticas(const uint64_t hist[256], double* media, double* desvio);
+
+// O mesmo para um histograma de 'bins' bins (potência de 2 até 256), cada um valendo pelo centro da sua faixa
+// de intensidades
+void procimg_estatisticas_bins(const uint64_t* hist, int bins, double* media, double* desvio);
+
+// LUT de equalização pela distribuição cumulativa do histograma (identidade se houver uma intensidade só)
+void procimg_lut_equalizacao(const uint64_t hist[256], uint8_t lut[256]);
+
+// dst = lut[src] para imagens CINZA8 do mesmo tamanho; src e dst podem ser a mesma imagem
+int procimg_aplicar_lut(const ProcimgImagem* src, const ProcimgImagem* dst, const uint8_t lut[256]);
+
+// Equalização completa de uma imagem CINZA8 (histograma, LUT e aplicação); src e dst podem ser a mesma
+// imagem. Opcionais: o histograma de entrada e o de saída (derivado do de entrada, sem nova varredura).
+int procimg_equalizar(const ProcimgImagem* src, const ProcimgImagem* dst, uint64_t hist_original[256],
+                      uint64_t hist_equalizado[256]);
+
+// CLAHE (equalização adaptativa com contraste limitado) de uma imagem CINZA8: a imagem é dividida em uma grade
+// de blocos_x x blocos_y blocos, cada bloco é equalizado pelo próprio histograma e as LUTs dos blocos vizinhos
+// são interpoladas bilinearmente. 'limite' corta cada bin do bloco em limite x (pixels do bloco / 256) antes
+// da equalização, o que segura a amplificação de ruído em regiões lisas (valores usuais de 2 a 4; <= 0 não
+// corta). Grades maiores que 256 ou que a própria imagem são reduzidas. src e dst podem ser a mesma imagem.
+int procimg_clahe(const ProcimgImagem* src, const ProcimgImagem* dst, int blocos_x, int blocos_y, double limite);
+
+//-------------------------------------------------------------------------------------------------------------------------
+// 16 bits: imagens CINZA16 são medidas e equalizadas sem perder a faixa dinâmica, com histogramas de
+// PROCIMG_BINS16 bins e LUTs de PROCIMG_BINS16 entradas. A redução para 8 bits fica para o fim (exibição ou
+// gravação em formatos de 8 bits), por uma LUT que já pode embutir o mapeamento.
+
+#define PROCIMG_BINS16 65536
+
+// Histograma de uma imagem CINZA16 ('hist' com PROCIMG_BINS16 entradas), com um parcial de 256 KiB por thread
+int procimg_histograma16(const ProcimgImagem* img, uint64_t* hist);
+
+// Média e desvio padrão (escala 0 a 65535) de um histograma de PROCIMG_BINS16 bins
+void procimg_estatisticas16(const uint64_t* hist, double* media, double* desvio);
+
+// LUT de equalização de 16 bits ('lut' com PROCIMG_BINS16 entradas, saída de 0 a 65535)
+void procimg_lut_equalizacao16(const uint64_t* hist, uint16_t* lut);
+
+// dst = lut[src] para imagens CINZA16 do mesmo tamanho; src e dst podem ser a mesma imagem
+int procimg_aplicar_lut16(const ProcimgImagem* src, const ProcimgImagem* dst, const uint16_t* lut);
+
+// Equalização completa de uma imagem CINZA16; src e dst podem ser a mesma imagem. Opcionais: os histogramas de
+// entrada e de saída (PROCIMG_BINS16 entradas cada).
+int procimg_equalizar16(const ProcimgImagem* src, const ProcimgImagem* dst, uint64_t* hist_original,
+                        uint64_t* hist_equalizado);
+
+// Redução para 8 bits: dst (CINZA8) = lut[src (CINZA16)], com 'lut' de PROCIMG_BINS16 entradas. 'dst' pode ocupar
+// os mesmos bytes de 'src' com o mesmo stride. 'hist' (opcional) recebe o histograma do resultado.
+int procimg_reduzir16(const ProcimgImagem* src, const ProcimgImagem* dst, const uint8_t* lut, uint64_t hist[256]);
+
+// LUT de redução que estica [minimo, maximo] linearmente sobre 0 a 255 (fora da janela, satura; janela vazia
+// usa a faixa inteira de 0 a 65535)
+void procimg_lut_janela16(int minimo, int maximo, uint8_t* lut);
+
+//-------------------------------------------------------------------------------------------------------------------------
+// Histograma de regiões: índice de histograma integral por células. Para cada canto de célula (lado 'celula'
+// pixels) o índice guarda o histograma acumulado de tudo acima e à esquerda, então o histograma de qualquer
+// retângulo de células sai de quatro consultas, em O(bins), qualquer que seja o tamanho da região.
+
+typedef struct ProcimgIndiceHistograma ProcimgIndiceHistograma;
+
+// Monta o índice de uma imagem CINZA8 em paralelo. 'bins' (potência de 2 até 256) agrupa intensidades vizinhas
+// para gastar menos memória; 'celula' 0 escolhe o menor lado (a partir de 8) que cabe em
+// PROCIMG_INDICE_MEMORIA_PADRAO. A imagem precisa continuar válida e sem mudanças enquanto o índice existir:
+// as consultas exatas leem os pixels das bordas.
+#define PROCIMG_INDICE_MEMORIA_PADRAO ((size_t)64 << 20)
+int procimg_indice_criar(const ProcimgImagem* img, int bins, int celula, ProcimgIndiceHistograma** indice);
+void procimg_indice_destruir(ProcimgIndiceHistograma* indice);
+
+// Bins, lado da célula e memória ocupada (qualquer ponteiro pode ser NULL)
+void procimg_indice_info(const ProcimgIndiceHistograma* indice, int* bins, int* celula, size_t* bytes);
+
+// Histograma (com 'bins' entradas) do retângulo (x, y, largura, altura), recortado à imagem. Com 'exato', as
+// faixas da borda que não cobrem células inteiras são varridas pixel a pixel (custo proporcional ao perímetro
+// vezes a célula, não à área); sem 'exato', o retângulo é arredondado para as bordas de célula mais próximas
+// e a consulta custa só O(bins).
+int procimg_indice_consultar(const ProcimgIndiceHistograma* indice, int x, int y, int largura, int altura, int exato,
+                             uint64_t* hist);
+
+//-------------------------------------------------------------------------------------------------------------------------
+// Configuração
+
+// Limite de threads (workers + quem chama); 0 = um por núcleo lógico. Vale a partir do próximo início do pool.
+void procimg_definir_threads(int n);
+
+// Quantas threads participam de cada operação (inicia o pool, se preciso)
+int procimg_threads(void);
+
+// Encerra o pool; o próximo uso cria outro
+void procimg_encerrar(void);
+
+// Memória de trabalho (histogramas parciais das faixas, LUTs do CLAHE, índices de histograma). O padrão é
+// malloc alinhado a 64 bytes; 'obter' deve devolver memória alinhada a 64. NULL restaura o padrão.
+void procimg_definir_alocador(void* (*obter)(size_t n), void (*devolver)(void* p, size_t n));
+
+// Nome do kernel de escala de cinza escolhido para esta CPU ("avx2", "sse2" ou "escalar")
+const char* procimg_kernel_cinza(void);
+
+//-------------------------------------------------------------------------------------------------------------------------
+// Blocos para quem monta passadas próprias sobre o mesmo pool (por exemplo, converter e analisar numa passada só)
+
+typedef void (*ProcimgTarefa)(void* ctx, int faixa);
+
+// Executa fn(ctx, i) para i em [0, n_faixas) no pool; retorna quando todas terminarem. Se o pool já estiver
+// ocupado por outra chamada, as faixas rodam na thread que chamou.
+void procimg_paralelo_para(int n_faixas, ProcimgTarefa fn, void* ctx);
+
+// Número de faixas de linhas que compensa para uma imagem desse tamanho
+int procimg_faixas(int largura, int altura);
+
+// Linhas [*y0, *y1) da faixa 'faixa' de 'n_faixas'
+static inline void procimg_faixa_linhas(int altura, int n_faixas, int faixa, int* y0, int* y1) {
+    *y0 = (int)((int64_t)altura * faixa / n_faixas);
+    *y1 = (int)((int64_t)altura * (faixa + 1) / n_faixas);
+}
+
+// Kernel de uma linha colorida -> intensidade, o melhor para a CPU atual; NULL para CINZA8 e CINZA16
+typedef void (*ProcimgCinzaLinha)(const uint8_t* src, uint8_t* dst, int largura);
+ProcimgCinzaLinha procimg_cinza_linha(ProcimgFormato formato);
+
+// Coeficientes da fórmula em ponto fixo Q15; somam exatamente 1 << 15, então um pixel que já é cinza (R=G=B)
+// mantém a mesma intensidade
+#define PROCIMG_CINZA_FRAC 15
+#define PROCIMG_CINZA_R 6963
+#define PROCIMG_CINZA_G 23442
+#define PROCIMG_CINZA_B 2363
+
+// Referência escalar: todos os kernels SIMD dão exatamente este resultado
+static inline uint8_t procimg_luma(uint8_t r, uint8_t g, uint8_t b) {
+    return (uint8_t)((PROCIMG_CINZA_R * r + PROCIMG_CINZA_G * g + PROCIMG_CINZA_B * b +
+                      (1 << (PROCIMG_CINZA_FRAC - 1))) >> PROCIMG_CINZA_FRAC);
+}
+
+// Histograma de uma faixa: cópias separadas para pixels vizinhos, para que áreas lisas não incrementem o
+// mesmo contador em sequência. 4 KiB por parcial (múltiplo da linha de cache).
+#define PROCIMG_HIST_COPIAS 4
+
+typedef struct {
+    uint32_t c[PROCIMG_HIST_COPIAS][256];
+} ProcimgHistogramaParcial;
+
+// Soma uma linha CINZA8 no parcial (que começa zerado pelo chamador)
+void procimg_histograma_linha(const uint8_t* linha, int largura, ProcimgHistogramaParcial* parcial);
+
+// Um parcial por faixa, alinhados a 64 bytes, com o alocador configurado
+ProcimgHistogramaParcial* procimg_parciais_alocar(int n_faixas);
+void procimg_parciais_liberar(ProcimgHistogramaParcial* parciais, int n_faixas);
+
+// hist += soma dos parciais
+void procimg_parciais_somar(const ProcimgHistogramaParcial* parciais, int n_faixas, uint64_t hist[256]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PROCIMG_H